@@ -0,0 +1,22 @@
+#ifndef CPUID_H
+#define CPUID_H
+
+#include <stdint.h>
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    uint32_t a, b, c, d;
+    __asm__ volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(subleaf));
+    if (eax) *eax = a;
+    if (ebx) *ebx = b;
+    if (ecx) *ecx = c;
+    if (edx) *edx = d;
+}
+
+// Highest supported extended leaf (0x8000xxxx)
+static inline uint32_t cpuid_max_ext(void) {
+    uint32_t a;
+    cpuid(0x80000000, 0, &a, 0, 0, 0);
+    return a;
+}
+
+#endif
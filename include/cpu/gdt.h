@@ -37,7 +37,17 @@ struct tss_entry {
 
 extern struct tss_entry tss;
 
+// Interrupt stack table slot of the double-fault handler. A kernel stack overflow faults on the
+// guard page with no stack left to push the frame on, so #DF needs a known-good stack of its own.
+#define TSS_IST_DOUBLE_FAULT 1
+// NMI and machine check can arrive between syscall and its stack switch, still on the user stack
+#define TSS_IST_NMI 2
+#define TSS_IST_MACHINE_CHECK 3
+
 void gdt_init();
+// Give application processor `cpu` (1..SMP_MAX_CPUS-1) its own GDT and TSS and load them
+void gdt_init_cpu(int cpu);
+// Ring-0 stack the calling CPU switches to on an interrupt from user mode
 void tss_set_stack(uint64_t rsp0);
 
 #endif
\ No newline at end of file
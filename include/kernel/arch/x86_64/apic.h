@@ -0,0 +1,47 @@
+#ifndef DANOS_APIC_H
+#define DANOS_APIC_H
+
+#include <stdint.h>
+
+// Vectors owned by the local APIC, above the remapped PIC range (32-47)
+#define LAPIC_TIMER_VECTOR    48
+#define LAPIC_RESCHED_VECTOR  49    // IPI: run the scheduler on the target CPU
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Enable the calling CPU's local APIC. The first call (on the BSP) also maps its registers
+// uncached and measures the APIC timer against the TSC. Returns 0 on success, -1 if the CPU has no APIC.
+int lapic_init(void);
+
+// Non-zero once lapic_init succeeded on the BSP
+int lapic_present(void);
+
+// APIC ID of the calling CPU
+uint32_t lapic_id(void);
+
+// Acknowledge the interrupt being serviced
+void lapic_eoi(void);
+
+// Inter-processor interrupts used to start an application processor: INIT puts it in
+// wait-for-SIPI, STARTUP makes it execute real-mode code at page `vector` (address vector << 12).
+// Both wait for the ICR to report delivery.
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uint8_t vector);
+
+// Send `vector` to the CPU with APIC ID `apic_id`
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// The APIC timer as a one-shot clock event on LAPIC_TIMER_VECTOR. TSC-deadline mode is used when
+// the CPU has it, otherwise one-shot mode with a count converted from TSC cycles.
+// Set the calling CPU's timer up in that mode, stopped
+void lapic_timer_init(void);
+
+// Raise LAPIC_TIMER_VECTOR once the TSC reaches `deadline` (at once if it already has). 0 stops the timer.
+void lapic_timer_arm(uint64_t deadline);
+
+// APIC timer frequency after the divider, in kHz (0 if not calibrated)
+uint64_t lapic_timer_khz(void);
+
+// Non-zero when the timer runs in TSC-deadline mode
+int lapic_timer_tsc_deadline(void);
+
+#endif // DANOS_APIC_H
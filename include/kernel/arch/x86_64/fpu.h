@@ -0,0 +1,55 @@
+#ifndef DANOS_FPU_H
+#define DANOS_FPU_H
+
+#include <stdint.h>
+
+// Extended register state (x87, SSE, AVX) of one task. A task gets its save area on its first
+// FPU instruction, so threads that never touch the FPU cost nothing. A zeroed fpu_ctx_t is valid.
+typedef struct fpu_ctx {
+    uint8_t *area;          // XSAVE or FXSAVE image, NULL until first use
+} fpu_ctx_t;
+
+typedef struct {
+    int xsave;              // XSAVE/XRSTOR in use, FXSAVE/FXRSTOR otherwise
+    int xsaveopt;           // saves skip components the task did not modify
+    uint64_t xcr0;          // state components enabled (bit 0 x87, 1 SSE, 2 AVX)
+    uint32_t area_size;
+    uint64_t traps;         // #NM exceptions taken
+    uint64_t restores;      // state loaded from a save area
+    uint64_t saves;         // state written back to a save area
+    uint64_t reuses;        // switches to a task whose state was still in the registers
+    uint64_t kernel_sections;   // outermost kernel_fpu_begin calls
+} fpu_stats_t;
+
+// Enable the FPU, SSE and (when present) XSAVE/AVX on the boot CPU, with CR0.TS set so the first
+// FPU instruction of each task traps (#NM) and loads its state. Needs the kernel heap.
+void fpu_init(void);
+
+// Same setup on an application processor, after fpu_init ran on the BSP
+void fpu_init_cpu(void);
+
+// Non-zero once fpu_init has run
+int fpu_ready(void);
+
+// Context switch on the calling CPU, interrupts disabled: save prev's registers if it used the
+// FPU during its slice, then leave CR0.TS set unless next's state is still loaded here
+void fpu_switch(fpu_ctx_t *prev, fpu_ctx_t *next);
+
+// #NM handler: load the state of the running task (`cur`, NULL before the scheduler runs)
+void fpu_trap(fpu_ctx_t *cur);
+
+// Give a fork child a copy of the parent's state. Returns 0, or -1 when out of memory.
+int fpu_fork(fpu_ctx_t *child, fpu_ctx_t *parent);
+
+// Free the state of a task that is off every CPU for good
+void fpu_release(fpu_ctx_t *ctx);
+
+// Bracket kernel code that uses SSE/AVX registers; only valid when fpu_ready(). Interrupts stay
+// off in between, and the interrupted task's state is saved first. Sections may nest. The kernel
+// is built with -mno-sse, so vector code inside a section has to be written in inline assembly.
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+void fpu_get_stats(fpu_stats_t *out);
+
+#endif // DANOS_FPU_H
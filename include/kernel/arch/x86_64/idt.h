@@ -29,9 +29,16 @@ typedef struct {
 // Initialize the IDT
 void idt_init(void);
 
+// Load the IDT built by idt_init on an application processor
+void idt_init_cpu(void);
+
 // Set an IDT gate
 void idt_set_gate(uint8_t num, uint64_t handler, uint16_t selector, uint8_t flags);
 
+// Route legacy PIC line `irq` (0-15) to `handler` and unmask it. Returns 0, or -1 if the line is
+// out of range or already taken.
+int irq_install_handler(uint8_t irq, void (*handler)(void));
+
 // ISR handlers (defined in interrupts.asm)
 extern void isr0(void);
 extern void isr1(void);
@@ -83,5 +90,10 @@ extern void irq12(void);
 extern void irq13(void);
 extern void irq14(void);
 extern void irq15(void);
+extern void irq16(void);    // local APIC timer
+extern void irq17(void);    // local APIC spurious
+extern void irq18(void);    // reschedule IPI
+extern void irq19(void);    // yield
+extern void irq20(void);    // preempt
 
 #endif // IDT_H
@@ -0,0 +1,38 @@
+#ifndef DANOS_KSTACK_H
+#define DANOS_KSTACK_H
+
+#include <stdint.h>
+
+// Kernel stacks are 2^KSTACK_ORDER pages: 2 for 16 KiB, 3 for 32 KiB
+#ifndef KSTACK_ORDER
+#define KSTACK_ORDER 2
+#endif
+#define KSTACK_SIZE (4096UL << KSTACK_ORDER)
+
+// Stacks each CPU keeps for reuse before handing them to the shared pool
+#define KSTACK_CACHE 8
+
+typedef struct {
+    uint64_t created;       // stacks mapped so far (they are recycled, never unmapped)
+    uint64_t in_use;
+    uint64_t cached;        // sitting in the per-CPU caches
+    uint64_t pooled;        // sitting in the shared pool
+    uint64_t cache_hits;    // allocations served from the calling CPU's cache
+    uint64_t pool_hits;     // allocations served from the shared pool
+} kstack_stats_t;
+
+// Allocate a KSTACK_SIZE kernel stack in the kernel half, with an unmapped guard page right
+// below it so an overflow faults instead of overwriting memory. Returns the lowest address of
+// the stack (the top is base + KSTACK_SIZE), or NULL when out of memory. The stack is not
+// identity mapped: never hand buffers living on it to a device for DMA.
+void *kstack_alloc(void);
+
+// Return a stack from kstack_alloc. It must no longer be in use by any CPU.
+void kstack_free(void *base);
+
+// Non-zero when addr lies in the guard page of a kernel stack
+int kstack_is_guard(uint64_t addr);
+
+void kstack_get_stats(kstack_stats_t *out);
+
+#endif // DANOS_KSTACK_H
@@ -0,0 +1,68 @@
+#ifndef DANOS_MM_H
+#define DANOS_MM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/fs/fat32.h>
+
+// A range of user address space whose pages are created on first touch.
+// Pages inside [file_va, file_end) are filled from the backing file, the rest are zero-filled.
+typedef struct vm_region {
+    struct vm_region *next;
+    uint64_t start;         // page aligned
+    uint64_t end;           // page aligned, exclusive
+    uint64_t pte_flags;     // flags of the pages mapped for this region (VMM_PFLAG_*)
+    uint64_t file_va;       // first byte backed by the file
+    uint64_t file_end;      // end of the file-backed bytes
+    uint32_t file_offset;   // file offset of file_va
+    int has_file;
+    fat32_file_t file;      // handle of the backing file, positioned at 0
+} vm_region_t;
+
+// Per address space bookkeeping for demand paging
+typedef struct mm {
+    struct mm *next;
+    uint64_t cr3;           // page table root (no PCID bits)
+    vm_region_t *regions;
+    uint64_t faults;        // pages brought in on demand
+    uint64_t cow_faults;    // writes to pages shared with a fork parent or child
+} mm_t;
+
+// Create the descriptor for the address space rooted at cr3. Returns NULL on failure.
+mm_t *mm_create(uint64_t cr3);
+
+// Descriptor of the address space rooted at cr3 (PCID bits ignored), or NULL
+mm_t *mm_find(uint64_t cr3);
+
+// Register a lazily populated region [start, end) inside one user window (see vmm.h).
+// `file` may be NULL for a zero-filled region. Returns 0 on success, -1 on failure.
+int mm_add_region(mm_t *mm, uint64_t start, uint64_t end, uint64_t pte_flags,
+                  const fat32_file_t *file, uint64_t file_va, uint64_t file_end, uint32_t file_offset);
+
+// Descriptor for the fork child rooted at cr3: same regions as `src`, with every page `src`
+// has mapped shared copy-on-write. Returns NULL on failure, leaving cr3's user half empty.
+mm_t *mm_fork(mm_t *src, uint64_t cr3);
+
+// Drop the descriptor and its regions (does not touch the page tables)
+void mm_destroy(mm_t *mm);
+
+// Page-fault hook: bring in the page at `addr` if it belongs to a lazy region of the
+// address space rooted at cr3, or copy it on a write to a copy-on-write page.
+// Returns 0 if the fault was resolved, -1 otherwise.
+int mm_handle_fault(uint64_t cr3, uint64_t addr, uint64_t error_code);
+
+// User memory access from syscalls. The kernel is mapped in every user table, so user buffers are
+// read and written in place; pages not yet present or still shared are handled by the fault handler.
+// Non-zero when [uaddr, uaddr+len) is covered by the current address space's regions (writable ones
+// if `write`). Always true on the kernel's own table, where callers pass kernel buffers.
+int mm_access_ok(const void *uaddr, size_t len, int write);
+
+// Copy len bytes to / from user memory of the current address space. Returns 0, or -1 on a bad range.
+int copy_to_user(void *udst, const void *src, size_t len);
+int copy_from_user(void *dst, const void *usrc, size_t len);
+
+// Copy the NUL-terminated user string at usrc into dst, which holds `max` bytes. Returns its
+// length, or -1 if part of it is not readable or it does not fit.
+int strncpy_from_user(char *dst, const char *usrc, size_t max);
+
+#endif // DANOS_MM_H
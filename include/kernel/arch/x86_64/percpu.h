@@ -0,0 +1,61 @@
+#ifndef DANOS_PERCPU_H
+#define DANOS_PERCPU_H
+
+// Per-CPU data block. In kernel mode GS_BASE points at the running CPU's block and
+// KERNEL_GS_BASE holds the user GS base; entry from user mode (syscall_entry and the interrupt
+// stubs) runs swapgs first, and the way back to user mode swaps again.
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+// Field offsets for the assembly entry paths. interrupts.asm (NASM) repeats the counter offsets.
+#define PERCPU_SELF          0
+#define PERCPU_KERNEL_RSP    8
+#define PERCPU_USER_RSP      16
+#define PERCPU_SYSCALL_FRAME 24
+#define PERCPU_CPU           32
+#define PERCPU_PREEMPT_COUNT 36
+#define PERCPU_CURRENT       40
+#define PERCPU_SYSCALLS      48
+#define PERCPU_IRQS          56
+#define PERCPU_EXCEPTIONS    64
+#define PERCPU_NEED_RESCHED  72
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+struct syscall_frame;
+
+// One cache line per CPU, so CPUs never share the lines of their entry state
+typedef struct percpu {
+    struct percpu *self;            // linear address of this block, read through %gs:0
+    uint64_t kernel_rsp;            // stack syscall_entry switches to (top of the task's kernel stack)
+    uint64_t user_rsp;              // user RSP while a syscall is being entered
+    struct syscall_frame *syscall_frame;    // frame of the syscall in progress
+    int32_t cpu;                    // smp_cpu_id()
+    volatile int32_t preempt_count; // of the running task, see preempt.h
+    void *current;                  // task running here (the scheduler's task_struct_t)
+    uint64_t syscalls;              // counted by the entry stubs
+    uint64_t irqs;
+    uint64_t exceptions;
+    volatile uint32_t need_resched; // switch tasks as soon as the running one may be preempted
+    uint32_t reserved;
+} __attribute__((aligned(64))) percpu_t;
+
+// Point GS_BASE at the block of `cpu`, on that CPU. Runs before anything calls this_cpu(), and
+// after the last segment load of GS, which would clear the base again.
+void percpu_init(int cpu);
+
+// Block of CPU `cpu`, for reading its counters from elsewhere
+percpu_t *percpu_of(int cpu);
+
+// Block of the calling CPU
+static inline percpu_t *this_cpu(void) {
+    percpu_t *p;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(p));
+    return p;
+}
+
+#endif // __ASSEMBLER__
+
+#endif // DANOS_PERCPU_H
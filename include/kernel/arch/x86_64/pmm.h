@@ -6,13 +6,49 @@
 
 #define PMM_PAGE_SIZE 4096
 
+// Largest buddy block is 2^PMM_MAX_ORDER pages (4 MiB)
+#define PMM_MAX_ORDER 10
+
 void pmm_init(void *multiboot_info, size_t memory_size);
 void *pmm_alloc_page(void);
+// Drop one owner of a page; it returns to the allocator once the last owner is gone
 void pmm_free_page(void *addr);
+
+// Add an owner to an allocated page (copy-on-write sharing). Returns 0 on success, -1 if the page
+// is not allocated or the count would overflow.
+int pmm_page_ref(void *addr);
+
+// Number of owners of a page: 0 if free or untracked, 1 if unshared
+uint32_t pmm_page_refcount(void *addr);
+
+// Allocate 2^order physically contiguous pages, aligned to the block size. Returns physical address or NULL.
+void *pmm_alloc_pages(unsigned int order);
+
+// Free a block previously returned by pmm_alloc_pages with the same order.
+// Pages of a block may also be released one at a time with pmm_free_page.
+void pmm_free_pages_order(void *addr, unsigned int order);
 size_t pmm_total_pages(void);
 size_t pmm_free_pages(void);
 
+// Usable RAM regions found in the Multiboot2 memory map, sorted by address.
+size_t pmm_region_count(void);
+// Get region i's physical base and size in pages. Returns 0 on success, -1 if i is out of range.
+int pmm_get_region(size_t i, uintptr_t *base, size_t *pages);
+
 // Find first zero bit (free page) starting at start_idx. Returns index or (size_t)-1 if none.
+// Scans 64 frames per step and skips the fully used low part of the bitmap via a next-fit cursor.
+// Reads the bitmap without the allocator lock: only meaningful while nothing else allocates.
 size_t ffs64_find_zero(size_t start_idx);
 
+// Allocator microbenchmark results (TSC cycles for `count` single-page allocations)
+typedef struct {
+    size_t count;
+    uint64_t bitscan_cycles;    // original search: one bit at a time from frame 0
+    uint64_t wordscan_cycles;   // ffs64_find_zero: 64 bits per step from the next-fit cursor
+    uint64_t buddy_cycles;      // pmm_alloc_page through the buddy free lists
+} pmm_bench_t;
+
+// Time `count` single-page allocations with each strategy. Leaves allocator state unchanged.
+void pmm_benchmark(size_t count, pmm_bench_t *out);
+
 #endif // DANOS_PMM_H
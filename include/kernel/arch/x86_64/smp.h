@@ -0,0 +1,29 @@
+#ifndef DANOS_SMP_H
+#define DANOS_SMP_H
+
+#include <stdint.h>
+
+#define SMP_MAX_CPUS 16
+
+// Record the processors the ACPI MADT lists, found through the RSDP copy in the Multiboot2 info.
+// Must run before pmm_init, which may hand out the memory holding that info.
+void smp_detect(void *multiboot_info);
+
+// Start every application processor found by smp_detect (INIT-SIPI-SIPI). Each sets up its own
+// GDT, TSS, local APIC and timers and then runs its own scheduler. Needs the BSP's local APIC
+// enabled, the TSC calibrated and the scheduler set up.
+void smp_init(void);
+
+// Index of the calling CPU: 0 for the BSP, then in MADT order
+int smp_cpu_id(void);
+
+// Number of CPUs running, the BSP included
+int smp_cpu_count(void);
+
+// Non-zero if CPU `cpu` has started
+int smp_cpu_online(int cpu);
+
+// Local APIC ID of CPU `cpu`
+uint32_t smp_cpu_apic_id(int cpu);
+
+#endif // DANOS_SMP_H
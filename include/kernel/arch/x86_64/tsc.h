@@ -0,0 +1,36 @@
+#ifndef DANOS_TSC_H
+#define DANOS_TSC_H
+
+#include <stdint.h>
+
+// Read the time-stamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Measure the TSC frequency against PIT channel 2. Safe to call again to re-calibrate.
+void tsc_init(void);
+
+// TSC frequency in kHz (0 if calibration failed)
+uint64_t tsc_khz(void);
+
+// Convert a cycle count to nanoseconds using the calibrated frequency
+uint64_t tsc_cycles_to_ns(uint64_t cycles);
+
+// Distribution of a set of cycle samples
+typedef struct {
+    uint32_t count;
+    uint64_t min;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+    uint64_t mean;
+} tsc_summary_t;
+
+// Sort `samples` in place and summarize them (all zero when count is 0)
+void tsc_summarize(uint64_t *samples, uint32_t count, tsc_summary_t *out);
+
+#endif // DANOS_TSC_H
@@ -8,22 +8,143 @@
 #define VMM_PFLAG_PRESENT  (1ULL << 0)
 #define VMM_PFLAG_WRITE    (1ULL << 1)
 #define VMM_PFLAG_USER     (1ULL << 2)
+#define VMM_PFLAG_PWT      (1ULL << 3)   // write-through
+#define VMM_PFLAG_PCD      (1ULL << 4)   // cache disabled, for device registers
+#define VMM_PFLAG_HUGE     (1ULL << 7)   // PS: leaf at the PD (2 MiB) or PDP (1 GiB) level
+#define VMM_PFLAG_GLOBAL   (1ULL << 8)   // kept in the TLB across CR3 loads (needs CR4.PGE)
+#define VMM_PFLAG_COW      (1ULL << 9)   // software bit: read-only only because the frame is shared
+
+// Address space split. Every user page table shares the kernel's mappings outside two user windows:
+//  [0, VMM_USER_BASE)                      kernel image and low identity map, supervisor only
+//  [VMM_USER_BASE, VMM_USER_IMAGE_END)     user window for program images; the PMM never hands out
+//                                          the frames behind these addresses, so the kernel does not
+//                                          miss their identity mapping while a user table is loaded
+//  [VMM_USER_IMAGE_END, VMM_USER_HIGH_BASE) identity map of the rest of RAM, supervisor only
+//  [VMM_USER_HIGH_BASE, VMM_USER_TOP)      user window for stacks and other mappings (PML4 1-255)
+//  [VMM_KERNEL_BASE, VMM_KSTACK_BASE)      kernel half (heap), shared through PML4 entries 256-511
+//  [VMM_KSTACK_BASE, ...)                  kernel stacks behind guard pages (kstack.h), same sharing
+#define VMM_USER_BASE       0x0000000000400000ULL
+#define VMM_USER_IMAGE_END  0x0000000001000000ULL
+#define VMM_USER_HIGH_BASE  0x0000008000000000ULL
+#define VMM_USER_TOP        0x0000800000000000ULL
+#define VMM_KERNEL_BASE     0xFFFF800000000000ULL
+#define VMM_KSTACK_BASE     0xFFFFC00000000000ULL
+
+// Non-zero when [va, va+len) lies inside one of the user windows
+static inline int vmm_is_user_range(uint64_t va, uint64_t len) {
+    uint64_t end = va + len;
+    if (end < va) return 0;
+    if (va >= VMM_USER_BASE && end <= VMM_USER_IMAGE_END) return 1;
+    return va >= VMM_USER_HIGH_BASE && end <= VMM_USER_TOP;
+}
+
+// CR3 layout with PCIDs: table address in bits 12-51, PCID in bits 0-11,
+// bit 63 on a write keeps the TLB entries tagged with that PCID
+#define VMM_CR3_ADDR_MASK  0x000ffffffffff000ULL
+#define VMM_CR3_PCID_MASK  0xFFFULL
+#define VMM_CR3_NOFLUSH    (1ULL << 63)
+
+// Live leaf counts of the active address space, plus large-page split totals
+typedef struct {
+    uint64_t pages_4k;
+    uint64_t pages_2m;
+    uint64_t pages_1g;
+    uint64_t table_pages;   // page-table pages reachable from CR3, PML4 included
+    uint64_t global_leaves; // leaves of any size carrying the Global bit
+    uint64_t splits_2m;     // 2 MiB leaves broken into 4 KiB pages
+    uint64_t splits_1g;     // 1 GiB leaves broken into 2 MiB pages
+    uint64_t invlpg_flushes;  // single-address invalidations issued
+    uint64_t full_flushes;    // whole-TLB flushes (CR3 reload or all-PCID flush)
+    uint64_t cow_shared;      // user pages shared by vmm_cow_share
+    uint64_t cow_copies;      // write faults that copied a shared frame
+    uint64_t cow_reuses;      // write faults that found the frame no longer shared
+    uint64_t cr3_switches;    // address-space switches prepared by vmm_pcid_cr3
+    uint64_t cr3_flushing;    // of those, CR3 loads that drop the target's non-global TLB entries
+    int gib_pages;          // CPU supports 1 GiB leaves
+    int global_pages;       // CR4.PGE is on and kernel leaves are marked global
+} vmm_stats_t;
 
 // Initialize virtual memory manager. Assumes paging already enabled by bootloader.
 void vmm_init(void);
 
+// Turn on the paging features vmm_init enabled on the BSP (CR0.WP, global pages, PCIDs) on the
+// calling application processor, which must be running on the kernel's table
+void vmm_init_cpu(void);
+
 // Map a single 4KiB page: vaddr -> paddr with flags (combination of VMM_PFLAG_*)
 int vmm_map_page(uint64_t vaddr, uint64_t paddr, uint64_t flags);
 
+// Map [va, va+len) -> [pa, pa+len) using the largest leaves alignment allows (1 GiB, 2 MiB, 4 KiB).
+// Large pages overlapping the range are split as needed. All three values must be 4 KiB aligned.
+// On failure nothing from this call stays mapped. Returns 0 on success, -1 on error.
+int vmm_map_range(uint64_t va, uint64_t pa, uint64_t len, uint64_t flags);
+
+// Same as vmm_map_range, in the page table rooted at target_cr3
+int vmm_map_range_in_table(uint64_t target_cr3, uint64_t va, uint64_t pa, uint64_t len, uint64_t flags);
+
+// Walk the active page tables and fill in leaf counts per size
+void vmm_get_stats(vmm_stats_t *st);
+
 // Unmap a single page at vaddr (does not free the physical page)
 int vmm_unmap_page(uint64_t vaddr);
 
-// Clone the top-level page table (copy-on-write not implemented; this does a shallow copy of entries)
+// Unmap [va, va+len) in the active address space with one TLB flush at the end: invlpg per leaf
+// for small ranges, a CR3 reload for large ones. Page tables left empty go back to the PMM,
+// as do the mapped frames when free_frames is set. Large pages partly inside the range are split.
+// Returns 0 on success, -1 on bad alignment or if a split ran out of memory.
+int vmm_unmap_range(uint64_t va, uint64_t len, int free_frames);
+
+// Same as vmm_unmap_range, in the page table rooted at target_cr3
+int vmm_unmap_range_in_table(uint64_t target_cr3, uint64_t va, uint64_t len, int free_frames);
+
+// Create the page table of a new user address space: the kernel half and the supervisor-only low
+// window are shared with the kernel's table, the user windows start empty. `src_cr3` is unused;
+// user pages are never copied here (fork shares them with vmm_cow_share). Returns 0 on failure.
 uint64_t vmm_clone_table(uint64_t src_cr3);
 
+// Unmap both user windows of the table rooted at cr3, freeing the frames when free_frames is set
+int vmm_unmap_user(uint64_t cr3, int free_frames);
+
+// Unmap the user windows (freeing their frames) and release the page table made by vmm_clone_table.
+// Must not be the active table.
+void vmm_destroy_table(uint64_t cr3);
+
+// Share every user-accessible 4 KiB page in the user windows of src_cr3 with dst_cr3. Writable
+// pages become read-only with VMM_PFLAG_COW in both tables, and every shared frame gains an owner.
+// Large user leaves are split first. Returns 0 on success, -1 when out of page-table memory
+// (pages already shared stay mapped in dst_cr3).
+int vmm_cow_share(uint64_t dst_cr3, uint64_t src_cr3);
+
+// Resolve a write to the copy-on-write page at va in the table rooted at target_cr3: copy the
+// frame if it is still shared, otherwise just make it writable again. Returns 0 on success,
+// -1 if the page is not copy-on-write or no frame is available.
+int vmm_cow_fault(uint64_t target_cr3, uint64_t va);
+
 // Map a page in a different page table (without switching CR3)
 int vmm_map_page_in_table(uint64_t target_cr3, uint64_t vaddr, uint64_t paddr, uint64_t flags);
 
+// Non-zero once CR4.PCIDE has been turned on by vmm_init
+int vmm_pcid_enabled(void);
+
+// CR3 value to load for the address space rooted at `cr3`. `pcid`/`gen` hold that address space's
+// tag and the generation it was issued in (both 0 for a new one) and are refreshed when stale.
+// Pass NULL for the kernel address space, which always uses PCID 0.
+uint64_t vmm_pcid_cr3(uint64_t cr3, uint16_t *pcid, uint32_t *gen);
+
+typedef struct {
+    uint32_t iterations;
+    uint32_t pages;          // working-set pages touched after every switch
+    uint64_t flush_cycles;   // average cycles per round trip with flushing CR3 writes
+    uint64_t nonglobal_cycles; // same with the working set's Global bit cleared (0 without PGE)
+    uint64_t pcid_cycles;    // same with PCID-tagged, no-flush CR3 writes (0 if unsupported)
+    int pcid_enabled;
+} vmm_cr3_bench_t;
+
+// Time `iterations` round trips between the kernel address space and a copy of it,
+// touching `pages` heap pages after each switch. Runs with interrupts disabled.
+// The heap is mapped global, so flushing switches are also timed with its Global bit cleared.
+void vmm_cr3_benchmark(uint32_t iterations, uint32_t pages, vmm_cr3_bench_t *out);
+
 // Get current CR3
 uint64_t vmm_get_cr3(void);
 
@@ -159,6 +159,19 @@ int net_send_ethernet(net_interface_t* iface, const mac_addr_t* dest,
 // Process received Ethernet frame
 void net_receive_ethernet(net_interface_t* iface, const void* data, size_t len);
 
+// Longest a net_wait caller sleeps before polling the interface again, should a receive
+// interrupt never come
+#define NET_POLL_NS 10000000ULL     // 10 ms
+
+// Block until cond(arg) holds or timeout_ns has passed, processing received frames in between.
+// The caller gives up the CPU while nothing arrives and is woken by net_rx_notify.
+// Returns 1 if cond held, 0 on timeout.
+int net_wait(int (*cond)(void* arg), void* arg, uint64_t timeout_ns);
+
+// Called by a driver's interrupt handler when frames are waiting: wakes the net_wait callers,
+// which process them in task context
+void net_rx_notify(void);
+
 // =============================================================================
 // ARP FUNCTIONS
 // =============================================================================
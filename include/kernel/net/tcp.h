@@ -103,6 +103,14 @@ int tcp_data_available(int conn_id);
 // Check if connection closed by remote
 int tcp_is_closed(int conn_id);
 
+// Block until the handshake completes or the connection is refused, for at most timeout_ns.
+// Returns 1 if the connection is established.
+int tcp_wait_connected(int conn_id, uint64_t timeout_ns);
+
+// Block until the connection has data to read or is closed, for at most timeout_ns.
+// Returns 1 if tcp_recv has data or the connection is closed, 0 on timeout.
+int tcp_wait_readable(int conn_id, uint64_t timeout_ns);
+
 // Process received TCP packet (called by IPv4 handler)
 void tcp_receive(net_interface_t* iface, uint32_t src_ip, 
                  const tcp_header_t* tcp, size_t len);
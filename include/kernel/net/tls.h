@@ -128,6 +128,13 @@ typedef struct __attribute__((packed)) {
 // Initialize TLS connection
 void tls_init(tls_conn_t* conn, int tcp_conn);
 
+// Allocate and initialize a connection context from the TLS object cache
+// Returns NULL on allocation failure
+tls_conn_t* tls_alloc(int tcp_conn);
+
+// Release a context obtained from tls_alloc
+void tls_free(tls_conn_t* conn);
+
 // Perform TLS handshake
 // Returns 0 on success, -1 on error
 int tls_handshake(tls_conn_t* conn, const char* hostname);
@@ -0,0 +1,32 @@
+#ifndef DANOS_BENCH_H
+#define DANOS_BENCH_H
+
+#include <stdint.h>
+
+// Samples a run can return; callers pass buffers of at least this many entries
+#define BENCH_MAX_SAMPLES 1024
+
+// Latency microbenchmarks for the `bench` command. Each one fills `samples` with up to `max`
+// per-operation TSC cycle counts and returns how many it took, or -1 if it could not run.
+// The ones that start tasks run on CPU 0, need the APIC timer to wait for them, and must be
+// called from a context that may block (the shell).
+
+// Back-to-back RDTSC pairs: the floor every other sample includes
+int bench_rdtsc(uint64_t *samples, uint32_t max);
+
+// A user process calling getpid through SYSCALL/SYSRET
+int bench_null_syscall(uint64_t *samples, uint32_t max);
+
+// Two kernel threads yielding to each other: one scheduler_switch each way
+int bench_kernel_switch(uint64_t *samples, uint32_t max);
+
+// Two user processes calling sched_yield on each other: syscall, switch and CR3 load
+int bench_user_switch(uint64_t *samples, uint32_t max);
+
+// Software interrupt on the spurious vector: irq_common_stub entry, scheduler_switch and iretq
+int bench_irq(uint64_t *samples, uint32_t max);
+
+// First write to a demand-zero user page: #PF, mm_handle_fault and a fresh frame
+int bench_page_fault(uint64_t *samples, uint32_t max);
+
+#endif // DANOS_BENCH_H
@@ -0,0 +1,49 @@
+// High-resolution timers: per-CPU queues of TSC deadlines driven by the local APIC timer
+#ifndef DANOS_HRTIMER_H
+#define DANOS_HRTIMER_H
+
+#include <stdint.h>
+
+typedef struct hrtimer {
+    struct hrtimer *next;
+    uint64_t expires;                   // TSC value
+    void (*fn)(struct hrtimer *timer);  // runs in interrupt context on the CPU that queued the timer
+    void *data;
+    int cpu;                            // queue holding the timer
+    int queued;
+} hrtimer_t;
+
+typedef struct {
+    uint64_t interrupts;    // timer interrupts taken
+    uint64_t expired;       // callbacks run
+    uint64_t programmed;    // times the hardware was re-armed
+} hrtimer_stats_t;
+
+// Set up the calling CPU's clock event. Needs its local APIC enabled and the TSC calibrated.
+void hrtimer_cpu_init(void);
+
+// Non-zero once the calling CPU can run timers
+int hrtimer_ready(void);
+
+// Prepare `timer` to call `fn` (timer->data is free for the caller)
+void hrtimer_init(hrtimer_t *timer, void (*fn)(hrtimer_t *timer), void *data);
+
+// Queue `timer` on the calling CPU to expire when the TSC reaches `expires`, moving it if it
+// is already queued. The hardware is only re-armed when the timer becomes the earliest one.
+// Returns 0, or -1 if the CPU has no clock event.
+int hrtimer_start(hrtimer_t *timer, uint64_t expires);
+
+// Same with a delay in nanoseconds from now
+int hrtimer_start_ns(hrtimer_t *timer, uint64_t ns);
+
+// Dequeue `timer` and wait for its callback if it is running on another CPU, so the timer and
+// its data may be freed or set up again afterwards. Returns 1 if it was pending, 0 otherwise.
+int hrtimer_cancel(hrtimer_t *timer);
+
+// Called from the LAPIC_TIMER_VECTOR handler: run the expired timers and arm the next one
+void hrtimer_interrupt(void);
+
+// Counters of CPU `cpu`. Returns -1 if it has no clock event.
+int hrtimer_get_stats(int cpu, hrtimer_stats_t *out);
+
+#endif // DANOS_HRTIMER_H
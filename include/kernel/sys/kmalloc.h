@@ -14,4 +14,35 @@ void *kmalloc_aligned(size_t size, size_t alignment);
 // Free a previously allocated pointer from kmalloc
 void kfree(void *ptr);
 
+// Number of allocation-site slots; slot 0 absorbs sites that found no free slot
+#define KMALLOC_SITES 256
+
+// Accounting for one kmalloc call site (caller == 0 means the slot is unused)
+typedef struct {
+    uintptr_t caller;      // return address of the kmalloc call
+    uint64_t live_bytes;   // bytes currently held, rounded to the slab class or heap block size
+    uint64_t live_count;
+    uint64_t peak_bytes;
+    uint64_t allocs;
+    uint64_t frees;
+} kmalloc_site_t;
+
+typedef struct {
+    uint64_t heap_bytes;        // size of the mapped block-list heap
+    uint64_t free_bytes;
+    uint64_t free_blocks;
+    uint64_t largest_free;
+    uint64_t walk_cycles;       // TSC cycles spent walking the free lists for this snapshot
+    uint64_t search_count;      // fit searches done by kmalloc on the block-list heap
+    uint64_t search_cycles;
+    uint64_t search_max_cycles;
+    uint32_t sites_used;
+} kmalloc_heap_stats_t;
+
+// Copy site slot `index` (0..KMALLOC_SITES-1) into `out`. Returns -1 if out of range.
+int kmalloc_site_info(int index, kmalloc_site_t *out);
+
+// Snapshot fragmentation and search-latency counters of the block-list heap
+void kmalloc_heap_stats(kmalloc_heap_stats_t *out);
+
 #endif // DANOS_KMALLOC_H
@@ -0,0 +1,47 @@
+// Contention counters and hold-time histograms for individual locks
+#ifndef DANOS_LOCKSTAT_H
+#define DANOS_LOCKSTAT_H
+
+#include <stdint.h>
+
+// Build with -DLOCK_STATS=0 to compile every hook out; locks then carry no stats pointer
+#ifndef LOCK_STATS
+#define LOCK_STATS 1
+#endif
+
+// Hold times land in log2 buckets: bucket 0 counts holds under 2^(LOCK_HIST_SHIFT + 1) cycles,
+// the last one everything from 2^(LOCK_HIST_SHIFT + LOCK_HIST_BUCKETS - 1) cycles up
+#define LOCK_HIST_BUCKETS 16
+#define LOCK_HIST_SHIFT   6
+
+// Statistics of one lock (or one class of locks sharing it). Everything but the registration
+// link is written by the holder only, so the counters need no atomics. Readers of rwlock_t are
+// not counted; its stats describe the write side.
+typedef struct lock_stat {
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contended;         // acquisitions that found the lock taken
+    uint64_t wait_cycles;       // spent spinning, summed over contended acquisitions
+    uint64_t max_wait_cycles;
+    uint64_t hold_cycles;
+    uint64_t max_hold_cycles;
+    uint64_t hold_hist[LOCK_HIST_BUCKETS];
+    uint64_t held_since;        // TSC at the current acquisition
+    struct lock_stat *next;     // registry, linked on first acquisition
+    uint32_t registered;
+} __attribute__((unused)) lock_stat_t;     // with LOCK_STATS=0 the static stats go unreferenced
+
+#define LOCK_STAT_INIT(n) { .name = (n) }
+
+// Hooks for the lock implementations: called right after the lock is taken (`start` is the TSC
+// read before trying, `waited` non-zero if it had to spin) and right before it is released
+void lock_stat_acquired(lock_stat_t *s, uint64_t start, int waited);
+void lock_stat_released(lock_stat_t *s);
+
+// Walk the stats of every lock taken at least once: pass NULL for the first one
+lock_stat_t *lock_stat_next(lock_stat_t *prev);
+
+// Zero the counters of every registered lock. Holds in progress are measured from the reset.
+void lock_stat_reset(void);
+
+#endif // DANOS_LOCKSTAT_H
@@ -0,0 +1,47 @@
+// Kernel preemption control. An interrupt may switch the running task out on its way back only
+// while the task's preempt count is zero; holding a spinlock, or an explicit preempt_disable(),
+// raises it. A switch wanted meanwhile is remembered in need_resched and made by the
+// preempt_enable() that brings the count back to zero.
+#ifndef DANOS_PREEMPT_H
+#define DANOS_PREEMPT_H
+
+#include <stdint.h>
+#include <kernel/arch/x86_64/percpu.h>
+
+// The count lives in the per-CPU block, so one instruction updates it; the scheduler saves and
+// restores it with the task, which makes it per task
+static inline int preempt_count(void) {
+    int32_t c;
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(c) : "i"(PERCPU_PREEMPT_COUNT));
+    return c;
+}
+
+static inline void preempt_disable(void) {
+    __asm__ volatile ("incl %%gs:%c0" :: "i"(PERCPU_PREEMPT_COUNT) : "memory", "cc");
+}
+
+// Drop the count without acting on a pending switch: for paths that are about to reschedule anyway
+static inline void preempt_enable_no_resched(void) {
+    __asm__ volatile ("decl %%gs:%c0" :: "i"(PERCPU_PREEMPT_COUNT) : "memory", "cc");
+}
+
+// Switch to the next task now; only called with the count at zero and interrupts on (scheduler.c)
+void preempt_schedule(void);
+
+// Make a switch that was held off, if the task may now be preempted. With interrupts off it waits
+// for the next interrupt return instead.
+static inline void preempt_check_resched(void) {
+    uint32_t want;
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(want) : "i"(PERCPU_NEED_RESCHED) : "memory");
+    if (!want || preempt_count()) return;
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0" : "=r"(flags) :: "memory");
+    if (flags & 0x200) preempt_schedule();
+}
+
+static inline void preempt_enable(void) {
+    preempt_enable_no_resched();
+    preempt_check_resched();
+}
+
+#endif // DANOS_PREEMPT_H
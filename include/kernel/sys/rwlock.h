@@ -0,0 +1,86 @@
+// Reader/writer spinlock: any number of readers, or one writer
+#ifndef DANOS_RWLOCK_H
+#define DANOS_RWLOCK_H
+
+#include <kernel/sys/spinlock.h>
+
+#define RW_WRITER  0x80000000U      // held for writing
+#define RW_WAITING 0x40000000U      // a writer is spinning: new readers hold back so it gets in
+
+typedef struct {
+    volatile uint32_t word;         // reader count in the low bits, plus the flags above
+    LOCK_STAT_FIELD
+} rwlock_t;
+
+#define RWLOCK_INIT { 0 }
+// Stats cover the write side only (see lockstat.h)
+#define RWLOCK_INIT_STAT(s) { 0 LOCK_STAT_PTR(s) }
+
+static inline void rwlock_init(rwlock_t *l) {
+    l->word = 0;
+#if LOCK_STATS
+    l->stat = 0;
+#endif
+}
+
+static inline void read_lock(rwlock_t *l) {
+    preempt_disable();
+    for (;;) {
+        uint32_t c = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+        if (!(c & (RW_WRITER | RW_WAITING)) &&
+            __atomic_compare_exchange_n(&l->word, &c, c + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+        __asm__ volatile ("pause");
+    }
+}
+
+static inline void read_unlock(rwlock_t *l) {
+    __atomic_fetch_sub(&l->word, 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline void write_lock(rwlock_t *l) {
+    preempt_disable();
+    LOCK_STAT_BEGIN(l);
+    for (;;) {
+        uint32_t c = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+        // Taking the lock also clears RW_WAITING; other writers still spinning set it again
+        if ((c & ~RW_WAITING) == 0 &&
+            __atomic_compare_exchange_n(&l->word, &c, RW_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        LOCK_STAT_WAITED();
+        if (!(c & RW_WAITING)) __atomic_fetch_or(&l->word, RW_WAITING, __ATOMIC_RELAXED);
+        __asm__ volatile ("pause");
+    }
+    LOCK_STAT_TAKEN(l);
+}
+
+static inline void write_unlock(rwlock_t *l) {
+    LOCK_STAT_DROP(l);
+    __atomic_fetch_and(&l->word, ~RW_WRITER, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline uint64_t read_lock_irqsave(rwlock_t *l) {
+    uint64_t flags = irq_save();
+    read_lock(l);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *l, uint64_t flags) {
+    read_unlock(l);
+    irq_restore(flags);
+    preempt_check_resched();
+}
+
+static inline uint64_t write_lock_irqsave(rwlock_t *l) {
+    uint64_t flags = irq_save();
+    write_lock(l);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *l, uint64_t flags) {
+    write_unlock(l);
+    irq_restore(flags);
+    preempt_check_resched();
+}
+
+#endif // DANOS_RWLOCK_H
@@ -3,16 +3,87 @@
 
 #include <stdint.h>
 
+// Nice-style priorities: lower values are favoured, and a runnable task of a lower level always
+// runs before any task of a higher one
+#define SCHED_NICE_MIN     -20
+#define SCHED_NICE_MAX     19
+#define SCHED_NICE_DEFAULT 0
+
+// Software interrupt a task raises to give up the CPU (scheduler_yield)
+#define SCHED_YIELD_VECTOR 50
+// Software interrupt that makes a preemption held off by the preempt count (preempt_schedule)
+#define SCHED_PREEMPT_VECTOR 51
+
+// Per-CPU scheduler counters
+typedef struct {
+    uint32_t queued;        // tasks waiting in the CPU's run queues
+    int running_pid;        // task on the CPU, 0 when it idles
+    uint64_t switches;      // context switches made by the CPU
+    uint64_t steals;        // tasks it took from other CPUs' queues
+    uint64_t preemptions;   // running tasks it switched out
+    uint64_t deferred;      // preemptions it held off until a lock was dropped
+} sched_cpu_info_t;
+
 // Initialize scheduler
 void scheduler_init(void);
 
-// Add a new kernel thread. func is the entry point (void func(void)).
-int scheduler_add_task(void (*func)(void));
+// Give application processor `cpu` its scheduler. The calling context becomes the CPU's idle task.
+void scheduler_init_cpu(int cpu);
+
+// Add a new kernel thread. func is the entry point (void func(void)), nice its priority (clamped).
+int scheduler_add_task(void (*func)(void), int nice);
+
+// Same as scheduler_add_task, with the thread pinned to `cpu` unless it is negative
+int scheduler_add_task_on(void (*func)(void), int nice, int cpu);
+
+// Add a new user process. entry_point is the RIP, user_stack_top is the initial RSP, cr3 is the page table,
+// nice its priority (clamped).
+int scheduler_create_user_process(void *entry_point, void *user_stack_top, uint64_t cr3, int nice);
+
+struct syscall_frame;
+
+// Add the child of a fork: a user process in the address space `cr3` that resumes from the
+// parent's syscall frame with a return value of 0. Returns the child's PID, or -1 on failure.
+int scheduler_fork_user_process(const struct syscall_frame *frame, uint64_t cr3);
+
+// PID of the running task
+int scheduler_current_pid(void);
 
-// Add a new user process. entry_point is the RIP, user_stack_top is the initial RSP, cr3 is the page table.
-int scheduler_create_user_process(void *entry_point, void *user_stack_top, uint64_t cr3);
+// End the calling task with `status`. Its parent, if any, is woken to collect the status; the
+// reaper thread frees everything else. Returns only when called from the boot task, which cannot exit.
+void scheduler_exit(int status);
+
+// Block until a child of the calling task exits, store its status in `status` (may be NULL) and
+// return its PID. Returns -1 at once if the task has no children.
+int scheduler_wait(int *status);
+
+// Dead tasks freed by the reaper so far
+uint64_t scheduler_reaped(void);
+
+// Change the priority of task `pid`. Returns 0 on success, -1 if there is no such task.
+int scheduler_set_nice(int pid, int nice);
+
+// Give up the CPU to the next runnable task. A task that set itself blocked first stays off the
+// run queues until it is woken (see waitqueue.h).
+void scheduler_yield(void);
+
+// Idle loop body for a task with nothing to do: yields to queued work, otherwise halts until the
+// next interrupt
+void scheduler_idle(void);
+
+// Block the calling task for `ns` nanoseconds, leaving the CPU to other tasks
+void scheduler_sleep_ns(uint64_t ns);
+
+// Fill `out` with the counters of CPU `cpu`. Returns -1 if that CPU does not schedule.
+int scheduler_cpu_info(int cpu, sched_cpu_info_t *out);
 
 // Called from the IRQ stub. 'regs' points to saved register block on stack; returns pointer to registers of next task
 void *scheduler_switch(void *regs);
 
+// Called from the IRQ stub once it runs on the stack scheduler_switch returned
+void scheduler_finish_switch(void);
+
+// #NM handler: load the running task's vector registers (see fpu.h)
+void scheduler_fpu_trap(void);
+
 #endif // DANOS_SCHEDULER_H
@@ -0,0 +1,60 @@
+// Sequence lock for small, read-mostly data. Readers take no lock and never delay the writer;
+// they copy the data and retry if a write ran meanwhile:
+//
+//     uint32_t seq;
+//     do {
+//         seq = read_seqbegin(&lock);
+//         copy = data;
+//     } while (read_seqretry(&lock, seq));
+//
+// Readers may see torn data inside the loop, so they must only copy it there, never follow pointers.
+#ifndef DANOS_SEQLOCK_H
+#define DANOS_SEQLOCK_H
+
+#include <kernel/sys/spinlock.h>
+
+typedef struct {
+    volatile uint32_t seq;      // odd while a write is in progress
+    spinlock_t lock;            // serializes writers
+} seqlock_t;
+
+#define SEQLOCK_INIT { 0, SPINLOCK_INIT }
+#define SEQLOCK_INIT_STAT(s) { 0, SPINLOCK_INIT_STAT(s) }
+
+static inline uint32_t read_seqbegin(const seqlock_t *s) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1) __asm__ volatile ("pause");
+    return seq;
+}
+
+static inline int read_seqretry(const seqlock_t *s, uint32_t start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqlock(seqlock_t *s) {
+    spin_lock(&s->lock);
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_sequnlock(seqlock_t *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+    spin_unlock(&s->lock);
+}
+
+// Writers must use these when readers can run in interrupt handlers: a reader interrupting the
+// writer on its own CPU would otherwise spin forever on the odd sequence
+static inline uint64_t write_seqlock_irqsave(seqlock_t *s) {
+    uint64_t flags = irq_save();
+    write_seqlock(s);
+    return flags;
+}
+
+static inline void write_sequnlock_irqrestore(seqlock_t *s, uint64_t flags) {
+    write_sequnlock(s);
+    irq_restore(flags);
+    preempt_check_resched();
+}
+
+#endif // DANOS_SEQLOCK_H
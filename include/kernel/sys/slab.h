@@ -0,0 +1,50 @@
+// Size-class slab allocator backing small kmalloc requests, and typed object caches
+#ifndef DANOS_SLAB_H
+#define DANOS_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Smallest and largest size classes served by the slab layer
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 4096
+
+// Minimum alignment of objects handed out by a kmem cache
+#define KMEM_CACHE_LINE 64
+
+typedef struct kmem_cache kmem_cache_t;
+
+typedef struct {
+    const char *name;
+    size_t obj_size;
+    size_t stride;      // bytes per object including padding and free-list link
+    uint32_t per_slab;
+    uint64_t live;      // objects currently allocated
+    uint64_t peak;      // high-water mark of live
+    uint64_t slabs;     // slabs currently backing the cache
+} kmem_cache_info_t;
+
+// Allocate an object from the power-of-two class covering `size` (1..SLAB_MAX_SIZE).
+// Objects are aligned to their class size; `tag` is stored alongside for accounting.
+// Returns NULL on failure.
+void *slab_alloc(size_t size, uint16_t tag);
+
+// Return an object obtained from slab_alloc. On success reports the object's tag and
+// class size through `tag` and `size` (either may be NULL) and returns 0; -1 if ptr is not a slab object.
+int slab_free(void *ptr, uint16_t *tag, size_t *size);
+
+// Create a cache of `size`-byte objects aligned to at least KMEM_CACHE_LINE.
+// `ctor`, if given, runs once per object when its slab is populated; objects must be
+// handed back to kmem_cache_free in their constructed state. Returns NULL on failure.
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj));
+
+// Allocate a constructed object from `cache`. Returns NULL on failure.
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+// Return an object to the cache it came from
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+// Fill `out` with the counters of the index-th cache (kmalloc classes included). Returns -1 past the end.
+int kmem_cache_info(int index, kmem_cache_info_t *out);
+
+#endif // DANOS_SLAB_H
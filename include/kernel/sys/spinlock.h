@@ -0,0 +1,171 @@
+// Busy-waiting locks for data shared between CPUs. The holder cannot be preempted (preempt.h),
+// so a task never sleeps with a lock that another task on its CPU would spin on.
+#ifndef DANOS_SPINLOCK_H
+#define DANOS_SPINLOCK_H
+
+#include <stdint.h>
+#include <kernel/sys/lockstat.h>
+#include <kernel/sys/preempt.h>
+#include <kernel/arch/x86_64/tsc.h>
+
+#if LOCK_STATS
+#define LOCK_STAT_FIELD lock_stat_t *stat;
+#define LOCK_STAT_PTR(s) , &(s)
+#define LOCK_STAT_BEGIN(l) uint64_t stat_t0 = (l)->stat ? rdtsc() : 0; int stat_waited = 0
+#define LOCK_STAT_WAITED() (stat_waited = 1)
+#define LOCK_STAT_TAKEN(l) do { if ((l)->stat) lock_stat_acquired((l)->stat, stat_t0, stat_waited); } while (0)
+#define LOCK_STAT_DROP(l) do { if ((l)->stat) lock_stat_released((l)->stat); } while (0)
+#else
+#define LOCK_STAT_FIELD
+#define LOCK_STAT_PTR(s)
+#define LOCK_STAT_BEGIN(l) do { } while (0)
+#define LOCK_STAT_WAITED() ((void)0)
+#define LOCK_STAT_TAKEN(l) do { } while (0)
+#define LOCK_STAT_DROP(l) do { } while (0)
+#endif
+
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & 0x200) __asm__ volatile ("sti" ::: "memory");
+}
+
+typedef struct {
+    volatile uint32_t locked;
+    LOCK_STAT_FIELD
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+// A lock whose acquisitions are counted in the lock_stat_t `s` (see lockstat.h)
+#define SPINLOCK_INIT_STAT(s) { 0 LOCK_STAT_PTR(s) }
+
+static inline void spin_lock_init(spinlock_t *l) {
+    l->locked = 0;
+#if LOCK_STATS
+    l->stat = 0;
+#endif
+}
+
+// Same, for a lock set up at run time that should be counted in `s`
+static inline void spin_lock_init_stat(spinlock_t *l, lock_stat_t *s) {
+    spin_lock_init(l);
+#if LOCK_STATS
+    l->stat = s;
+#else
+    (void)s;
+#endif
+}
+
+// Test-and-test-and-set: waiters spin on a plain read so the cache line stays shared until release
+static inline void spin_lock(spinlock_t *l) {
+    preempt_disable();
+    LOCK_STAT_BEGIN(l);
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        LOCK_STAT_WAITED();
+        while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED)) __asm__ volatile ("pause");
+    }
+    LOCK_STAT_TAKEN(l);
+}
+
+static inline int spin_trylock(spinlock_t *l) {
+    preempt_disable();
+    LOCK_STAT_BEGIN(l);
+    if (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        preempt_enable();
+        return 0;
+    }
+    LOCK_STAT_TAKEN(l);
+    return 1;
+}
+
+static inline void spin_unlock(spinlock_t *l) {
+    LOCK_STAT_DROP(l);
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+// Variants for locks also taken from interrupt handlers: interrupts stay off while the lock is held
+static inline uint64_t spin_lock_irqsave(spinlock_t *l) {
+    uint64_t flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, uint64_t flags) {
+    spin_unlock(l);
+    irq_restore(flags);
+    preempt_check_resched();
+}
+
+// Ticket lock: waiters are served in arrival order, so a CPU that keeps re-taking the lock cannot
+// starve the others. Costs a locked add on every acquisition, even uncontended.
+typedef struct {
+    union {
+        volatile uint32_t word;
+        struct {
+            volatile uint16_t owner;    // ticket being served
+            volatile uint16_t next;     // next ticket to hand out
+        } t;
+    };
+    LOCK_STAT_FIELD
+} ticketlock_t;
+
+#define TICKETLOCK_INIT { { 0 } }
+#define TICKETLOCK_INIT_STAT(s) { { 0 } LOCK_STAT_PTR(s) }
+
+static inline void ticket_lock_init(ticketlock_t *l) {
+    l->word = 0;
+#if LOCK_STATS
+    l->stat = 0;
+#endif
+}
+
+static inline void ticket_lock(ticketlock_t *l) {
+    preempt_disable();
+    LOCK_STAT_BEGIN(l);
+    uint16_t me = (uint16_t)(__atomic_fetch_add(&l->word, 1U << 16, __ATOMIC_ACQUIRE) >> 16);
+    if (__atomic_load_n(&l->t.owner, __ATOMIC_ACQUIRE) != me) {
+        LOCK_STAT_WAITED();
+        while (__atomic_load_n(&l->t.owner, __ATOMIC_ACQUIRE) != me) __asm__ volatile ("pause");
+    }
+    LOCK_STAT_TAKEN(l);
+}
+
+static inline int ticket_trylock(ticketlock_t *l) {
+    preempt_disable();
+    LOCK_STAT_BEGIN(l);
+    uint32_t old = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+    // Free only when nobody holds or waits for a ticket
+    if ((old & 0xFFFF) != (old >> 16) ||
+        !__atomic_compare_exchange_n(&l->word, &old, old + (1U << 16), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        preempt_enable();
+        return 0;
+    }
+    LOCK_STAT_TAKEN(l);
+    return 1;
+}
+
+static inline void ticket_unlock(ticketlock_t *l) {
+    LOCK_STAT_DROP(l);
+    // Only the holder writes `owner`, so a plain increment of the low half is enough
+    __atomic_store_n(&l->t.owner, (uint16_t)(l->t.owner + 1), __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline uint64_t ticket_lock_irqsave(ticketlock_t *l) {
+    uint64_t flags = irq_save();
+    ticket_lock(l);
+    return flags;
+}
+
+static inline void ticket_unlock_irqrestore(ticketlock_t *l, uint64_t flags) {
+    ticket_unlock(l);
+    irq_restore(flags);
+    preempt_check_resched();
+}
+
+#endif // DANOS_SPINLOCK_H
@@ -22,6 +22,7 @@
 #define SYS_MMAP      9
 #define SYS_MUNMAP    11
 #define SYS_BRK       12
+#define SYS_SCHED_YIELD 24
 #define SYS_GETPID    39
 #define SYS_FORK      57
 #define SYS_EXEC      59
@@ -83,9 +84,22 @@ typedef struct {
 #define MSR_CSTAR        0xC0000083
 #define MSR_SYSCALL_MASK 0xC0000084
 
+// User registers as pushed by syscall_entry, lowest address first
+typedef struct syscall_frame {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rdi, rsi, rbp, rdx, rcx, rbx, rax;
+    uint64_t rip, cs, rflags, rsp, ss;
+} syscall_frame_t;
+
+// Frame of the syscall the calling CPU is handling (kept in its per-CPU block)
+syscall_frame_t* syscall_current_frame(void);
+
 // Initialize syscall subsystem (setup MSRs and fd table)
 void syscall_init(void);
 
+// Program the syscall MSRs of an application processor
+void syscall_init_cpu(void);
+
 // Syscall handler (called from syscall entry point)
 int64_t syscall_handler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, 
                         uint64_t arg3, uint64_t arg4, uint64_t arg5);
@@ -106,6 +120,7 @@ int64_t sys_exec(const char* path, char* const argv[], char* const envp[]);
 int64_t sys_fork(void);
 int64_t sys_wait(int* status);
 int64_t sys_getpid(void);
+int64_t sys_sched_yield(void);
 int64_t sys_stat(const char* pathname, stat_t* statbuf);
 int64_t sys_mkdir(const char* pathname);
 int64_t sys_rmdir(const char* pathname);
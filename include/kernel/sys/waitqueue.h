@@ -0,0 +1,38 @@
+// Wait queues: tasks give up the CPU until an event (interrupt, other task, timer) wakes them
+#ifndef DANOS_WAITQUEUE_H
+#define DANOS_WAITQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/sys/spinlock.h>
+
+struct task_struct;
+
+// One sleeping task. Lives on the sleeper's stack for the duration of the wait.
+typedef struct wait_entry {
+    struct wait_entry *next;
+    struct task_struct *task;
+    int queued;
+} wait_entry_t;
+
+typedef struct {
+    spinlock_t lock;
+    wait_entry_t *head;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, NULL }
+
+static inline void wait_queue_init(wait_queue_t *wq) {
+    spin_lock_init(&wq->lock);
+    wq->head = NULL;
+}
+
+// Block the calling task on `wq` until cond(arg) holds or `timeout_ns` has passed (0 waits forever).
+// The task is queued before cond is checked, so a wake-up between the check and the sleep is not
+// lost. `wq` and `cond` may be NULL for a plain timed sleep. Returns 1 if cond held, 0 on timeout.
+int wait_event_timeout(wait_queue_t *wq, int (*cond)(void *arg), void *arg, uint64_t timeout_ns);
+
+// Make every task sleeping on `wq` runnable. Safe from interrupt context. Returns how many were woken.
+int wake_up_all(wait_queue_t *wq);
+
+#endif // DANOS_WAITQUEUE_H
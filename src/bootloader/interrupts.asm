@@ -103,6 +103,27 @@ IRQ 12, 44      ; PS/2 mouse
 IRQ 13, 45      ; FPU
 IRQ 14, 46      ; Primary ATA
 IRQ 15, 47      ; Secondary ATA
+IRQ 16, 48      ; Local APIC timer
+IRQ 17, 255     ; Local APIC spurious
+IRQ 18, 49      ; Reschedule IPI
+IRQ 19, 50      ; Yield (software interrupt)
+IRQ 20, 51      ; Preempt (software interrupt)
+
+; Per-CPU block offsets, see include/kernel/arch/x86_64/percpu.h
+%define PERCPU_IRQS       56
+%define PERCPU_EXCEPTIONS 64
+
+%define MSR_GS_BASE       0xC0000101
+
+; Entered from user mode (RPL 3 in the saved CS, %1 bytes above rsp): switch to the kernel GS base.
+; Used again on the way out, with the same test, to give user mode its own GS base back.
+; Only good for IRQs: they are masked in the swapgs windows of syscall_entry.S, exceptions are not.
+%macro SWAPGS_IF_USER 1
+    test qword [rsp + %1], 3
+    jz %%kernel
+    swapgs
+%%kernel:
+%endmacro
 
 extern isr_handler
 
@@ -125,6 +146,20 @@ isr_common_stub:
     push r14
     push r15
 
+    ; An NMI, #MC or #DF can hit between syscall and its swapgs, or between the exit swapgs and
+    ; sysretq, and an iretq back to user mode can #GP after SWAPGS_IF_USER: the saved CS says
+    ; kernel but GS holds the user base. So look at GS_BASE itself; user mode always has 0 there.
+    ; rbx is callee-saved and remembers the swap for the way out.
+    mov ecx, MSR_GS_BASE
+    rdmsr
+    xor ebx, ebx
+    or eax, edx
+    jnz .kernel_gs
+    swapgs
+    mov ebx, 1
+.kernel_gs:
+    inc qword [gs:PERCPU_EXCEPTIONS]
+
     ; Get interrupt number from stack (now at rsp+120)
     mov rdi, [rsp + 120]
 
@@ -137,6 +172,12 @@ isr_common_stub:
     ; Call C handler
     call isr_handler
 
+    ; Give back the GS base found on entry
+    test ebx, ebx
+    jz .gs_restored
+    swapgs
+.gs_restored:
+
     ; Restore all registers
     pop r15
     pop r14
@@ -162,12 +203,13 @@ isr_common_stub:
 
 extern irq_handler
 extern scheduler_switch
-
-    ; External symbol for scheduler to set next CR3
-    extern sched_next_cr3
+extern scheduler_finish_switch
 
 ; Common IRQ stub
 irq_common_stub:
+    SWAPGS_IF_USER 24
+    inc qword [gs:PERCPU_IRQS]
+
     ; Save all registers
     push rax
     push rbx
@@ -200,19 +242,8 @@ irq_common_stub:
     mov rsp, rax
 
 no_switch:
-    ; CRITICAL: Load CR3 BEFORE popping registers (while we still can use registers safely)
-    mov rax, [sched_next_cr3]
-    test rax, rax
-    jz .no_cr3_switch
-    
-    ; Load the new CR3
-    mov cr3, rax
-    
-    ; Clear the global
-    xor rax, rax
-    mov [sched_next_cr3], rax
-    
-.no_cr3_switch:
+    ; The previous task's stack is no longer in use: another CPU may now run it
+    call scheduler_finish_switch
 
     ; Restore all registers
     pop r15
@@ -234,6 +265,8 @@ no_switch:
     ; Clean up error code and IRQ number
     add rsp, 16
 
+    ; The frame may belong to another task than the one that entered
+    SWAPGS_IF_USER 8
     ; Return from interrupt - stack now has: [RIP][CS][RFLAGS][RSP][SS]
     iretq
 
@@ -6,11 +6,27 @@
  *=============================================**/
 #include <cpu/gdt.h>
 #include <kernel/sys/string.h>
+#include <kernel/arch/x86_64/smp.h>
 
-uint64_t gdt[7];
+#define GDT_ENTRIES 7
+#define DF_STACK_SIZE 4096
+#define IST_STACK_SIZE 4096
+
+// The BSP's table; application processors get their own copies below
+uint64_t gdt[GDT_ENTRIES];
 struct gdt_ptr gdt_ptr;
 struct tss_entry tss;
 
+static uint64_t ap_gdt[SMP_MAX_CPUS][GDT_ENTRIES];
+static struct gdt_ptr ap_gdt_ptr[SMP_MAX_CPUS];
+static struct tss_entry ap_tss[SMP_MAX_CPUS];
+
+// Stacks the double-fault handler runs on (TSS_IST_DOUBLE_FAULT), one per CPU
+static uint8_t df_stacks[SMP_MAX_CPUS][DF_STACK_SIZE] __attribute__((aligned(16)));
+// Same for NMI and machine check (TSS_IST_NMI, TSS_IST_MACHINE_CHECK)
+static uint8_t nmi_stacks[SMP_MAX_CPUS][IST_STACK_SIZE] __attribute__((aligned(16)));
+static uint8_t mc_stacks[SMP_MAX_CPUS][IST_STACK_SIZE] __attribute__((aligned(16)));
+
 // Helper to build a 64-bit GDT descriptor
 static uint64_t build_desc(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
     uint64_t desc = 0;
@@ -24,50 +40,71 @@ static uint64_t build_desc(uint32_t base, uint32_t limit, uint8_t access, uint8_
     return desc;
 }
 
-void gdt_init() {
+// Build the descriptor table of one CPU around its own TSS
+static void gdt_fill(uint64_t *g, struct tss_entry *t, int cpu) {
     // Null descriptor
-    gdt[0] = 0;
+    g[0] = 0;
     // use file-scope build_desc
 
     // Kernel code segment (ring 0, executable, 64-bit): access=0x9A, flags upper nibble=(G=1,L=1)->0xA
-    gdt[1] = build_desc(0, 0xFFFF, 0x9A, 0xA);
+    g[1] = build_desc(0, 0xFFFF, 0x9A, 0xA);
 
     // Kernel data segment (ring 0, data): access=0x92, flags upper nibble=(G=1,D/B=1)->0xC
-    gdt[2] = build_desc(0, 0xFFFF, 0x92, 0xC);
+    g[2] = build_desc(0, 0xFFFF, 0x92, 0xC);
 
     // User data segment (ring 3, data): access=0xF2 (DPL=3)
     // Placed at index 3 to support SYSRET (expects SS at Base+8 = 16+8 = 24? No. Base=0x10. SS=0x18, CS=0x20)
     // Wait. If Base=0x10. Base+8 = 0x18 => Index 3. Base+16=0x20 => Index 4.
     // So Index 3 MUST be User Data. Index 4 MUST be User Code.
-    gdt[3] = build_desc(0, 0xFFFF, 0xF2, 0xC);
+    g[3] = build_desc(0, 0xFFFF, 0xF2, 0xC);
 
     // User code segment (ring 3, executable, 64-bit): access=0xFA (DPL=3)
-    gdt[4] = build_desc(0, 0xFFFF, 0xFA, 0xA);
+    g[4] = build_desc(0, 0xFFFF, 0xFA, 0xA);
 
     // TSS descriptor (spans two entries)
-    uint64_t tss_base = (uint64_t)&tss;
+    uint64_t tss_base = (uint64_t)t;
     uint32_t tss_limit = sizeof(struct tss_entry) - 1;
-    gdt[5] = (tss_limit & 0xFFFF) |
-             ((tss_base & 0xFFFF) << 16) |
-             (((tss_base >> 16) & 0xFF) << 32) |
-             (0x89ULL << 40) |
-             ((uint64_t)(tss_limit >> 16 & 0xF) << 48) |
-             (((tss_base >> 24) & 0xFF) << 56);
-    gdt[6] = (tss_base >> 32);
+    g[5] = (tss_limit & 0xFFFF) |
+           ((tss_base & 0xFFFF) << 16) |
+           (((tss_base >> 16) & 0xFF) << 32) |
+           (0x89ULL << 40) |
+           ((uint64_t)(tss_limit >> 16 & 0xF) << 48) |
+           (((tss_base >> 24) & 0xFF) << 56);
+    g[6] = (tss_base >> 32);
 
     // Initialize TSS
-    memset_k(&tss, 0, sizeof(struct tss_entry));
-    tss.iopb_offset = sizeof(struct tss_entry);
+    memset_k(t, 0, sizeof(struct tss_entry));
+    t->iopb_offset = sizeof(struct tss_entry);
+    t->ist1 = (uint64_t)(uintptr_t)(df_stacks[cpu] + DF_STACK_SIZE);
+    t->ist2 = (uint64_t)(uintptr_t)(nmi_stacks[cpu] + IST_STACK_SIZE);
+    t->ist3 = (uint64_t)(uintptr_t)(mc_stacks[cpu] + IST_STACK_SIZE);
+}
 
-    // Load GDT
-    gdt_ptr.limit = sizeof(gdt) - 1;
-    gdt_ptr.base = (uint64_t)&gdt;
-    __asm__ volatile("lgdt %0" : : "m"(gdt_ptr));
+static void gdt_load(uint64_t *g, struct gdt_ptr *p) {
+    p->limit = GDT_ENTRIES * sizeof(uint64_t) - 1;
+    p->base = (uint64_t)g;
+    __asm__ volatile("lgdt %0" : : "m"(*p));
 
     // Load Task Register
     __asm__ volatile("ltr %0" : : "r"((uint16_t)0x28));
 }
 
+void gdt_init() {
+    gdt_fill(gdt, &tss, 0);
+    gdt_load(gdt, &gdt_ptr);
+}
+
+void gdt_init_cpu(int cpu) {
+    // The busy bit ltr sets in a TSS descriptor rules out sharing one table between CPUs
+    if (cpu <= 0 || cpu >= SMP_MAX_CPUS) return;
+    gdt_fill(ap_gdt[cpu], &ap_tss[cpu], cpu);
+    gdt_load(ap_gdt[cpu], &ap_gdt_ptr[cpu]);
+}
+
+static struct tss_entry *cpu_tss(int cpu) {
+    return cpu > 0 && cpu < SMP_MAX_CPUS ? &ap_tss[cpu] : &tss;
+}
+
 void tss_set_stack(uint64_t rsp0) {
-    tss.rsp0 = rsp0;
-}
\ No newline at end of file
+    cpu_tss(smp_cpu_id())->rsp0 = rsp0;
+}
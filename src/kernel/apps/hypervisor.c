@@ -277,7 +277,7 @@ void cmd_vm(const char* filename) {
     for (i = 0; i < 255 && filename[i]; ++i) vm_task_filename[i] = filename[i];
     vm_task_filename[i] = '\0';
     // Schedule task
-    int rc = scheduler_add_task(vm_task);
+    int rc = scheduler_add_task(vm_task, SCHED_NICE_DEFAULT);
     if (rc == 0) {
         tty_putstr("VM scheduled as kernel task.\n");
     } else {
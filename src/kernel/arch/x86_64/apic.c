@@ -0,0 +1,159 @@
+// Local APIC: per-CPU interrupt controller used for IPIs, the per-CPU timer and EOIs of both.
+// Its registers sit at the same physical address on every CPU, each CPU seeing its own.
+#include <kernel/arch/x86_64/apic.h>
+#include <kernel/arch/x86_64/vmm.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <kernel/sys/tty.h>
+#include <cpu/cpuid.h>
+#include <cpu/msr.h>
+
+#define APIC_BASE_ENABLE (1ULL << 11)
+#define APIC_BASE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Register offsets
+#define LAPIC_ID        0x020
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LOW   0x300
+#define LAPIC_ICR_HIGH  0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR 0x390
+#define LAPIC_TIMER_DIV 0x3E0
+
+#define SVR_ENABLE        0x100
+#define ICR_INIT          0x500
+#define ICR_STARTUP       0x600
+#define ICR_LEVEL_ASSERT  0x4000
+#define ICR_FIXED         0x000
+#define ICR_PENDING       0x1000
+#define LVT_MASKED        0x10000
+#define LVT_TIMER_ONESHOT 0x00000
+#define LVT_TIMER_DEADLINE 0x40000
+#define TIMER_DIV_16      0x3
+#define MSR_TSC_DEADLINE  0x6E0
+#define CALIBRATE_US      10000
+
+static volatile uint32_t *lapic = 0;
+static uint64_t timer_khz = 0;
+static int tsc_deadline = 0;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+// Count APIC timer ticks over a TSC-timed interval
+static void timer_calibrate(void) {
+    uint64_t khz = tsc_khz();
+    if (!khz) return;
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    uint64_t cycles = khz * CALIBRATE_US / 1000;
+    uint64_t start = rdtsc();
+    while (rdtsc() - start < cycles) __asm__ volatile ("pause");
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    timer_khz = (uint64_t)elapsed * 1000 / CALIBRATE_US;
+}
+
+int lapic_init(void) {
+    int first = !lapic;
+    if (first) {
+        uint32_t ecx = 0, edx = 0;
+        cpuid(1, 0, 0, 0, &ecx, &edx);
+        if (!((edx >> 9) & 1)) return -1;
+        tsc_deadline = (ecx >> 24) & 1;
+        uint64_t base = rdmsr(MSR_APIC_BASE) & APIC_BASE_ADDR_MASK;
+        // Device registers must not be cached; the identity map covers them with a write-back page
+        if (vmm_map_page(base, base, VMM_PFLAG_WRITE | VMM_PFLAG_PCD | VMM_PFLAG_PWT) != 0) {
+            tty_putstr("[APIC] Could not map the local APIC\n");
+            return -1;
+        }
+        lapic = (volatile uint32_t *)(uintptr_t)base;
+    }
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    // Every CPU's timer runs from the same bus clock, so measuring it once is enough
+    if (first) timer_calibrate();
+    return 0;
+}
+
+int lapic_present(void) {
+    return lapic != 0;
+}
+
+uint32_t lapic_id(void) {
+    if (!lapic) return 0;
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    if (lapic) lapic_write(LAPIC_EOI, 0);
+}
+
+static void send_ipi(uint32_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) __asm__ volatile ("pause");
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    send_ipi(apic_id, ICR_INIT | ICR_LEVEL_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uint8_t vector) {
+    send_ipi(apic_id, ICR_STARTUP | ICR_LEVEL_ASSERT | vector);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    send_ipi(apic_id, ICR_FIXED | ICR_LEVEL_ASSERT | vector);
+}
+
+void lapic_timer_init(void) {
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    if (tsc_deadline) {
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_DEADLINE | LAPIC_TIMER_VECTOR);
+        // Writes to the deadline MSR must not be reordered before the LVT switch
+        __asm__ volatile ("mfence" ::: "memory");
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INIT, 0);
+    }
+}
+
+void lapic_timer_arm(uint64_t deadline) {
+    if (tsc_deadline) {
+        wrmsr(MSR_TSC_DEADLINE, deadline);
+        return;
+    }
+    if (!deadline) {
+        lapic_write(LAPIC_TIMER_INIT, 0);
+        return;
+    }
+    uint64_t now = rdtsc();
+    uint64_t khz = tsc_khz();
+    uint64_t ticks = 1;
+    if (deadline > now && khz) {
+        // Round up so the interrupt never comes before the deadline
+        ticks = ((deadline - now) * timer_khz + khz - 1) / khz;
+        if (ticks == 0) ticks = 1;
+        if (ticks > 0xFFFFFFFF) ticks = 0xFFFFFFFF;
+    }
+    lapic_write(LAPIC_TIMER_INIT, (uint32_t)ticks);
+}
+
+uint64_t lapic_timer_khz(void) {
+    return timer_khz;
+}
+
+int lapic_timer_tsc_deadline(void) {
+    return tsc_deadline;
+}
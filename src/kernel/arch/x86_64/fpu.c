@@ -0,0 +1,301 @@
+// Lazy FPU switching. CR0.TS stays set while the running task's vector state is not in the
+// registers; its first FPU instruction then raises #NM and the state is loaded. Saving is eager:
+// a task that used the FPU is saved when it is switched out, so the registers never hold unsaved
+// state of a task that is not running and tasks can move between CPUs freely.
+#include <kernel/arch/x86_64/fpu.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/sys/slab.h>
+#include <kernel/sys/spinlock.h>
+#include <kernel/sys/string.h>
+#include <kernel/sys/tty.h>
+#include <cpu/cpuid.h>
+#include <stdint.h>
+
+#define CR0_MP (1ULL << 1)
+#define CR0_EM (1ULL << 2)
+#define CR0_TS (1ULL << 3)
+#define CR0_NE (1ULL << 5)
+#define CR4_OSFXSR     (1ULL << 9)
+#define CR4_OSXMMEXCPT (1ULL << 10)
+#define CR4_OSXSAVE    (1ULL << 18)
+
+#define CPUID1_ECX_XSAVE (1U << 26)
+#define CPUID1_ECX_AVX   (1U << 28)
+#define CPUID1_EDX_FXSR  (1U << 24)
+#define CPUID1_EDX_SSE2  (1U << 26)
+
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+
+#define FXSAVE_SIZE 512
+#define MXCSR_DEFAULT 0x1F80
+
+typedef struct {
+    fpu_ctx_t *loaded;      // task whose state is in the registers (saved copy is current unless `active`)
+    int active;             // the running task has the FPU enabled and may have changed its state
+    int ts;                 // CR0.TS as last written
+    int depth;              // kernel_fpu_begin nesting
+    uint64_t irq_flags;     // RFLAGS of the outermost kernel_fpu_begin
+    uint64_t traps;
+    uint64_t restores;
+    uint64_t saves;
+    uint64_t reuses;
+    uint64_t kernel_sections;
+} fpu_cpu_t;
+
+static fpu_cpu_t fpu_cpus[SMP_MAX_CPUS];
+static int use_xsave = 0;
+static int use_xsaveopt = 0;
+static uint64_t xcr0 = 0;
+static uint32_t area_size = FXSAVE_SIZE;
+static kmem_cache_t *fpu_cache = NULL;
+// State right after FNINIT, copied into a task's area on its first FPU instruction
+static uint8_t init_area[4096] __attribute__((aligned(64)));
+static int fpu_up = 0;
+
+static inline uint64_t read_cr0(void) {
+    uint64_t v;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v) {
+    __asm__ volatile ("mov %0, %%cr0" :: "r"(v) : "memory");
+}
+
+static inline void clts(fpu_cpu_t *c) {
+    if (!c->ts) return;
+    __asm__ volatile ("clts" ::: "memory");
+    c->ts = 0;
+}
+
+static inline void stts(fpu_cpu_t *c) {
+    if (c->ts) return;
+    write_cr0(read_cr0() | CR0_TS);
+    c->ts = 1;
+}
+
+// The x87/SSE state is written by these instructions only; the compiler never touches it
+static void state_save(uint8_t *area) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    if (use_xsaveopt) __asm__ volatile ("xsaveopt64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else if (use_xsave) __asm__ volatile ("xsave64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else __asm__ volatile ("fxsave64 (%0)" :: "r"(area) : "memory");
+}
+
+static void state_restore(const uint8_t *area) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    if (use_xsave) __asm__ volatile ("xrstor64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else __asm__ volatile ("fxrstor64 (%0)" :: "r"(area) : "memory");
+}
+
+static void state_reset(void) {
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    __asm__ volatile ("fninit; ldmxcsr %0" :: "m"(mxcsr));
+}
+
+// The same state may not stay marked as loaded on a CPU other than the one that last loaded it
+static void forget_elsewhere(fpu_ctx_t *ctx, int cpu) {
+    for (int i = 0; i < SMP_MAX_CPUS; ++i) {
+        if (i == cpu) continue;
+        fpu_ctx_t *expected = ctx;
+        __atomic_compare_exchange_n(&fpu_cpus[i].loaded, &expected, NULL, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+}
+
+static void cpu_setup(void) {
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+
+    uint64_t cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (use_xsave) cr4 |= CR4_OSXSAVE;
+    __asm__ volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    if (use_xsave) {
+        __asm__ volatile ("xsetbv" :: "c"(0), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)));
+    }
+    state_reset();
+
+    fpu_cpu_t *c = &fpu_cpus[smp_cpu_id()];
+    c->ts = 0;
+    stts(c);
+}
+
+void fpu_init(void) {
+    uint32_t ecx, edx;
+    cpuid(1, 0, 0, 0, &ecx, &edx);
+    if (!(edx & CPUID1_EDX_FXSR) || !(edx & CPUID1_EDX_SSE2)) {
+        tty_putstr("[FPU] No FXSAVE/SSE2, vector registers stay disabled\n");
+        return;
+    }
+    if (ecx & CPUID1_ECX_XSAVE) {
+        use_xsave = 1;
+        xcr0 = XCR0_X87 | XCR0_SSE;
+        // Larger components (AVX-512, AMX) are left off to keep save areas small
+        if (ecx & CPUID1_ECX_AVX) xcr0 |= XCR0_AVX;
+    }
+    cpu_setup();
+    if (use_xsave) {
+        uint32_t eax, ebx;
+        // EBX: area size for the components enabled in XCR0
+        cpuid(0xD, 0, 0, &ebx, 0, 0);
+        if (ebx > sizeof(init_area)) {
+            tty_putstr("[FPU] XSAVE area too large\n");
+            return;
+        }
+        area_size = ebx;
+        cpuid(0xD, 1, &eax, 0, 0, 0);
+        use_xsaveopt = eax & 1;
+    }
+    fpu_cache = kmem_cache_create("fpu_state", area_size, 64, NULL);
+    if (!fpu_cache) {
+        tty_putstr("[FPU] No memory for save areas\n");
+        return;
+    }
+
+    // Capture the initial state. XSAVE only writes the components in use, so start from zero.
+    fpu_cpu_t *c = &fpu_cpus[smp_cpu_id()];
+    clts(c);
+    state_reset();
+    memset_k(init_area, 0, sizeof(init_area));
+    if (use_xsave) __asm__ volatile ("xsave64 (%0)" :: "r"(init_area), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)) : "memory");
+    else __asm__ volatile ("fxsave64 (%0)" :: "r"(init_area) : "memory");
+    stts(c);
+    fpu_up = 1;
+
+    tty_putstr("[FPU] ");
+    tty_putstr(use_xsave ? (xcr0 & XCR0_AVX ? "XSAVE, x87/SSE/AVX" : "XSAVE, x87/SSE") : "FXSAVE, x87/SSE");
+    tty_putstr(", lazy switching\n");
+}
+
+void fpu_init_cpu(void) {
+    if (fpu_up) cpu_setup();
+}
+
+int fpu_ready(void) {
+    return fpu_up;
+}
+
+void fpu_switch(fpu_ctx_t *prev, fpu_ctx_t *next) {
+    if (!fpu_up) return;
+    int cpu = smp_cpu_id();
+    fpu_cpu_t *c = &fpu_cpus[cpu];
+    if (c->active) {
+        // Only the running task can be active, and it has an area (fpu_trap gave it one)
+        if (prev && c->loaded == prev && prev->area) {
+            state_save(prev->area);
+            c->saves++;
+        } else {
+            c->loaded = NULL;
+        }
+        c->active = 0;
+    }
+    if (next && next->area && c->loaded == next) {
+        // Nothing else used the FPU here since next was switched out
+        clts(c);
+        c->active = 1;
+        c->reuses++;
+    } else {
+        stts(c);
+    }
+}
+
+void fpu_trap(fpu_ctx_t *cur) {
+    int cpu = smp_cpu_id();
+    fpu_cpu_t *c = &fpu_cpus[cpu];
+    c->traps++;
+    clts(c);
+    if (!fpu_up || !cur) return;
+    if (!cur->area) {
+        cur->area = (uint8_t *)kmem_cache_alloc(fpu_cache);
+        if (!cur->area) {
+            // Run on the initial state; it is not kept across switches
+            tty_putstr("[FPU] No memory for a save area\n");
+            state_restore(init_area);
+            c->loaded = NULL;
+            c->active = 0;
+            return;
+        }
+        for (uint32_t i = 0; i < area_size; ++i) cur->area[i] = init_area[i];
+    }
+    if (c->loaded != cur) {
+        state_restore(cur->area);
+        c->restores++;
+        c->loaded = cur;
+        forget_elsewhere(cur, cpu);
+    }
+    c->active = 1;
+}
+
+int fpu_fork(fpu_ctx_t *child, fpu_ctx_t *parent) {
+    child->area = NULL;
+    if (!fpu_up || !parent->area) return 0;
+    uint64_t flags = irq_save();
+    fpu_cpu_t *c = &fpu_cpus[smp_cpu_id()];
+    // The parent's newest state may only be in the registers
+    if (c->active && c->loaded == parent) {
+        clts(c);
+        state_save(parent->area);
+        c->saves++;
+    }
+    uint8_t *area = (uint8_t *)kmem_cache_alloc(fpu_cache);
+    if (area) {
+        for (uint32_t i = 0; i < area_size; ++i) area[i] = parent->area[i];
+    }
+    irq_restore(flags);
+    child->area = area;
+    return area ? 0 : -1;
+}
+
+void fpu_release(fpu_ctx_t *ctx) {
+    if (!ctx->area) return;
+    forget_elsewhere(ctx, -1);
+    kmem_cache_free(fpu_cache, ctx->area);
+    ctx->area = NULL;
+}
+
+void kernel_fpu_begin(void) {
+    uint64_t flags = irq_save();
+    fpu_cpu_t *c = &fpu_cpus[smp_cpu_id()];
+    if (c->depth++ > 0) return;
+    c->irq_flags = flags;
+    if (!fpu_up) return;
+    c->kernel_sections++;
+    clts(c);
+    if (c->active && c->loaded && c->loaded->area) {
+        state_save(c->loaded->area);
+        c->saves++;
+    }
+    // The registers are about to be clobbered; the task reloads its state on its next FPU use
+    c->loaded = NULL;
+    c->active = 0;
+    state_reset();
+}
+
+void kernel_fpu_end(void) {
+    fpu_cpu_t *c = &fpu_cpus[smp_cpu_id()];
+    if (c->depth == 0 || --c->depth > 0) return;
+    if (fpu_up) stts(c);
+    irq_restore(c->irq_flags);
+}
+
+void fpu_get_stats(fpu_stats_t *out) {
+    if (!out) return;
+    memset_k(out, 0, sizeof(*out));
+    out->xsave = use_xsave;
+    out->xsaveopt = use_xsaveopt;
+    out->xcr0 = xcr0;
+    out->area_size = area_size;
+    for (int i = 0; i < SMP_MAX_CPUS; ++i) {
+        out->traps += fpu_cpus[i].traps;
+        out->restores += fpu_cpus[i].restores;
+        out->saves += fpu_cpus[i].saves;
+        out->reuses += fpu_cpus[i].reuses;
+        out->kernel_sections += fpu_cpus[i].kernel_sections;
+    }
+}
@@ -6,6 +6,12 @@
 #include <kernel/sys/tty.h>
 #include <cpu/ports.h>
 #include <kernel/arch/x86_64/vmm.h>
+#include <kernel/arch/x86_64/mm.h>
+#include <kernel/arch/x86_64/apic.h>
+#include <kernel/sys/hrtimer.h>
+#include <kernel/sys/scheduler.h>
+#include <kernel/arch/x86_64/kstack.h>
+#include <cpu/gdt.h>
 
 // IDT entries and pointer
 static idt_entry_t idt[IDT_ENTRIES];
@@ -77,24 +83,22 @@ void idt_init(void) {
     // Remap PIC
     pic_remap();
 
-    // Program PIT for timer interrupts (~100Hz)
-    outb(0x43, 0x36); // channel 0, mode 3, binary
-    outb(0x40, 0x9B); // divisor low
-    outb(0x40, 0x2E); // divisor high
-
-    // Unmask timer interrupt (IRQ0)
-    outb(PIC1_DATA, 0xFE);
+    // Mask every legacy IRQ; drivers unmask their own. Timer interrupts come from the local
+    // APIC (hrtimer.c), so the PIT's channel 0 is left unprogrammed.
+    outb(PIC1_DATA, 0xFF);
 
     // Install CPU exception handlers (ISRs)
     idt_set_gate(0, (uint64_t)isr0, 0x08, 0x8E);
     idt_set_gate(1, (uint64_t)isr1, 0x08, 0x8E);
     idt_set_gate(2, (uint64_t)isr2, 0x08, 0x8E);
+    idt[2].ist = TSS_IST_NMI;
     idt_set_gate(3, (uint64_t)isr3, 0x08, 0x8E);
     idt_set_gate(4, (uint64_t)isr4, 0x08, 0x8E);
     idt_set_gate(5, (uint64_t)isr5, 0x08, 0x8E);
     idt_set_gate(6, (uint64_t)isr6, 0x08, 0x8E);
     idt_set_gate(7, (uint64_t)isr7, 0x08, 0x8E);
     idt_set_gate(8, (uint64_t)isr8, 0x08, 0x8E);
+    idt[8].ist = TSS_IST_DOUBLE_FAULT;
     idt_set_gate(9, (uint64_t)isr9, 0x08, 0x8E);
     idt_set_gate(10, (uint64_t)isr10, 0x08, 0x8E);
     idt_set_gate(11, (uint64_t)isr11, 0x08, 0x8E);
@@ -105,6 +109,7 @@ void idt_init(void) {
     idt_set_gate(16, (uint64_t)isr16, 0x08, 0x8E);
     idt_set_gate(17, (uint64_t)isr17, 0x08, 0x8E);
     idt_set_gate(18, (uint64_t)isr18, 0x08, 0x8E);
+    idt[18].ist = TSS_IST_MACHINE_CHECK;
     idt_set_gate(19, (uint64_t)isr19, 0x08, 0x8E);
     idt_set_gate(20, (uint64_t)isr20, 0x08, 0x8E);
     idt_set_gate(21, (uint64_t)isr21, 0x08, 0x8E);
@@ -137,6 +142,13 @@ void idt_init(void) {
     idt_set_gate(46, (uint64_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint64_t)irq15, 0x08, 0x8E);
 
+    // Local APIC vectors
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint64_t)irq16, 0x08, 0x8E);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint64_t)irq17, 0x08, 0x8E);
+    idt_set_gate(LAPIC_RESCHED_VECTOR, (uint64_t)irq18, 0x08, 0x8E);
+    idt_set_gate(SCHED_YIELD_VECTOR, (uint64_t)irq19, 0x08, 0x8E);
+    idt_set_gate(SCHED_PREEMPT_VECTOR, (uint64_t)irq20, 0x08, 0x8E);
+
     // Load the IDT
     idt_load((uint64_t)&idt_ptr);
 
@@ -144,16 +156,41 @@ void idt_init(void) {
     __asm__ volatile("sti");
 }
 
+void idt_init_cpu(void) {
+    idt_load((uint64_t)&idt_ptr);
+}
+
 // ISR handler
 void isr_handler(uint64_t int_no, uint64_t error_code, uint64_t *frame) {
+    if (int_no == 7) {
+        // Device not available: first FPU/SSE instruction since CR0.TS was set
+        scheduler_fpu_trap();
+        return;
+    }
     if (int_no == 14) {
+        uint64_t cr2;
+        __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+        // First touch of a demand-paged user page: map it and retry the instruction
+        if (mm_handle_fault(vmm_get_cr3(), cr2, error_code) == 0) return;
+        if (kstack_is_guard(cr2)) tty_putstr("Kernel stack overflow. ");
         /* Minimal, safe page-fault handler: print error, CR2 and RIP, then halt.
            Avoid dereferencing page-tables here to prevent boot-time faults. */
         tty_putstr("Page fault (int 14) error_code=");
         tty_puthex64(error_code);
         tty_putstr(" cr2=");
+        tty_puthex64(cr2);
+        if (frame) {
+            tty_putstr(" rip=");
+            tty_puthex64(frame[0]);
+        }
+        tty_putstr(" — halting.\n");
+        __asm__ volatile("cli; hlt");
+    } else if (int_no == 8) {
+        // Runs on its own IST stack. A push onto an overflowed stack leaves CR2 in the guard page.
         uint64_t cr2;
         __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+        tty_putstr(kstack_is_guard(cr2) ? "Kernel stack overflow" : "Double fault");
+        tty_putstr(" (int 8) cr2=");
         tty_puthex64(cr2);
         if (frame) {
             tty_putstr(" rip=");
@@ -187,7 +224,7 @@ void isr_handler(uint64_t int_no, uint64_t error_code, uint64_t *frame) {
 
         // Page table walk for rip
         if (rip) {
-            uint64_t *pml4 = (uint64_t *)(uintptr_t)cr3;
+            uint64_t *pml4 = (uint64_t *)(uintptr_t)(cr3 & VMM_CR3_ADDR_MASK);
             size_t i4 = (rip >> 39) & 0x1FF;
             uint64_t pml4val = pml4[i4];
             tty_putstr(" pml4["); tty_putdec(i4); tty_putstr("]="); tty_puthex64(pml4val);
@@ -232,12 +269,45 @@ void isr_handler(uint64_t int_no, uint64_t error_code, uint64_t *frame) {
 // External keyboard handler
 extern void keyboard_handler(void);
 
+// Handlers of the PIC lines drivers asked for
+static void (*irq_handlers[16])(void);
+
+int irq_install_handler(uint8_t irq, void (*handler)(void)) {
+    if (irq >= 16 || irq == 2 || !handler || irq_handlers[irq]) return -1;
+    irq_handlers[irq] = handler;
+    if (irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        // The slave reaches the CPU through the cascade line
+        outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << 2));
+    } else {
+        outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+    }
+    return 0;
+}
+
 // IRQ handler
 void irq_handler(uint64_t irq_no) {
+    // Local APIC interrupts are acknowledged to the APIC; a spurious one needs no EOI at all
+    if (irq_no == LAPIC_TIMER_VECTOR) {
+        lapic_eoi();
+        hrtimer_interrupt();
+        return;
+    }
+    if (irq_no == LAPIC_RESCHED_VECTOR) {
+        // The scheduler runs after every IRQ; this one only makes sure it switches
+        lapic_eoi();
+        return;
+    }
+    if (irq_no == LAPIC_SPURIOUS_VECTOR) return;
+    // Raised by the task itself; the scheduler switches away right after
+    if (irq_no == SCHED_YIELD_VECTOR || irq_no == SCHED_PREEMPT_VECTOR) return;
+
     // Handle specific IRQs
     if (irq_no == 33) {
         // IRQ1 - Keyboard
         keyboard_handler();
+    } else if (irq_no >= 32 && irq_no < 48 && irq_handlers[irq_no - 32]) {
+        irq_handlers[irq_no - 32]();
     }
     
     // Send End of Interrupt (EOI) to PIC
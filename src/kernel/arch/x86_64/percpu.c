@@ -0,0 +1,33 @@
+// Per-CPU data blocks, reached through GS_BASE (see percpu.h)
+#include <kernel/arch/x86_64/percpu.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <cpu/msr.h>
+#include <stddef.h>
+
+_Static_assert(offsetof(percpu_t, self) == PERCPU_SELF, "percpu layout");
+_Static_assert(offsetof(percpu_t, kernel_rsp) == PERCPU_KERNEL_RSP, "percpu layout");
+_Static_assert(offsetof(percpu_t, user_rsp) == PERCPU_USER_RSP, "percpu layout");
+_Static_assert(offsetof(percpu_t, syscall_frame) == PERCPU_SYSCALL_FRAME, "percpu layout");
+_Static_assert(offsetof(percpu_t, cpu) == PERCPU_CPU, "percpu layout");
+_Static_assert(offsetof(percpu_t, preempt_count) == PERCPU_PREEMPT_COUNT, "percpu layout");
+_Static_assert(offsetof(percpu_t, current) == PERCPU_CURRENT, "percpu layout");
+_Static_assert(offsetof(percpu_t, syscalls) == PERCPU_SYSCALLS, "percpu layout");
+_Static_assert(offsetof(percpu_t, irqs) == PERCPU_IRQS, "percpu layout");
+_Static_assert(offsetof(percpu_t, exceptions) == PERCPU_EXCEPTIONS, "percpu layout");
+_Static_assert(offsetof(percpu_t, need_resched) == PERCPU_NEED_RESCHED, "percpu layout");
+
+static percpu_t blocks[SMP_MAX_CPUS];
+
+void percpu_init(int cpu) {
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS) return;
+    percpu_t *p = &blocks[cpu];
+    p->self = p;
+    p->cpu = cpu;
+    wrmsr(MSR_GS_BASE, (uint64_t)(uintptr_t)p);
+    // User mode always runs with a zero GS base; the exception stubs (interrupts.asm) rely on it
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+percpu_t *percpu_of(int cpu) {
+    return cpu >= 0 && cpu < SMP_MAX_CPUS ? &blocks[cpu] : NULL;
+}
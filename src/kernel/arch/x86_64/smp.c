@@ -0,0 +1,244 @@
+// Application processor bring-up. The MADT gives the local APIC ID of every CPU; each AP is sent
+// INIT, then STARTUP pointing at a copy of ap_trampoline.S below 1 MiB, which brings it to long
+// mode on the kernel's page table and into ap_main on a stack of its own.
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/arch/x86_64/apic.h>
+#include <kernel/arch/x86_64/idt.h>
+#include <kernel/arch/x86_64/pmm.h>
+#include <kernel/arch/x86_64/vmm.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <kernel/arch/x86_64/fpu.h>
+#include <kernel/arch/x86_64/percpu.h>
+#include <kernel/sys/scheduler.h>
+#include <kernel/sys/hrtimer.h>
+#include <kernel/sys/syscall.h>
+#include <kernel/sys/tty.h>
+#include <cpu/cpuid.h>
+#include <cpu/gdt.h>
+#include <cpu/msr.h>
+#include <stddef.h>
+
+#define AP_TRAMPOLINE_BASE 0x8000   // must match ap_trampoline.S; STARTUP vector 0x08
+#define AP_STACK_ORDER 2            // 16 KiB boot stack, which later backs the AP's idle task
+#define MSR_EFER 0xC0000080
+#define ACPI_MAPPED_LIMIT (4ULL * 1024 * 1024 * 1024)   // identity mapped by the bootloader
+
+// Multiboot2 tags carrying a copy of the ACPI RSDP
+#define MB2_TAG_ACPI_OLD 14
+#define MB2_TAG_ACPI_NEW 15
+
+// MADT entry types
+#define MADT_LOCAL_APIC 0
+#define MADT_LAPIC_ENABLED 0x1
+#define MADT_LAPIC_ONLINE_CAPABLE 0x2
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;            // revision 2 and later
+    uint64_t xsdt_address;
+} __attribute__((packed)) acpi_rsdp_t;
+
+extern char ap_trampoline_start[];
+extern char ap_trampoline_end[];
+extern uint64_t ap_boot_cr3, ap_boot_efer, ap_boot_stack, ap_boot_entry, ap_boot_cpu;
+
+static uint32_t cpu_apic_ids[SMP_MAX_CPUS];
+static volatile int cpu_online[SMP_MAX_CPUS] = { 1 };
+static int cpu_found = 1;           // CPUs listed by the MADT, the BSP at index 0
+static volatile int cpus_online = 1;
+static int smp_started = 0;
+
+static int acpi_valid(const acpi_header_t *h, const char *sig) {
+    if ((uint64_t)(uintptr_t)h >= ACPI_MAPPED_LIMIT) return 0;
+    for (int i = 0; i < 4; ++i) if (h->signature[i] != sig[i]) return 0;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < h->length; ++i) sum += ((const uint8_t *)h)[i];
+    return sum == 0;
+}
+
+static const acpi_header_t *find_madt(const acpi_rsdp_t *rsdp) {
+    int xsdt = rsdp->revision >= 2 && rsdp->xsdt_address;
+    const acpi_header_t *root = (const acpi_header_t *)(uintptr_t)(xsdt ? rsdp->xsdt_address : rsdp->rsdt_address);
+    if (!acpi_valid(root, xsdt ? "XSDT" : "RSDT")) return NULL;
+    uint32_t width = xsdt ? 8 : 4;
+    const uint8_t *entries = (const uint8_t *)root + sizeof(acpi_header_t);
+    uint32_t count = (root->length - sizeof(acpi_header_t)) / width;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t addr = xsdt ? *(const uint64_t *)(entries + i * 8) : *(const uint32_t *)(entries + i * 4);
+        const acpi_header_t *h = (const acpi_header_t *)(uintptr_t)addr;
+        if (acpi_valid(h, "APIC")) return h;
+    }
+    return NULL;
+}
+
+void smp_detect(void *multiboot_info) {
+    uint32_t ebx = 0;
+    cpuid(1, 0, 0, &ebx, 0, 0);
+    cpu_apic_ids[0] = ebx >> 24;
+    if (!multiboot_info) return;
+
+    const acpi_rsdp_t *rsdp = NULL;
+    uint8_t *mb = (uint8_t *)multiboot_info;
+    uint32_t total_size = *(uint32_t *)mb;
+    uint32_t offset = 8;
+    while (offset + 8 <= total_size) {
+        uint32_t type = *(uint32_t *)(mb + offset);
+        uint32_t size = *(uint32_t *)(mb + offset + 4);
+        if (type == 0 || size == 0) break;
+        // Prefer the ACPI 2.0 copy, which leads to the 64-bit XSDT
+        if (type == MB2_TAG_ACPI_NEW || (type == MB2_TAG_ACPI_OLD && !rsdp)) rsdp = (const acpi_rsdp_t *)(mb + offset + 8);
+        offset += (size + 7) & ~7u;
+    }
+    const acpi_header_t *madt = rsdp ? find_madt(rsdp) : NULL;
+    if (!madt) {
+        tty_putstr("[SMP] No MADT, running on the boot CPU only\n");
+        return;
+    }
+
+    // Local APIC address and flags precede the variable-length entries
+    const uint8_t *p = (const uint8_t *)madt + sizeof(acpi_header_t) + 8;
+    const uint8_t *end = (const uint8_t *)madt + madt->length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        if (p[0] == MADT_LOCAL_APIC && p[1] >= 8) {
+            uint8_t apic_id = p[3];
+            uint32_t flags = *(const uint32_t *)(p + 4);
+            if ((flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) && apic_id != cpu_apic_ids[0]) {
+                if (cpu_found < SMP_MAX_CPUS) cpu_apic_ids[cpu_found++] = apic_id;
+            }
+        }
+        p += p[1];
+    }
+    tty_putstr("[SMP] ");
+    tty_putdec((uint32_t)cpu_found);
+    tty_putstr(" CPUs in the MADT\n");
+}
+
+// Busy-wait using the calibrated TSC
+static void udelay(uint64_t us) {
+    uint64_t cycles = us * tsc_khz() / 1000;
+    uint64_t start = rdtsc();
+    while (rdtsc() - start < cycles) __asm__ volatile ("pause");
+}
+
+static int wait_online(int cpu, uint64_t us) {
+    uint64_t cycles = us * tsc_khz() / 1000;
+    uint64_t start = rdtsc();
+    while (!__atomic_load_n(&cpu_online[cpu], __ATOMIC_ACQUIRE)) {
+        if (rdtsc() - start >= cycles) return 0;
+        __asm__ volatile ("pause");
+    }
+    return 1;
+}
+
+// Write one of the ap_boot_* fields in the trampoline copy
+static void tramp_set(uint64_t *field, uint64_t value) {
+    uintptr_t off = (uintptr_t)field - (uintptr_t)ap_trampoline_start;
+    *(volatile uint64_t *)(uintptr_t)(AP_TRAMPOLINE_BASE + off) = value;
+}
+
+static void ap_main(uint64_t cpu) {
+    // smp_cpu_id() reads the per-CPU block, so it comes first
+    percpu_init((int)cpu);
+    gdt_init_cpu((int)cpu);
+    idt_init_cpu();
+    vmm_init_cpu();
+    fpu_init_cpu();
+    lapic_init();
+    hrtimer_cpu_init();
+    syscall_init_cpu();
+    scheduler_init_cpu((int)cpu);
+    __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cpu_online[cpu], 1, __ATOMIC_RELEASE);
+    // From here on this loop is the CPU's idle task. It takes no timer interrupts; a reschedule
+    // IPI wakes it when work is queued for it or another CPU has some to spare.
+    __asm__ volatile ("sti");
+    for (;;) __asm__ volatile ("hlt");
+}
+
+void smp_init(void) {
+    if (cpu_found <= 1) return;
+    if (!lapic_present()) {
+        tty_putstr("[SMP] No local APIC, running on the boot CPU only\n");
+        return;
+    }
+    if (!tsc_khz()) {
+        tty_putstr("[SMP] TSC not calibrated, cannot time the start-up IPIs\n");
+        return;
+    }
+    // The CR3 the trampoline loads is 32 bits wide
+    uint64_t cr3 = vmm_get_cr3() & VMM_CR3_ADDR_MASK;
+    if (cr3 >= ACPI_MAPPED_LIMIT) return;
+
+    cpu_apic_ids[0] = lapic_id();
+
+    size_t len = (size_t)(ap_trampoline_end - ap_trampoline_start);
+    uint8_t *dst = (uint8_t *)(uintptr_t)AP_TRAMPOLINE_BASE;
+    for (size_t i = 0; i < len; ++i) dst[i] = (uint8_t)ap_trampoline_start[i];
+    tramp_set(&ap_boot_cr3, cr3);
+    tramp_set(&ap_boot_efer, rdmsr(MSR_EFER));
+    tramp_set(&ap_boot_entry, (uint64_t)(uintptr_t)ap_main);
+    smp_started = 1;
+
+    for (int cpu = 1; cpu < cpu_found; ++cpu) {
+        uint8_t *stack = (uint8_t *)pmm_alloc_pages(AP_STACK_ORDER);
+        if (!stack) {
+            tty_putstr("[SMP] Out of memory for AP stacks\n");
+            break;
+        }
+        // Each AP reads its fields before it reports in, so once it has they can be reused for the next one
+        tramp_set(&ap_boot_stack, (uint64_t)(uintptr_t)(stack + (PMM_PAGE_SIZE << AP_STACK_ORDER)));
+        tramp_set(&ap_boot_cpu, (uint64_t)cpu);
+        uint32_t id = cpu_apic_ids[cpu];
+        lapic_send_init(id);
+        udelay(10000);
+        lapic_send_startup(id, AP_TRAMPOLINE_BASE >> 12);
+        if (!wait_online(cpu, 1000)) {
+            // A second STARTUP is part of the sequence for CPUs that missed the first
+            lapic_send_startup(id, AP_TRAMPOLINE_BASE >> 12);
+            if (!wait_online(cpu, 100000)) {
+                // Keep the stack: the AP could still wake up and run on it. It would also read the
+                // trampoline fields whenever it does, so they can't be handed to another AP.
+                tty_putstr("[SMP] CPU with APIC ID ");
+                tty_putdec(id);
+                tty_putstr(" did not start, not starting the rest\n");
+                break;
+            }
+        }
+    }
+    tty_putstr("[SMP] ");
+    tty_putdec((uint32_t)cpus_online);
+    tty_putstr(" CPUs online\n");
+}
+
+int smp_cpu_id(void) {
+    if (!smp_started) return 0;
+    return this_cpu()->cpu;
+}
+
+int smp_cpu_count(void) {
+    return cpus_online;
+}
+
+int smp_cpu_online(int cpu) {
+    return cpu >= 0 && cpu < SMP_MAX_CPUS && cpu_online[cpu];
+}
+
+uint32_t smp_cpu_apic_id(int cpu) {
+    return (cpu >= 0 && cpu < cpu_found) ? cpu_apic_ids[cpu] : 0;
+}
@@ -0,0 +1,88 @@
+#include <kernel/arch/x86_64/tsc.h>
+#include <kernel/sys/tty.h>
+#include <cpu/ports.h>
+
+// PIT runs at 1.193182 MHz; channel 2 is gated through port 0x61 and its output can be polled there
+#define PIT_HZ           1193182ULL
+#define PIT_CH2_DATA     0x42
+#define PIT_COMMAND      0x43
+#define PIT_GATE_PORT    0x61
+#define CALIBRATE_MS     10
+
+static uint64_t tsc_freq_khz = 0;
+
+void tsc_init(void) {
+    uint16_t count = (uint16_t)(PIT_HZ * CALIBRATE_MS / 1000);
+
+    // Gate high, speaker off
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
+
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count), binary
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CH2_DATA, count & 0xFF);
+    outb(PIT_CH2_DATA, count >> 8);
+
+    // Restart the count by pulsing the gate, then wait for OUT2 to go high
+    uint8_t v = inb(PIT_GATE_PORT) & ~0x01;
+    outb(PIT_GATE_PORT, v);
+    outb(PIT_GATE_PORT, v | 0x01);
+    uint64_t start = rdtsc();
+    uint64_t spins = 0;
+    while (!(inb(PIT_GATE_PORT) & 0x20)) {
+        if (++spins > 100000000ULL) break;
+    }
+    uint64_t end = rdtsc();
+
+    outb(PIT_GATE_PORT, gate);
+
+    if (spins > 100000000ULL) {
+        tty_putstr("[TSC] PIT calibration timed out\n");
+        tsc_freq_khz = 0;
+        return;
+    }
+    tsc_freq_khz = (end - start) / CALIBRATE_MS;
+
+    tty_putstr("[TSC] ");
+    tty_putdec((uint32_t)(tsc_freq_khz / 1000));
+    tty_putstr(" MHz\n");
+}
+
+uint64_t tsc_khz(void) {
+    return tsc_freq_khz;
+}
+
+uint64_t tsc_cycles_to_ns(uint64_t cycles) {
+    if (!tsc_freq_khz) return 0;
+    // Split to avoid overflowing cycles * 1000000 on long intervals
+    return (cycles / tsc_freq_khz) * 1000000ULL + ((cycles % tsc_freq_khz) * 1000000ULL) / tsc_freq_khz;
+}
+
+void tsc_summarize(uint64_t *samples, uint32_t count, tsc_summary_t *out) {
+    out->count = count;
+    out->min = out->p50 = out->p90 = out->p99 = out->max = out->mean = 0;
+    if (!count) return;
+    // Shell sort with Ciura's gaps: no recursion and no scratch memory
+    static const uint32_t gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+    for (uint32_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); ++g) {
+        uint32_t gap = gaps[g];
+        for (uint32_t i = gap; i < count; ++i) {
+            uint64_t v = samples[i];
+            uint32_t j = i;
+            while (j >= gap && samples[j - gap] > v) {
+                samples[j] = samples[j - gap];
+                j -= gap;
+            }
+            samples[j] = v;
+        }
+    }
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < count; ++i) sum += samples[i];
+    out->min = samples[0];
+    out->max = samples[count - 1];
+    // Nearest-rank percentiles
+    out->p50 = samples[(count * 50 + 99) / 100 - 1];
+    out->p90 = samples[(count * 90 + 99) / 100 - 1];
+    out->p99 = samples[(count * 99 + 99) / 100 - 1];
+    out->mean = sum / count;
+}
@@ -13,6 +13,20 @@
 #include <kernel/net/tcp.h>
 #include <kernel/net/http.h>
 #include <kernel/sys/syscall.h>
+#include <kernel/arch/x86_64/pmm.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <kernel/sys/slab.h>
+#include <kernel/sys/kmalloc.h>
+#include <kernel/arch/x86_64/vmm.h>
+#include <kernel/arch/x86_64/kstack.h>
+#include <kernel/arch/x86_64/fpu.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/arch/x86_64/percpu.h>
+#include <kernel/arch/x86_64/apic.h>
+#include <kernel/sys/hrtimer.h>
+#include <kernel/sys/scheduler.h>
+#include <kernel/sys/bench.h>
+#include <kernel/sys/lockstat.h>
 
 extern void tty_putchar_internal(char c);
 extern size_t tty_row;
@@ -23,6 +37,82 @@ extern int cmd_buffer_pos;
 extern int cmd_cursor_pos;
 extern void cmd_vm(const char* filename);
 
+// net_wait conditions of the ping command; `arg` records a Ctrl+C seen while waiting
+static int ping_interrupted(void* arg) {
+    int* stopped = (int*)arg;
+    if (tty_check_stop()) *stopped = 1;
+    return *stopped;
+}
+
+static int ping_answered(void* arg) {
+    return ping_reply_received || ping_interrupted(arg);
+}
+
+// One line of the bench table: `count` samples from a bench_* run, or -1 if it could not run
+static void bench_report(const char* name, uint64_t* samples, int count) {
+    tty_putstr(name);
+    if (count <= 0) {
+        tty_putstr("unavailable\n");
+        return;
+    }
+    tsc_summary_t ts;
+    tsc_summarize(samples, (uint32_t)count, &ts);
+    tty_putstr("min ");
+    tty_putdec((uint32_t)ts.min);
+    tty_putstr(", p50 ");
+    tty_putdec((uint32_t)ts.p50);
+    tty_putstr(", p90 ");
+    tty_putdec((uint32_t)ts.p90);
+    tty_putstr(", p99 ");
+    tty_putdec((uint32_t)ts.p99);
+    tty_putstr(", max ");
+    tty_putdec((uint32_t)ts.max);
+    tty_putstr(" cycles; p50 ");
+    tty_putdec((uint32_t)tsc_cycles_to_ns(ts.p50));
+    tty_putstr(" ns, p99 ");
+    tty_putdec((uint32_t)tsc_cycles_to_ns(ts.p99));
+    tty_putstr(" ns\n");
+}
+
+#if LOCK_STATS
+static void lockstat_report(const lock_stat_t* s) {
+    tty_putstr("  ");
+    tty_putstr(s->name ? s->name : "?");
+    tty_putstr(": ");
+    tty_putdec((uint32_t)s->acquisitions);
+    tty_putstr(" taken, ");
+    tty_putdec((uint32_t)s->contended);
+    tty_putstr(" contended");
+    if (s->contended) {
+        tty_putstr(", wait avg ");
+        tty_putdec((uint32_t)(s->wait_cycles / s->contended));
+        tty_putstr(" max ");
+        tty_putdec((uint32_t)s->max_wait_cycles);
+    }
+    if (s->acquisitions) {
+        tty_putstr(", hold avg ");
+        tty_putdec((uint32_t)(s->hold_cycles / s->acquisitions));
+        tty_putstr(" max ");
+        tty_putdec((uint32_t)s->max_hold_cycles);
+    }
+    tty_putstr(" cycles\n    hold:");
+    // Only the non-empty buckets, each labelled with its upper bound in cycles
+    for (int b = 0; b < LOCK_HIST_BUCKETS; ++b) {
+        if (!s->hold_hist[b]) continue;
+        if (b == LOCK_HIST_BUCKETS - 1) {
+            tty_putstr(" >=");
+            tty_putdec(1U << (LOCK_HIST_SHIFT + b));
+        } else {
+            tty_putstr(" <");
+            tty_putdec(1U << (LOCK_HIST_SHIFT + b + 1));
+        }
+        tty_putstr(":");
+        tty_putdec((uint32_t)s->hold_hist[b]);
+    }
+    tty_putstr("\n");
+}
+#endif
+
 void tty_process_command(void) {
     cmd_buffer[cmd_buffer_pos] = '\0'; // Null terminate
     
@@ -57,6 +147,14 @@ void tty_process_command(void) {
             tty_putstr("  dns      - Resolve hostname to IP (dns hostname)\n");
             tty_putstr("  fetch    - Fetch a webpage (fetch http://url)\n");
             tty_putstr("  exec     - Execute ELF binary in user mode (exec filename [args])\n");
+            tty_putstr("  pmmbench - Benchmark physical page allocation strategies\n");
+            tty_putstr("  slabinfo - Show slab cache usage (live/peak objects)\n");
+            tty_putstr("  heapstat - Show heap fragmentation and top kmalloc call sites\n");
+            tty_putstr("  vmstat   - Show page mappings by size (4K/2M/1G) and kernel stacks\n");
+            tty_putstr("  cr3bench - Measure address-space switch cost with and without PCIDs and global pages\n");
+            tty_putstr("  cpus     - Show online CPUs, their run queues and timers\n");
+            tty_putstr("  bench    - Measure syscall, context switch, IRQ and page fault latency\n");
+            tty_putstr("  lockstat - Show lock contention and hold times (lockstat reset to clear)\n");
             tty_putstr("  reboot   - Reboot the system\n");
             tty_putstr("  shutdown  - Shut down the system\n");
         } else if (strncmp(cmd_buffer, "cls", 3) == 0) {
@@ -681,18 +779,16 @@ void tty_process_command(void) {
                     
                     // Try to send ping (may fail if ARP not resolved)
                     int sent = 0;
+                    int stopped = 0;
                     if (icmp_send_echo(iface, ip, 1, 1, "DanOS", 5) == 0) {
                         sent = 1;
                     } else {
                         tty_putstr("Resolving MAC address...\n");
-                        // Wait for ARP reply (up to ~2 seconds)
-                        for (volatile int i = 0; i < 20000000 && !sent; i++) {
-                            e1000_poll();
-                            if (i % 5000000 == 0 && i > 0) {
-                                // Retry sending ping
-                                if (icmp_send_echo(iface, ip, 1, 1, "DanOS", 5) == 0) {
-                                    sent = 1;
-                                }
+                        // Wait for the ARP reply, retrying every 500 ms (up to 2 seconds)
+                        for (int tries = 0; tries < 4 && !sent && !stopped; tries++) {
+                            net_wait(ping_interrupted, &stopped, 500000000ULL);
+                            if (!stopped && icmp_send_echo(iface, ip, 1, 1, "DanOS", 5) == 0) {
+                                sent = 1;
                             }
                         }
                     }
@@ -700,39 +796,24 @@ void tty_process_command(void) {
                     if (sent) {
                         tty_putstr("Waiting for reply (30s timeout)...\n");
                         
-                        // Wait up to 30 seconds for reply
-                        // ~100 million iterations ≈ 30 seconds on typical QEMU speed
-                        int timeout = 0;
-                        for (volatile uint32_t i = 0; i < 100000000; i++) {
-                            e1000_poll();
-                            
-                            if (ping_reply_received) {
-                                // Got a reply!
-                                char reply_ip[16];
-                                ip_to_string(ping_reply_from, reply_ip);
-                                tty_putstr("Reply from ");
-                                tty_putstr(reply_ip);
-                                tty_putstr(": seq=");
-                                tty_putdec(ping_reply_seq);
-                                tty_putstr("\n");
-                                timeout = 0;
-                                break;
-                            }
-                            
-                            // Check for Ctrl+C (stop signal)
-                            if (tty_check_stop()) {
-                                tty_putstr("\nPing interrupted.\n");
-                                timeout = 0;
-                                break;
-                            }
-                        }
-                        
-                        if (!ping_reply_received && timeout == 0) {
-                            // Loop finished without reply and wasn't interrupted
-                            if (!tty_check_stop()) {
-                                tty_putstr("Request timed out.\n");
-                            }
+                        // Sleep until the reply, Ctrl+C or 30 seconds
+                        net_wait(ping_answered, &stopped, 30000000000ULL);
+                        if (ping_reply_received) {
+                            // Got a reply!
+                            char reply_ip[16];
+                            ip_to_string(ping_reply_from, reply_ip);
+                            tty_putstr("Reply from ");
+                            tty_putstr(reply_ip);
+                            tty_putstr(": seq=");
+                            tty_putdec(ping_reply_seq);
+                            tty_putstr("\n");
+                        } else if (stopped) {
+                            tty_putstr("\nPing interrupted.\n");
+                        } else {
+                            tty_putstr("Request timed out.\n");
                         }
+                    } else if (stopped) {
+                        tty_putstr("\nPing interrupted.\n");
                     } else {
                         tty_putstr("Failed to send ping (could not resolve MAC)\n");
                     }
@@ -979,6 +1060,295 @@ void tty_process_command(void) {
                     tty_putstr("Failed to execute program\n");
                 }
             }
+        } else if (strncmp(cmd_buffer, "pmmbench", 8) == 0 && strlength(cmd_buffer) == 8) {
+            pmm_bench_t bench;
+            pmm_benchmark(1024, &bench);
+            uint64_t khz = tsc_khz();
+            if (bench.count == 0 || khz == 0) {
+                tty_putstr("pmmbench: no free pages or TSC not calibrated\n");
+            } else {
+                const char *names[3] = { "  bit scan (original) : ", "  word scan + cursor  : ", "  buddy free lists    : " };
+                uint64_t cycles[3] = { bench.bitscan_cycles, bench.wordscan_cycles, bench.buddy_cycles };
+                tty_putstr("Single-page allocations: ");
+                tty_putdec((uint32_t)bench.count);
+                tty_putstr(" (free pages: ");
+                tty_putdec((uint32_t)pmm_free_pages());
+                tty_putstr(")\n");
+                for (int i = 0; i < 3; i++) {
+                    uint64_t c = cycles[i] ? cycles[i] : 1;
+                    tty_putstr(names[i]);
+                    tty_putdec((uint32_t)((bench.count * khz * 1000ULL) / c));
+                    tty_putstr(" allocs/s, ");
+                    tty_putdec((uint32_t)(c / bench.count));
+                    tty_putstr(" cycles/alloc\n");
+                }
+            }
+        } else if (strncmp(cmd_buffer, "slabinfo", 8) == 0 && strlength(cmd_buffer) == 8) {
+            kmem_cache_info_t info;
+            tty_putstr("cache            objsize  live / peak  slabs x objs\n");
+            for (int i = 0; kmem_cache_info(i, &info) == 0; i++) {
+                int n = strlength(info.name);
+                tty_putstr(info.name);
+                for (int pad = n; pad < 17; pad++) tty_putstr(" ");
+                tty_putdec((uint32_t)info.obj_size);
+                tty_putstr("  ");
+                tty_putdec((uint32_t)info.live);
+                tty_putstr(" / ");
+                tty_putdec((uint32_t)info.peak);
+                tty_putstr("  ");
+                tty_putdec((uint32_t)info.slabs);
+                tty_putstr(" x ");
+                tty_putdec(info.per_slab);
+                tty_putstr("\n");
+            }
+        } else if (strncmp(cmd_buffer, "heapstat", 8) == 0 && strlength(cmd_buffer) == 8) {
+            kmalloc_heap_stats_t hs;
+            kmalloc_heap_stats(&hs);
+            tty_putstr("Heap: ");
+            tty_putdec((uint32_t)(hs.heap_bytes / 1024));
+            tty_putstr(" KiB mapped, ");
+            tty_putdec((uint32_t)(hs.free_bytes / 1024));
+            tty_putstr(" KiB free in ");
+            tty_putdec((uint32_t)hs.free_blocks);
+            tty_putstr(" blocks, largest free ");
+            tty_putdec((uint32_t)hs.largest_free);
+            tty_putstr(" bytes\n");
+            tty_putstr("Free-list walk: ");
+            tty_putdec((uint32_t)hs.walk_cycles);
+            tty_putstr(" cycles (");
+            tty_putdec((uint32_t)tsc_cycles_to_ns(hs.walk_cycles));
+            tty_putstr(" ns)\n");
+            tty_putstr("Fit searches: ");
+            tty_putdec((uint32_t)hs.search_count);
+            if (hs.search_count) {
+                tty_putstr(", avg ");
+                tty_putdec((uint32_t)(hs.search_cycles / hs.search_count));
+                tty_putstr(" cycles, max ");
+                tty_putdec((uint32_t)hs.search_max_cycles);
+                tty_putstr(" cycles");
+            }
+            tty_putstr("\n");
+            // Top call sites by live bytes; resolve the addresses against the kernel map
+            tty_putstr("Call sites in use: ");
+            tty_putdec(hs.sites_used);
+            tty_putstr("\n  caller              live bytes  live  peak bytes  allocs\n");
+            int shown[10];
+            int nshown = 0;
+            while (nshown < 10) {
+                int best = -1;
+                uint64_t best_bytes = 0;
+                kmalloc_site_t st;
+                for (int i = 0; kmalloc_site_info(i, &st) == 0; i++) {
+                    if (st.allocs == 0 || (best >= 0 && st.live_bytes <= best_bytes)) continue;
+                    int dup = 0;
+                    for (int k = 0; k < nshown; k++) if (shown[k] == i) dup = 1;
+                    if (dup) continue;
+                    best = i;
+                    best_bytes = st.live_bytes;
+                }
+                if (best < 0) break;
+                shown[nshown++] = best;
+                kmalloc_site_info(best, &st);
+                tty_putstr("  ");
+                if (st.caller) tty_puthex64(st.caller);
+                else tty_putstr("(other)           ");
+                tty_putstr("  ");
+                tty_putdec((uint32_t)st.live_bytes);
+                tty_putstr("  ");
+                tty_putdec((uint32_t)st.live_count);
+                tty_putstr("  ");
+                tty_putdec((uint32_t)st.peak_bytes);
+                tty_putstr("  ");
+                tty_putdec((uint32_t)st.allocs);
+                tty_putstr("\n");
+            }
+        } else if (strncmp(cmd_buffer, "vmstat", 6) == 0 && strlength(cmd_buffer) == 6) {
+            vmm_stats_t vs;
+            vmm_get_stats(&vs);
+            tty_putstr("Leaf mappings in current address space:\n  4 KiB: ");
+            tty_putdec((uint32_t)vs.pages_4k);
+            tty_putstr("\n  2 MiB: ");
+            tty_putdec((uint32_t)vs.pages_2m);
+            tty_putstr("\n  1 GiB: ");
+            tty_putdec((uint32_t)vs.pages_1g);
+            tty_putstr(vs.gib_pages ? "\n" : " (not supported by CPU)\n");
+            tty_putstr("Page-table pages: ");
+            tty_putdec((uint32_t)vs.table_pages);
+            tty_putstr("\nLarge-page splits: 2M->4K ");
+            tty_putdec((uint32_t)vs.splits_2m);
+            tty_putstr(", 1G->2M ");
+            tty_putdec((uint32_t)vs.splits_1g);
+            tty_putstr("\nTLB flushes: invlpg ");
+            tty_putdec((uint32_t)vs.invlpg_flushes);
+            tty_putstr(", full ");
+            tty_putdec((uint32_t)vs.full_flushes);
+            tty_putstr("\nCopy-on-write: shared ");
+            tty_putdec((uint32_t)vs.cow_shared);
+            tty_putstr(", copied ");
+            tty_putdec((uint32_t)vs.cow_copies);
+            tty_putstr(", reused ");
+            tty_putdec((uint32_t)vs.cow_reuses);
+            tty_putstr("\nGlobal pages: ");
+            tty_putstr(vs.global_pages ? "on, " : "off, ");
+            tty_putdec((uint32_t)vs.global_leaves);
+            tty_putstr(" global leaves\nCR3 switches: ");
+            tty_putdec((uint32_t)vs.cr3_switches);
+            tty_putstr(", flushing ");
+            tty_putdec((uint32_t)vs.cr3_flushing);
+            kstack_stats_t ks;
+            kstack_get_stats(&ks);
+            tty_putstr("\nKernel stacks (");
+            tty_putdec((uint32_t)(KSTACK_SIZE / 1024));
+            tty_putstr(" KiB): in use ");
+            tty_putdec((uint32_t)ks.in_use);
+            tty_putstr(", cached ");
+            tty_putdec((uint32_t)ks.cached);
+            tty_putstr(", pooled ");
+            tty_putdec((uint32_t)ks.pooled);
+            tty_putstr(", reused ");
+            tty_putdec((uint32_t)(ks.cache_hits + ks.pool_hits));
+            tty_putstr(" (");
+            tty_putdec((uint32_t)ks.cache_hits);
+            tty_putstr(" from the CPU cache)\n");
+        } else if (strncmp(cmd_buffer, "cr3bench", 8) == 0 && strlength(cmd_buffer) == 8) {
+            vmm_cr3_bench_t cb;
+            vmm_cr3_benchmark(10000, 64, &cb);
+            if (cb.iterations == 0) {
+                tty_putstr("cr3bench: must run in the kernel address space\n");
+            } else {
+                tty_putstr("Address-space round trips: ");
+                tty_putdec(cb.iterations);
+                tty_putstr(", ");
+                tty_putdec(cb.pages);
+                tty_putstr(" pages touched per switch\n  flushing CR3 : ");
+                tty_putdec((uint32_t)cb.flush_cycles);
+                tty_putstr(" cycles (");
+                tty_putdec((uint32_t)tsc_cycles_to_ns(cb.flush_cycles));
+                tty_putstr(" ns)\n  non-global   : ");
+                if (cb.nonglobal_cycles) {
+                    tty_putdec((uint32_t)cb.nonglobal_cycles);
+                    tty_putstr(" cycles (");
+                    tty_putdec((uint32_t)tsc_cycles_to_ns(cb.nonglobal_cycles));
+                    tty_putstr(" ns)\n");
+                } else {
+                    tty_putstr("global pages not supported by CPU\n");
+                }
+                tty_putstr("  PCID no-flush: ");
+                if (cb.pcid_enabled) {
+                    tty_putdec((uint32_t)cb.pcid_cycles);
+                    tty_putstr(" cycles (");
+                    tty_putdec((uint32_t)tsc_cycles_to_ns(cb.pcid_cycles));
+                    tty_putstr(" ns)\n");
+                } else {
+                    tty_putstr("not supported by CPU\n");
+                }
+            }
+        } else if (strncmp(cmd_buffer, "bench", 5) == 0 && strlength(cmd_buffer) == 5) {
+            uint64_t* samples = (uint64_t*)kmalloc(BENCH_MAX_SAMPLES * sizeof(uint64_t));
+            if (!samples) {
+                tty_putstr("bench: out of memory\n");
+            } else {
+                tty_putstr("Latency per operation (");
+                tty_putdec((uint32_t)tsc_khz());
+                tty_putstr(" kHz TSC, each includes the rdtsc floor):\n");
+                bench_report("  rdtsc floor    : ", samples, bench_rdtsc(samples, BENCH_MAX_SAMPLES));
+                bench_report("  null syscall   : ", samples, bench_null_syscall(samples, BENCH_MAX_SAMPLES));
+                bench_report("  kernel switch  : ", samples, bench_kernel_switch(samples, BENCH_MAX_SAMPLES));
+                bench_report("  user switch    : ", samples, bench_user_switch(samples, BENCH_MAX_SAMPLES));
+                bench_report("  IRQ entry/exit : ", samples, bench_irq(samples, BENCH_MAX_SAMPLES));
+                bench_report("  page fault     : ", samples, bench_page_fault(samples, BENCH_MAX_SAMPLES));
+                kfree(samples);
+            }
+        } else if (strncmp(cmd_buffer, "cpus", 4) == 0 && strlength(cmd_buffer) == 4) {
+            tty_putstr("CPUs online: ");
+            tty_putdec((uint32_t)smp_cpu_count());
+            tty_putstr("\n");
+            for (int cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+                sched_cpu_info_t ci;
+                if (!smp_cpu_online(cpu) || scheduler_cpu_info(cpu, &ci) != 0) continue;
+                tty_putstr("  cpu");
+                tty_putdec((uint32_t)cpu);
+                tty_putstr(" apic ");
+                tty_putdec(smp_cpu_apic_id(cpu));
+                tty_putstr(": ");
+                if (ci.running_pid) {
+                    tty_putstr("pid ");
+                    tty_putdec((uint32_t)ci.running_pid);
+                } else {
+                    tty_putstr("idle");
+                }
+                tty_putstr(", queued ");
+                tty_putdec(ci.queued);
+                tty_putstr(", switches ");
+                tty_putdec((uint32_t)ci.switches);
+                tty_putstr(", steals ");
+                tty_putdec((uint32_t)ci.steals);
+                tty_putstr(", preempted ");
+                tty_putdec((uint32_t)ci.preemptions);
+                tty_putstr(" (");
+                tty_putdec((uint32_t)ci.deferred);
+                tty_putstr(" deferred)");
+                percpu_t* pc = percpu_of(cpu);
+                tty_putstr(", syscalls ");
+                tty_putdec((uint32_t)pc->syscalls);
+                tty_putstr(", irqs ");
+                tty_putdec((uint32_t)pc->irqs);
+                tty_putstr(", exceptions ");
+                tty_putdec((uint32_t)pc->exceptions);
+                hrtimer_stats_t hs;
+                if (hrtimer_get_stats(cpu, &hs) == 0) {
+                    tty_putstr(", timer irqs ");
+                    tty_putdec((uint32_t)hs.interrupts);
+                    tty_putstr(" (");
+                    tty_putdec((uint32_t)hs.expired);
+                    tty_putstr(" expired)");
+                }
+                tty_putstr("\n");
+            }
+            if (lapic_timer_khz() || lapic_timer_tsc_deadline()) {
+                tty_putstr("APIC timer: ");
+                if (lapic_timer_tsc_deadline()) {
+                    tty_putstr("TSC-deadline mode\n");
+                } else {
+                    tty_putstr("one-shot, ");
+                    tty_putdec((uint32_t)lapic_timer_khz());
+                    tty_putstr(" kHz\n");
+                }
+            }
+            tty_putstr("Dead tasks reaped: ");
+            tty_putdec((uint32_t)scheduler_reaped());
+            tty_putstr("\n");
+            if (fpu_ready()) {
+                fpu_stats_t fs;
+                fpu_get_stats(&fs);
+                tty_putstr(fs.xsave ? (fs.xsaveopt ? "FPU: XSAVEOPT" : "FPU: XSAVE") : "FPU: FXSAVE");
+                tty_putstr((fs.xcr0 & 4) ? " x87/SSE/AVX, " : " x87/SSE, ");
+                tty_putdec(fs.area_size);
+                tty_putstr("-byte areas; #NM traps ");
+                tty_putdec((uint32_t)fs.traps);
+                tty_putstr(", restores ");
+                tty_putdec((uint32_t)fs.restores);
+                tty_putstr(", saves ");
+                tty_putdec((uint32_t)fs.saves);
+                tty_putstr(", kept loaded ");
+                tty_putdec((uint32_t)fs.reuses);
+                tty_putstr(", kernel sections ");
+                tty_putdec((uint32_t)fs.kernel_sections);
+                tty_putstr("\n");
+            }
+        } else if (strncmp(cmd_buffer, "lockstat", 8) == 0 &&
+                   (strlength(cmd_buffer) == 8 || strncmp(cmd_buffer + 8, " reset", 7) == 0)) {
+#if LOCK_STATS
+            if (cmd_buffer[8] == ' ') {
+                lock_stat_reset();
+                tty_putstr("Lock statistics cleared\n");
+            } else {
+                tty_putstr("Locks taken since boot or the last reset (TSC cycles):\n");
+                for (lock_stat_t* s = lock_stat_next(NULL); s; s = lock_stat_next(s)) lockstat_report(s);
+            }
+#else
+            tty_putstr("lockstat: kernel built with LOCK_STATS=0\n");
+#endif
         } else {
             tty_putstr("Unknown command: ");
             tty_putstr(cmd_buffer);
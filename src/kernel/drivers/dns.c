@@ -23,6 +23,14 @@ static volatile int dns_query_success = 0;
 static volatile uint32_t dns_resolved_ip = 0;
 static uint16_t dns_pending_id = 0;
 
+// How long dns_resolve waits for the server
+#define DNS_TIMEOUT_NS 10000000000ULL   // 10 s
+
+static int dns_reply_received(void* arg) {
+    (void)arg;
+    return !dns_query_pending;
+}
+
 // =============================================================================
 // INITIALIZATION
 // =============================================================================
@@ -358,19 +366,14 @@ int dns_resolve(const char* hostname, uint32_t* ip_out) {
         return -1;
     }
     
-    // Wait for response (with timeout)
-    // ~30 million iterations ≈ 10 seconds on typical QEMU
-    for (volatile uint32_t i = 0; i < 30000000; i++) {
-        e1000_poll();
-        
-        if (!dns_query_pending) {
-            if (dns_query_success && dns_resolved_ip != 0) {
-                *ip_out = dns_resolved_ip;
-                dns_cache_add(hostname, dns_resolved_ip);
-                return 0;
-            }
-            return -1;
+    // Sleep until the response arrives (with timeout)
+    if (net_wait(dns_reply_received, NULL, DNS_TIMEOUT_NS)) {
+        if (dns_query_success && dns_resolved_ip != 0) {
+            *ip_out = dns_resolved_ip;
+            dns_cache_add(hostname, dns_resolved_ip);
+            return 0;
         }
+        return -1;
     }
     
     dns_query_pending = 0;
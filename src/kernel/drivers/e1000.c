@@ -7,6 +7,7 @@
 #include <kernel/net/net.h>
 #include <kernel/sys/tty.h>
 #include <kernel/sys/kmalloc.h>
+#include <kernel/arch/x86_64/idt.h>
 #include "../../cpu/ports.h"
 #include <stddef.h>
 
@@ -301,8 +302,12 @@ int e1000_init(void) {
     e1000_init_rx();
     e1000_init_tx();
     
-    // Enable interrupts
+    // Enable interrupts. Receiving only wakes the tasks waiting in net_wait; without the IRQ
+    // they still poll every NET_POLL_NS.
     e1000_write_reg(E1000_IMS, E1000_INT_RXT0 | E1000_INT_LSC);
+    if (irq_install_handler(e1000_state.irq, e1000_interrupt_handler) != 0) {
+        tty_putstr("E1000: IRQ line unusable, polling\n");
+    }
     
     // Link up
     uint32_t ctrl = e1000_read_reg(E1000_CTRL);
@@ -444,8 +449,8 @@ void e1000_interrupt_handler(void) {
     uint32_t icr = e1000_read_reg(E1000_ICR);
     
     if (icr & E1000_INT_RXT0) {
-        // Packet received
-        e1000_poll();
+        // Packet received: the waiting tasks run the stack, not the interrupt
+        net_rx_notify();
     }
     
     if (icr & E1000_INT_LSC) {
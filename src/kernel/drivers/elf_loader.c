@@ -2,7 +2,9 @@
 #include <kernel/fs/fat32.h>
 #include <kernel/arch/x86_64/vmm.h>
 #include <kernel/arch/x86_64/pmm.h>
+#include <kernel/arch/x86_64/mm.h>
 #include <kernel/sys/kmalloc.h>
+#include <kernel/sys/slab.h>
 #include <kernel/sys/string.h>
 #include <kernel/sys/tty.h>
 #include <stdint.h>
@@ -16,35 +18,27 @@
 #define ELFCLASS64 2
 #define PAGE_SIZE 4096
 
-// Simple page allocation tracker
-typedef struct {
-    uint64_t va;
-    uint64_t pa;
-} va_pa_mapping_t;
-
-#define MAX_SEGMENTS 16
-static va_pa_mapping_t segment_map[MAX_SEGMENTS];
-static int segment_count = 0;
-
-static void map_add(uint64_t va, uint64_t pa) {
-    if (segment_count < MAX_SEGMENTS) {
-        segment_map[segment_count].va = va;
-        segment_map[segment_count].pa = pa;
-        segment_count++;
+// Program header tables of ordinary binaries fit one cache object; larger ones fall back to kmalloc
+#define ELF_PHDR_CACHE_MAX 16
+static kmem_cache_t *phdr_cache = NULL;
+
+static Elf64_Phdr *phdrs_alloc(size_t size) {
+    if (size <= ELF_PHDR_CACHE_MAX * sizeof(Elf64_Phdr)) {
+        if (!phdr_cache) phdr_cache = kmem_cache_create("elf_phdrs", ELF_PHDR_CACHE_MAX * sizeof(Elf64_Phdr), 0, NULL);
+        if (phdr_cache) return (Elf64_Phdr *)kmem_cache_alloc(phdr_cache);
     }
+    return (Elf64_Phdr *)kmalloc(size);
 }
 
-static uint64_t map_lookup(uint64_t va) {
-    for (int i = 0; i < segment_count; i++) {
-        uint64_t page_va = segment_map[i].va & ~(PAGE_SIZE - 1);
-        uint64_t va_page = va & ~(PAGE_SIZE - 1);
-        if (page_va == va_page) {
-            return segment_map[i].pa + (va & (PAGE_SIZE - 1));
-        }
-    }
-    return 0;
+static void phdrs_free(Elf64_Phdr *phdrs, size_t size) {
+    if (phdr_cache && size <= ELF_PHDR_CACHE_MAX * sizeof(Elf64_Phdr)) kmem_cache_free(phdr_cache, phdrs);
+    else kfree(phdrs);
 }
 
+// User stack: lazily zero-filled pages just below the top of the lower half
+#define USER_STACK_TOP VMM_USER_TOP
+#define USER_STACK_PAGES 16
+
 int elf_load_and_create_address_space(const char *path, char *const argv[], char *const envp[], struct proc *newproc) {
     tty_putstr("[ELF] Loading: ");
     tty_putstr(path);
@@ -52,8 +46,6 @@ int elf_load_and_create_address_space(const char *path, char *const argv[], char
 
     if (!path || !newproc) return -1;
 
-    segment_count = 0;  // Reset mapping
-
     // Open and read ELF header
     fat32_file_t file;
     if (fat32_open_file(path, &file) != 0) {
@@ -82,7 +74,7 @@ int elf_load_and_create_address_space(const char *path, char *const argv[], char
     tty_puthex64(ehdr.e_entry);
     tty_putstr("\n");
 
-    // Get kernel CR3 and clone it for user process
+    // New user page table: the kernel mappings are shared, the user windows start empty
     uint64_t kernel_cr3 = vmm_get_cr3();
     uint64_t user_cr3 = vmm_clone_table(kernel_cr3);
     if (!user_cr3) {
@@ -90,13 +82,16 @@ int elf_load_and_create_address_space(const char *path, char *const argv[], char
         return -6;
     }
     newproc->cr3 = user_cr3;
+    mm_t *mm = NULL;
+    int ret;
 
     // Read program headers
     size_t phdr_size = ehdr.e_phnum * ehdr.e_phentsize;
-    Elf64_Phdr *phdrs = (Elf64_Phdr *)kmalloc(phdr_size);
+    Elf64_Phdr *phdrs = phdrs_alloc(phdr_size);
     if (!phdrs) {
         tty_putstr("[ELF] Phdr malloc failed\n");
-        return -7;
+        ret = -7;
+        goto fail;
     }
 
     // Seek to program headers
@@ -113,10 +108,19 @@ int elf_load_and_create_address_space(const char *path, char *const argv[], char
     }
     fat32_read_file(&file2, (uint8_t*)phdrs, phdr_size);
 
-    // Process each PT_LOAD segment
+    // Segments are not loaded here: each PT_LOAD becomes a lazy region and the page-fault
+    // handler fills its pages from the file (or with zeroes past p_filesz) on first touch
+    mm = mm_create(user_cr3);
+    if (!mm) {
+        tty_putstr("[ELF] mm alloc failed\n");
+        phdrs_free(phdrs, phdr_size);
+        ret = -8;
+        goto fail;
+    }
+
     for (unsigned seg_idx = 0; seg_idx < ehdr.e_phnum; seg_idx++) {
         Elf64_Phdr *ph = &phdrs[seg_idx];
-        if (ph->p_type != PT_LOAD) continue;
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
 
         uint64_t seg_va = ph->p_vaddr;
         uint64_t seg_end = seg_va + ph->p_memsz;
@@ -127,111 +131,36 @@ int elf_load_and_create_address_space(const char *path, char *const argv[], char
         tty_putdec(ph->p_memsz);
         tty_putstr("\n");
 
-        // Allocate physical pages for the segment
-        for (uint64_t va = seg_va; va < seg_end; va += PAGE_SIZE) {
-            void *phys = pmm_alloc_page();
-            if (!phys) {
-                tty_putstr("[ELF] PMM alloc failed\n");
-                kfree(phdrs);
-                return -8;
-            }
-
-            uint64_t pa = (uint64_t)(uintptr_t)phys;
-            
-            // Zero the page
-            memset_k(phys, 0, PAGE_SIZE);
-
-            // Map it in user page table with proper permissions
-            // For executable segments: READ + EXECUTE (not WRITE) + USER
-            // For writable segments: READ + WRITE + USER
-            uint64_t flags = 0x1 | 0x4;  // PRESENT | USER
-            if (ph->p_flags & 0x2) flags |= 0x2;  // WRITE if needed
-
-            if (vmm_map_page_in_table(user_cr3, va, pa, flags) != 0) {
-                tty_putstr("[ELF] Map page failed at va=");
-                tty_puthex64(va);
-                tty_putstr("\n");
-                kfree(phdrs);
-                return -9;
-            }
-
-            map_add(va, pa);
-        }
-
-        // Copy file data into pages
-        if (ph->p_filesz > 0) {
-            fat32_file_t data_file;
-            fat32_open_file(path, &data_file);
-
-            // Seek to file offset
-            if (ph->p_offset > 0) {
-                uint8_t skipbuf[512];
-                uint64_t skip = ph->p_offset;
-                while (skip > 0) {
-                    int to_skip = (skip > 512) ? 512 : skip;
-                    fat32_read_file(&data_file, skipbuf, to_skip);
-                    skip -= to_skip;
-                }
-            }
-
-            // Copy data
-            uint64_t remaining = ph->p_filesz;
-            uint8_t data_buf[512];
-
-            while (remaining > 0) {
-                int to_read = (remaining > 512) ? 512 : remaining;
-                int got = fat32_read_file(&data_file, data_buf, to_read);
-                if (got <= 0) break;
-
-                // Find where in virtual address space we are
-                uint64_t file_va = seg_va + (ph->p_filesz - remaining);
-                
-                // Look up physical address
-                uint64_t file_pa = map_lookup(file_va);
-                if (!file_pa) {
-                    tty_putstr("[ELF] VA not mapped: ");
-                    tty_puthex64(file_va);
-                    tty_putstr("\n");
-                    remaining -= got;
-                    continue;
-                }
-
-                // Copy to physical address (kernel identity-mapped)
-                uint8_t *dest = (uint8_t *)(uintptr_t)file_pa;
-                memset_k(dest, 0, got);  // Clear first
-                for (int i = 0; i < got; i++) {
-                    dest[i] = data_buf[i];
-                }
-
-                remaining -= got;
-            }
+        // For executable segments: READ + EXECUTE (not WRITE) + USER
+        // For writable segments: READ + WRITE + USER
+        uint64_t flags = 0x1 | 0x4;  // PRESENT | USER
+        if (ph->p_flags & 0x2) flags |= 0x2;  // WRITE if needed
+
+        uint64_t start = seg_va & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = (seg_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (mm_add_region(mm, start, end, flags, &file, seg_va, seg_va + ph->p_filesz, (uint32_t)ph->p_offset) != 0) {
+            tty_putstr("[ELF] Region setup failed at va=");
+            tty_puthex64(seg_va);
+            tty_putstr("\n");
+            phdrs_free(phdrs, phdr_size);
+            ret = -9;
+            goto fail;
         }
     }
 
-    kfree(phdrs);
+    phdrs_free(phdrs, phdr_size);
     newproc->entry = ehdr.e_entry;
 
-    // Allocate stack at high user address
-    void *stack_phys = pmm_alloc_page();
-    if (!stack_phys) {
-        tty_putstr("[ELF] Stack alloc failed\n");
-        return -10;
-    }
-
-    memset_k(stack_phys, 0, PAGE_SIZE);
-
-    uint64_t stack_va = 0x7FFFFFFFF000ULL;
-    uint64_t stack_pa = (uint64_t)(uintptr_t)stack_phys;
-
-    // Map stack as PRESENT | WRITE | USER
-    if (vmm_map_page_in_table(user_cr3, stack_va, stack_pa, 0x1 | 0x2 | 0x4) != 0) {
-        tty_putstr("[ELF] Stack map failed\n");
-        return -11;
+    // Stack pages are zero-filled on demand as well
+    uint64_t stack_base = USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE;
+    if (mm_add_region(mm, stack_base, USER_STACK_TOP, 0x1 | 0x2 | 0x4, NULL, 0, 0, 0) != 0) {
+        tty_putstr("[ELF] Stack setup failed\n");
+        ret = -10;
+        goto fail;
     }
 
     // Set stack pointer (16-byte aligned at top)
-    uint64_t stack_top = stack_va + PAGE_SIZE;
-    newproc->user_rsp = (stack_top - 16) & ~0xFULL;
+    newproc->user_rsp = (USER_STACK_TOP - 16) & ~0xFULL;
 
     tty_putstr("[ELF] Done: entry=");
     tty_puthex64(newproc->entry);
@@ -240,4 +169,11 @@ int elf_load_and_create_address_space(const char *path, char *const argv[], char
     tty_putstr("\n");
 
     return 0;
+
+fail:
+    // Nothing is mapped yet, so dropping the mm and the cloned table releases everything
+    mm_destroy(mm);
+    vmm_destroy_table(user_cr3);
+    newproc->cr3 = 0;
+    return ret;
 }
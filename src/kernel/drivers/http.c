@@ -12,6 +12,10 @@
 #include <kernel/sys/string.h>
 #include <stddef.h>
 
+// How long to wait for the TCP handshake, and for more data once a response has started
+#define HTTP_CONNECT_TIMEOUT_NS 15000000000ULL  // 15 s
+#define HTTP_IDLE_TIMEOUT_NS    30000000000ULL  // 30 s
+
 // =============================================================================
 // URL PARSING
 // =============================================================================
@@ -224,13 +228,9 @@ int http_get(const char* host, uint16_t port, const char* path, http_response_t*
     }
     
     // Wait for connection with timeout
-    for (volatile uint32_t i = 0; i < 50000000; i++) {
-        e1000_poll();
-        if (tcp_is_connected(conn)) break;
-        if (tcp_is_closed(conn)) {
-            tty_putstr("Connection refused\n");
-            return -1;
-        }
+    if (!tcp_wait_connected(conn, HTTP_CONNECT_TIMEOUT_NS) && tcp_is_closed(conn)) {
+        tty_putstr("Connection refused\n");
+        return -1;
     }
     
     if (!tcp_is_connected(conn)) {
@@ -288,16 +288,14 @@ int http_get(const char* host, uint16_t port, const char* path, http_response_t*
     int body_start = 0;
     
     // Wait for data with timeout
-    for (volatile uint32_t timeout = 0; timeout < 100000000; timeout++) {
-        e1000_poll();
-        
+    // The timeout restarts whenever data comes in
+    while (recv_total < (int)sizeof(recv_buffer) - 1 && tcp_wait_readable(conn, HTTP_IDLE_TIMEOUT_NS)) {
         // Check for data
         int bytes = tcp_recv(conn, recv_buffer + recv_total, 
                             sizeof(recv_buffer) - recv_total - 1);
         if (bytes > 0) {
             recv_total += bytes;
             recv_buffer[recv_total] = '\0';
-            timeout = 0;  // Reset timeout on data
             
             // Parse headers if not done yet
             if (!headers_parsed) {
@@ -377,13 +375,9 @@ int https_get(const char* host, uint16_t port, const char* path, http_response_t
     }
     
     // Wait for TCP connection
-    for (volatile uint32_t i = 0; i < 50000000; i++) {
-        e1000_poll();
-        if (tcp_is_connected(tcp_conn)) break;
-        if (tcp_is_closed(tcp_conn)) {
-            tty_putstr("Connection refused\n");
-            return -1;
-        }
+    if (!tcp_wait_connected(tcp_conn, HTTP_CONNECT_TIMEOUT_NS) && tcp_is_closed(tcp_conn)) {
+        tty_putstr("Connection refused\n");
+        return -1;
     }
     
     if (!tcp_is_connected(tcp_conn)) {
@@ -393,12 +387,17 @@ int https_get(const char* host, uint16_t port, const char* path, http_response_t
     }
     
     // Initialize TLS
-    tls_conn_t tls;
-    tls_init(&tls, tcp_conn);
+    tls_conn_t* tls = tls_alloc(tcp_conn);
+    if (!tls) {
+        tty_putstr("TLS context allocation failed\n");
+        tcp_close(tcp_conn);
+        return -1;
+    }
     
     // Perform TLS handshake
-    if (tls_handshake(&tls, host) != 0) {
+    if (tls_handshake(tls, host) != 0) {
         tty_putstr("TLS handshake failed\n");
+        tls_free(tls);
         tcp_close(tcp_conn);
         return -1;
     }
@@ -437,9 +436,10 @@ int https_get(const char* host, uint16_t port, const char* path, http_response_t
     request[req_len] = '\0';
     
     // Send request via TLS
-    if (tls_send(&tls, (uint8_t*)request, req_len) < 0) {
+    if (tls_send(tls, (uint8_t*)request, req_len) < 0) {
         tty_putstr("Failed to send HTTPS request\n");
-        tls_close(&tls);
+        tls_close(tls);
+        tls_free(tls);
         tcp_close(tcp_conn);
         return -1;
     }
@@ -453,15 +453,13 @@ int https_get(const char* host, uint16_t port, const char* path, http_response_t
     int body_start = 0;
     
     // Wait for data with timeout
-    for (volatile uint32_t timeout = 0; timeout < 100000000; timeout++) {
-        e1000_poll();
-        
-        int bytes = tls_recv(&tls, (uint8_t*)(recv_buffer + recv_total), 
+    // The timeout restarts whenever data comes in
+    while (recv_total < (int)sizeof(recv_buffer) - 1 && tcp_wait_readable(tcp_conn, HTTP_IDLE_TIMEOUT_NS)) {
+        int bytes = tls_recv(tls, (uint8_t*)(recv_buffer + recv_total), 
                             sizeof(recv_buffer) - recv_total - 1);
         if (bytes > 0) {
             recv_total += bytes;
             recv_buffer[recv_total] = '\0';
-            timeout = 0;
             
             // Parse headers if not done yet
             if (!headers_parsed) {
@@ -484,7 +482,11 @@ int https_get(const char* host, uint16_t port, const char* path, http_response_t
             }
         }
         
-        if (!tls_is_connected(&tls)) {
+        if (!tls_is_connected(tls)) {
+            break;
+        }
+        // A closed connection stays readable; stop once its data is used up
+        if (bytes <= 0 && tcp_is_closed(tcp_conn) && !tcp_data_available(tcp_conn)) {
             break;
         }
     }
@@ -502,7 +504,8 @@ int https_get(const char* host, uint16_t port, const char* path, http_response_t
         response->body_len = body_len;
     }
     
-    tls_close(&tls);
+    tls_close(tls);
+    tls_free(tls);
     tcp_close(tcp_conn);
     
     return (response->status_code > 0) ? 0 : -1;
@@ -7,6 +7,10 @@
 #include <kernel/net/tcp.h>
 #include <kernel/sys/tty.h>
 #include <kernel/sys/string.h>
+#include <kernel/sys/waitqueue.h>
+#include <kernel/sys/spinlock.h>
+#include <kernel/sys/rwlock.h>
+#include <kernel/arch/x86_64/tsc.h>
 #include <stddef.h>
 
 // =============================================================================
@@ -26,6 +30,10 @@ typedef struct {
 } arp_entry_t;
 
 static arp_entry_t arp_cache[ARP_CACHE_SIZE];
+// Every outgoing packet looks the cache up, only ARP replies change it. The receive interrupt
+// writes, so readers keep interrupts off too.
+static lock_stat_t arp_stat = LOCK_STAT_INIT("arp");
+static rwlock_t arp_lock = RWLOCK_INIT_STAT(arp_stat);
 
 // UDP port bindings
 #define MAX_UDP_BINDINGS 16
@@ -39,6 +47,11 @@ static udp_binding_t udp_bindings[MAX_UDP_BINDINGS];
 // Packet ID counter for IPv4
 static uint16_t ip_packet_id = 0;
 
+// Tasks in net_wait, woken by the receive interrupt
+static wait_queue_t rx_wait = WAIT_QUEUE_INIT;
+// Only one task at a time runs the receive path
+static spinlock_t rx_poll_lock = SPINLOCK_INIT;
+
 // Ping state tracking
 volatile int ping_reply_received = 0;
 volatile uint16_t ping_reply_seq = 0;
@@ -113,9 +126,7 @@ void mac_to_string(const mac_addr_t* mac, char* buf) {
 
 void net_init(void) {
     // Clear ARP cache
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        arp_cache[i].valid = 0;
-    }
+    arp_init();
     
     // Clear UDP bindings
     for (int i = 0; i < MAX_UDP_BINDINGS; i++) {
@@ -227,24 +238,62 @@ void net_receive_ethernet(net_interface_t* iface, const void* data, size_t len)
     }
 }
 
+// =============================================================================
+// WAITING FOR TRAFFIC
+// =============================================================================
+
+void net_rx_notify(void) {
+    wake_up_all(&rx_wait);
+}
+
+typedef struct {
+    int (*cond)(void* arg);
+    void* arg;
+    uint64_t deadline;      // TSC, 0 for none
+} net_wait_t;
+
+// Process whatever the interface has received, then look at the caller's condition
+static int net_wait_check(void* arg) {
+    net_wait_t* w = (net_wait_t*)arg;
+    if (primary_iface && primary_iface->receive && spin_trylock(&rx_poll_lock)) {
+        primary_iface->receive(primary_iface);
+        spin_unlock(&rx_poll_lock);
+    }
+    if (w->cond(w->arg)) return 1;
+    return w->deadline && rdtsc() >= w->deadline;
+}
+
+int net_wait(int (*cond)(void* arg), void* arg, uint64_t timeout_ns) {
+    net_wait_t w = { cond, arg, 0 };
+    uint64_t khz = tsc_khz();
+    if (timeout_ns && khz) w.deadline = rdtsc() + timeout_ns / 1000000 * khz + timeout_ns % 1000000 * khz / 1000000;
+    // Each sleep is capped so frames still get processed without a receive interrupt
+    while (!wait_event_timeout(&rx_wait, net_wait_check, &w, NET_POLL_NS)) continue;
+    return cond(arg);
+}
+
 // =============================================================================
 // ARP
 // =============================================================================
 
 void arp_init(void) {
+    uint64_t flags = write_lock_irqsave(&arp_lock);
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
         arp_cache[i].valid = 0;
     }
+    write_unlock_irqrestore(&arp_lock, flags);
 }
 
 static void arp_cache_add(uint32_t ip, const mac_addr_t* mac) {
     // Look for existing entry or empty slot
     int empty_slot = -1;
+    uint64_t flags = write_lock_irqsave(&arp_lock);
     
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
         if (arp_cache[i].valid && arp_cache[i].ip == ip) {
             // Update existing entry
             mac_copy(&arp_cache[i].mac, mac);
+            write_unlock_irqrestore(&arp_lock, flags);
             return;
         }
         if (!arp_cache[i].valid && empty_slot < 0) {
@@ -258,16 +307,21 @@ static void arp_cache_add(uint32_t ip, const mac_addr_t* mac) {
         mac_copy(&arp_cache[empty_slot].mac, mac);
         arp_cache[empty_slot].valid = 1;
     }
+    write_unlock_irqrestore(&arp_lock, flags);
 }
 
 static int arp_cache_lookup(uint32_t ip, mac_addr_t* mac) {
+    int rc = -1;  // Not found
+    uint64_t flags = read_lock_irqsave(&arp_lock);
     for (int i = 0; i < ARP_CACHE_SIZE; i++) {
         if (arp_cache[i].valid && arp_cache[i].ip == ip) {
             mac_copy(mac, &arp_cache[i].mac);
-            return 0;
+            rc = 0;
+            break;
         }
     }
-    return -1;  // Not found
+    read_unlock_irqrestore(&arp_lock, flags);
+    return rc;
 }
 
 int arp_resolve(net_interface_t* iface, uint32_t ip, mac_addr_t* mac) {
@@ -6,12 +6,33 @@
 #include "../../cpu/ports.h"
 #include <kernel/sys/tty.h>
 #include <kernel/fs/fat32.h>
+#include <kernel/sys/seqlock.h>
 
 // Global timezone settings
 static timezone_t current_timezone = {0, 0, "UTC"};  // Default to UTC
+// Read on every local-time query, written only by the tz command
+static seqlock_t tz_lock = SEQLOCK_INIT;
+// CMOS index/data port pair: a select and its access must not be split by another reader, and
+// the shell reads the clock from the keyboard IRQ, so the lock keeps interrupts off
+static spinlock_t cmos_lock = SPINLOCK_INIT;
+
+// Replace the timezone; the name is cut to 7 characters
+static void timezone_store(int8_t hours_offset, int8_t minutes_offset, const char* name) {
+    uint64_t flags = write_seqlock_irqsave(&tz_lock);
+    current_timezone.offset_hours = hours_offset;
+    current_timezone.offset_minutes = minutes_offset;
+    int i = 0;
+    while (name[i] && i < 7) {
+        current_timezone.name[i] = name[i];
+        i++;
+    }
+    current_timezone.name[i] = '\0';
+    write_sequnlock_irqrestore(&tz_lock, flags);
+}
 
 // Initialize the RTC
 void rtc_init(void) {
+    uint64_t flags = spin_lock_irqsave(&cmos_lock);
     // Disable NMI and select status register A
     outb(RTC_INDEX_PORT, 0x8A);
     
@@ -27,20 +48,35 @@ void rtc_init(void) {
     uint8_t status_b = inb(RTC_DATA_PORT);
     outb(RTC_INDEX_PORT, 0x8B);
     outb(RTC_DATA_PORT, status_b | 0x02); // 24-hour format
+    spin_unlock_irqrestore(&cmos_lock, flags);
 }
 
-// Read a register from the RTC
-uint8_t rtc_read_register(uint8_t reg) {
+// Register access with cmos_lock held
+static uint8_t cmos_read(uint8_t reg) {
     outb(RTC_INDEX_PORT, reg | 0x80); // Disable NMI
     return inb(RTC_DATA_PORT);
 }
 
-// Write a register to the RTC
-void rtc_write_register(uint8_t reg, uint8_t value) {
+static void cmos_write(uint8_t reg, uint8_t value) {
     outb(RTC_INDEX_PORT, reg | 0x80); // Disable NMI
     outb(RTC_DATA_PORT, value);
 }
 
+// Read a register from the RTC
+uint8_t rtc_read_register(uint8_t reg) {
+    uint64_t flags = spin_lock_irqsave(&cmos_lock);
+    uint8_t v = cmos_read(reg);
+    spin_unlock_irqrestore(&cmos_lock, flags);
+    return v;
+}
+
+// Write a register to the RTC
+void rtc_write_register(uint8_t reg, uint8_t value) {
+    uint64_t flags = spin_lock_irqsave(&cmos_lock);
+    cmos_write(reg, value);
+    spin_unlock_irqrestore(&cmos_lock, flags);
+}
+
 // Convert BCD to binary
 uint8_t bcd_to_binary(uint8_t bcd) {
     return ((bcd >> 4) * 10) + (bcd & 0x0F);
@@ -54,20 +90,22 @@ uint8_t binary_to_bcd(uint8_t binary) {
 // Read current time from RTC
 void rtc_read_time(rtc_time_t* time) {
     uint8_t status_b;
+    uint64_t flags = spin_lock_irqsave(&cmos_lock);
     
     // Make sure we don't read during an update
-    while (rtc_read_register(0x0A) & 0x80);
+    while (cmos_read(0x0A) & 0x80);
     
     // Read time values
-    time->seconds = rtc_read_register(RTC_SECONDS);
-    time->minutes = rtc_read_register(RTC_MINUTES);
-    time->hours = rtc_read_register(RTC_HOURS);
-    time->day = rtc_read_register(RTC_DAY);
-    time->month = rtc_read_register(RTC_MONTH);
-    time->year = rtc_read_register(RTC_YEAR);
+    time->seconds = cmos_read(RTC_SECONDS);
+    time->minutes = cmos_read(RTC_MINUTES);
+    time->hours = cmos_read(RTC_HOURS);
+    time->day = cmos_read(RTC_DAY);
+    time->month = cmos_read(RTC_MONTH);
+    time->year = cmos_read(RTC_YEAR);
     
     // Check if we need to convert from BCD
-    status_b = rtc_read_register(0x0B);
+    status_b = cmos_read(0x0B);
+    spin_unlock_irqrestore(&cmos_lock, flags);
     if (!(status_b & 0x04)) {
         // Values are in BCD, convert to binary
         time->seconds = bcd_to_binary(time->seconds);
@@ -88,7 +126,8 @@ void rtc_read_time(rtc_time_t* time) {
 
 // Set RTC time
 void rtc_set_time(rtc_time_t* time) {
-    uint8_t status_b = rtc_read_register(0x0B);
+    uint64_t flags = spin_lock_irqsave(&cmos_lock);
+    uint8_t status_b = cmos_read(0x0B);
     uint8_t seconds, minutes, hours, day, month, year;
     
     // Convert year back to 2-digit format
@@ -115,19 +154,20 @@ void rtc_set_time(rtc_time_t* time) {
     }
     
     // Disable updates while setting time
-    status_b = rtc_read_register(0x0B);
-    rtc_write_register(0x0B, status_b | 0x80);
+    status_b = cmos_read(0x0B);
+    cmos_write(0x0B, status_b | 0x80);
     
     // Set the time
-    rtc_write_register(RTC_SECONDS, seconds);
-    rtc_write_register(RTC_MINUTES, minutes);
-    rtc_write_register(RTC_HOURS, hours);
-    rtc_write_register(RTC_DAY, day);
-    rtc_write_register(RTC_MONTH, month);
-    rtc_write_register(RTC_YEAR, year);
+    cmos_write(RTC_SECONDS, seconds);
+    cmos_write(RTC_MINUTES, minutes);
+    cmos_write(RTC_HOURS, hours);
+    cmos_write(RTC_DAY, day);
+    cmos_write(RTC_MONTH, month);
+    cmos_write(RTC_YEAR, year);
     
     // Re-enable updates
-    rtc_write_register(0x0B, status_b & ~0x80);
+    cmos_write(0x0B, status_b & ~0x80);
+    spin_unlock_irqrestore(&cmos_lock, flags);
 }
 
 // Format time as HH:MM:SS
@@ -168,27 +208,13 @@ void timezone_init(void) {
     // Try to load timezone from disk, default to UTC if not found
     if (timezone_load_from_disk() != 0) {
         // Default to UTC if no saved timezone
-        current_timezone.offset_hours = 0;
-        current_timezone.offset_minutes = 0;
-        current_timezone.name[0] = 'U';
-        current_timezone.name[1] = 'T';
-        current_timezone.name[2] = 'C';
-        current_timezone.name[3] = '\0';
+        timezone_store(0, 0, "UTC");
     }
 }
 
 // Set timezone
 void timezone_set(int8_t hours_offset, int8_t minutes_offset, const char* name) {
-    current_timezone.offset_hours = hours_offset;
-    current_timezone.offset_minutes = minutes_offset;
-    
-    // Copy name (max 7 chars + null terminator)
-    int i = 0;
-    while (name[i] && i < 7) {
-        current_timezone.name[i] = name[i];
-        i++;
-    }
-    current_timezone.name[i] = '\0';
+    timezone_store(hours_offset, minutes_offset, name);
     
     // Save to disk
     timezone_save_to_disk();
@@ -196,15 +222,12 @@ void timezone_set(int8_t hours_offset, int8_t minutes_offset, const char* name)
 
 // Get current timezone
 void timezone_get(timezone_t* tz) {
-    tz->offset_hours = current_timezone.offset_hours;
-    tz->offset_minutes = current_timezone.offset_minutes;
-    
-    int i = 0;
-    while (current_timezone.name[i] && i < 7) {
-        tz->name[i] = current_timezone.name[i];
-        i++;
-    }
-    tz->name[i] = '\0';
+    uint32_t seq;
+    do {
+        seq = read_seqbegin(&tz_lock);
+        *tz = current_timezone;
+    } while (read_seqretry(&tz_lock, seq));
+    tz->name[7] = '\0';
 }
 
 // Apply timezone offset to convert UTC to local time
@@ -242,20 +265,24 @@ void timezone_apply_offset(rtc_time_t* utc_time, rtc_time_t* local_time, timezon
 // Read local time (UTC + timezone offset)
 void rtc_read_local_time(rtc_time_t* time) {
     rtc_time_t utc_time;
+    timezone_t tz;
     rtc_read_time(&utc_time);
-    timezone_apply_offset(&utc_time, time, &current_timezone);
+    timezone_get(&tz);
+    timezone_apply_offset(&utc_time, time, &tz);
 }
 
 // Save timezone to disk (stores in a special file)
 int timezone_save_to_disk(void) {
     // Create a small data structure to save
     uint8_t tz_data[16];
-    tz_data[0] = current_timezone.offset_hours;
-    tz_data[1] = current_timezone.offset_minutes;
+    timezone_t tz;
+    timezone_get(&tz);
+    tz_data[0] = tz.offset_hours;
+    tz_data[1] = tz.offset_minutes;
     
     // Copy name
     for (int i = 0; i < 8; i++) {
-        tz_data[2 + i] = current_timezone.name[i];
+        tz_data[2 + i] = tz.name[i];
     }
     
     // Save to a hidden system file
@@ -271,15 +298,14 @@ int timezone_load_from_disk(void) {
         int bytes_read = fat32_read_file(&tz_file, tz_data, 10);
         
         if (bytes_read >= 10) {
-            current_timezone.offset_hours = (int8_t)tz_data[0];
-            current_timezone.offset_minutes = (int8_t)tz_data[1];
-            
             // Copy name
+            char name[8];
             for (int i = 0; i < 8; i++) {
-                current_timezone.name[i] = tz_data[2 + i];
+                name[i] = (char)tz_data[2 + i];
             }
-            current_timezone.name[7] = '\0';  // Ensure null termination
+            name[7] = '\0';  // Ensure null termination
             
+            timezone_store((int8_t)tz_data[0], (int8_t)tz_data[1], name);
             return 0;  // Success
         }
     }
@@ -6,6 +6,7 @@
 #include <kernel/net/net.h>
 #include <kernel/drivers/e1000.h>
 #include <kernel/sys/tty.h>
+#include <kernel/sys/spinlock.h>
 #include <stddef.h>
 
 // =============================================================================
@@ -14,6 +15,9 @@
 
 static tcp_connection_t connections[TCP_MAX_CONNECTIONS];
 static uint16_t next_local_port = 49152;  // Ephemeral port range start
+// Covers slot allocation, the lookup keys and next_local_port. Taken from the receive interrupt too.
+static lock_stat_t conn_stat = LOCK_STAT_INIT("tcp");
+static spinlock_t conn_lock = SPINLOCK_INIT_STAT(conn_stat);
 
 // =============================================================================
 // INITIALIZATION
@@ -120,31 +124,45 @@ static int tcp_send_segment(tcp_connection_t* conn, uint8_t flags,
 
 static tcp_connection_t* tcp_find_connection(uint32_t remote_ip, uint16_t remote_port,
                                               uint16_t local_port) {
+    tcp_connection_t* found = NULL;
+    uint64_t flags = spin_lock_irqsave(&conn_lock);
     for (int i = 0; i < TCP_MAX_CONNECTIONS; i++) {
         if (connections[i].active &&
             connections[i].remote_ip == remote_ip &&
             connections[i].remote_port == remote_port &&
             connections[i].local_port == local_port) {
-            return &connections[i];
+            found = &connections[i];
+            break;
         }
     }
-    return NULL;
+    spin_unlock_irqrestore(&conn_lock, flags);
+    return found;
 }
 
-static tcp_connection_t* tcp_alloc_connection(void) {
+// Claims a slot and fills in its lookup keys in one go, so the receive path never matches a
+// half-initialized connection
+static tcp_connection_t* tcp_alloc_connection(uint32_t remote_ip, uint16_t remote_port) {
+    tcp_connection_t* conn = NULL;
+    uint64_t flags = spin_lock_irqsave(&conn_lock);
     for (int i = 0; i < TCP_MAX_CONNECTIONS; i++) {
         if (!connections[i].active) {
-            connections[i].active = 1;
-            connections[i].state = TCP_STATE_CLOSED;
-            connections[i].recv_len = 0;
-            connections[i].recv_read_pos = 0;
-            connections[i].send_len = 0;
-            connections[i].data_available = 0;
-            connections[i].connection_closed = 0;
-            return &connections[i];
+            conn = &connections[i];
+            conn->state = TCP_STATE_CLOSED;
+            conn->recv_len = 0;
+            conn->recv_read_pos = 0;
+            conn->send_len = 0;
+            conn->data_available = 0;
+            conn->connection_closed = 0;
+            conn->remote_ip = remote_ip;
+            conn->remote_port = remote_port;
+            conn->local_port = next_local_port++;
+            if (next_local_port > 65535) next_local_port = 49152;
+            conn->active = 1;
+            break;
         }
     }
-    return NULL;
+    spin_unlock_irqrestore(&conn_lock, flags);
+    return conn;
 }
 
 // =============================================================================
@@ -152,17 +170,11 @@ static tcp_connection_t* tcp_alloc_connection(void) {
 // =============================================================================
 
 int tcp_connect(uint32_t remote_ip, uint16_t remote_port) {
-    tcp_connection_t* conn = tcp_alloc_connection();
+    tcp_connection_t* conn = tcp_alloc_connection(remote_ip, remote_port);
     if (!conn) return -1;
     
-    // Set up connection
-    conn->remote_ip = remote_ip;
-    conn->remote_port = remote_port;
-    conn->local_port = next_local_port++;
-    if (next_local_port > 65535) next_local_port = 49152;
-    
     // Initialize sequence numbers (simple, not cryptographically random)
-    conn->send_seq = 1000 + (next_local_port * 17);
+    conn->send_seq = 1000 + ((conn->local_port + 1) * 17);
     conn->recv_seq = 0;
     
     // Send SYN
@@ -265,6 +277,25 @@ int tcp_is_closed(int conn_id) {
            !connections[conn_id].active;
 }
 
+static int tcp_connect_done(void* arg) {
+    int conn_id = (int)(intptr_t)arg;
+    return tcp_is_connected(conn_id) || tcp_is_closed(conn_id);
+}
+
+int tcp_wait_connected(int conn_id, uint64_t timeout_ns) {
+    net_wait(tcp_connect_done, (void*)(intptr_t)conn_id, timeout_ns);
+    return tcp_is_connected(conn_id);
+}
+
+static int tcp_readable(void* arg) {
+    int conn_id = (int)(intptr_t)arg;
+    return tcp_data_available(conn_id) || tcp_is_closed(conn_id);
+}
+
+int tcp_wait_readable(int conn_id, uint64_t timeout_ns) {
+    return net_wait(tcp_readable, (void*)(intptr_t)conn_id, timeout_ns);
+}
+
 // =============================================================================
 // RECEIVE HANDLING
 // =============================================================================
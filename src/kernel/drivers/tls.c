@@ -7,6 +7,12 @@
 #include <kernel/net/tcp.h>
 #include <kernel/drivers/e1000.h>
 #include <kernel/sys/tty.h>
+#include <kernel/sys/slab.h>
+#include <kernel/sys/kmalloc.h>
+#include <kernel/sys/string.h>
+
+// How long a record may take to arrive, restarted by every piece of it
+#define TLS_RECV_TIMEOUT_NS 15000000000ULL     // 15 s
 
 // PRF (Pseudo-Random Function) for TLS 1.2 using HMAC-SHA256
 static void tls_prf_sha256(const uint8_t* secret, size_t secret_len,
@@ -78,8 +84,7 @@ static uint32_t swap32(uint32_t x) {
 
 void tls_init(tls_conn_t* conn, int tcp_conn) {
     // Zero everything
-    uint8_t* p = (uint8_t*)conn;
-    for (size_t i = 0; i < sizeof(tls_conn_t); i++) p[i] = 0;
+    memset_k(conn, 0, sizeof(tls_conn_t));
     
     conn->tcp_conn = tcp_conn;
     conn->state = TLS_STATE_INIT;
@@ -89,10 +94,34 @@ void tls_init(tls_conn_t* conn, int tcp_conn) {
     sha256_init(&conn->handshake_hash);
 }
 
+// Connection contexts are several KB of key material, too big for the command stack
+static kmem_cache_t* tls_cache = NULL;
+
+tls_conn_t* tls_alloc(int tcp_conn) {
+    if (!tls_cache) tls_cache = kmem_cache_create("tls_conn", sizeof(tls_conn_t), 0, NULL);
+    if (!tls_cache) return NULL;
+    tls_conn_t* conn = (tls_conn_t*)kmem_cache_alloc(tls_cache);
+    if (conn) tls_init(conn, tcp_conn);
+    return conn;
+}
+
+void tls_free(tls_conn_t* conn) {
+    if (!conn) return;
+    // Do not leave session keys behind in a free object
+    memset_k(conn, 0, sizeof(tls_conn_t));
+    kmem_cache_free(tls_cache, conn);
+}
+
+// Largest plaintext fragment of one record. Record-sized buffers come from the heap:
+// a couple of them would overflow a kernel stack.
+#define TLS_MAX_FRAGMENT 16384
+
 // Send raw TLS record
 static int tls_send_record(tls_conn_t* conn, uint8_t content_type, 
                            const uint8_t* data, size_t len) {
-    uint8_t record[5 + 16384];  // Max TLS record size
+    if (len > TLS_MAX_FRAGMENT + 2048) return -1;  // max TLSCiphertext length
+    uint8_t* record = (uint8_t*)kmalloc(5 + len);
+    if (!record) return -1;
     
     record[0] = content_type;
     record[1] = (conn->version >> 8) & 0xff;
@@ -104,7 +133,9 @@ static int tls_send_record(tls_conn_t* conn, uint8_t content_type,
         record[5 + i] = data[i];
     }
     
-    return tcp_send(conn->tcp_conn, (char*)record, 5 + len);
+    int ret = tcp_send(conn->tcp_conn, (char*)record, 5 + len);
+    kfree(record);
+    return ret;
 }
 
 // Receive TLS record
@@ -113,14 +144,11 @@ static int tls_recv_record(tls_conn_t* conn, uint8_t* content_type,
     uint8_t header[5];
     int received = 0;
     
-    // Wait for header with polling
-    for (volatile int timeout = 0; timeout < 50000000 && received < 5; timeout++) {
-        e1000_poll();
+    // Wait for the header; the timeout restarts whenever data comes in
+    while (received < 5 && tcp_wait_readable(conn->tcp_conn, TLS_RECV_TIMEOUT_NS)) {
         int r = tcp_recv(conn->tcp_conn, (char*)(header + received), 5 - received);
-        if (r > 0) {
-            received += r;
-            timeout = 0;
-        }
+        if (r > 0) received += r;
+        else if (tcp_is_closed(conn->tcp_conn)) break;
     }
     
     if (received < 5) return -1;
@@ -132,13 +160,10 @@ static int tls_recv_record(tls_conn_t* conn, uint8_t* content_type,
     
     // Receive payload
     received = 0;
-    for (volatile int timeout = 0; timeout < 50000000 && received < (int)length; timeout++) {
-        e1000_poll();
+    while (received < (int)length && tcp_wait_readable(conn->tcp_conn, TLS_RECV_TIMEOUT_NS)) {
         int r = tcp_recv(conn->tcp_conn, (char*)(data + received), length - received);
-        if (r > 0) {
-            received += r;
-            timeout = 0;
-        }
+        if (r > 0) received += r;
+        else if (tcp_is_closed(conn->tcp_conn)) break;
     }
     
     return received;
@@ -801,7 +826,7 @@ int tls_handshake(tls_conn_t* conn, const char* hostname) {
 }
 
 int tls_send(tls_conn_t* conn, const uint8_t* data, size_t len) {
-    if (conn->state != TLS_STATE_ESTABLISHED) {
+    if (conn->state != TLS_STATE_ESTABLISHED || len > TLS_MAX_FRAGMENT) {
         return -1;
     }
     
@@ -826,24 +851,24 @@ int tls_send(tls_conn_t* conn, const uint8_t* data, size_t len) {
         aad[11] = (len >> 8) & 0xff;
         aad[12] = len & 0xff;
         
-        uint8_t* encrypted = (uint8_t*)data;  // Warning: modifies input!
-        uint8_t ciphertext[16384];
-        for (size_t i = 0; i < len; i++) ciphertext[i] = data[i];
+        // explicit nonce || ciphertext || tag, encrypted in place
+        uint8_t* record = (uint8_t*)kmalloc(8 + len + 16);
+        if (!record) return -1;
+        for (int i = 0; i < 8; i++) record[i] = nonce[4 + i];
+        for (size_t i = 0; i < len; i++) record[8 + i] = data[i];
         
         uint8_t tag[16];
-        aes_gcm_encrypt(&gcm, aad, 13, ciphertext, len, tag);
-        
-        uint8_t record[8 + 16384 + 16];
-        for (int i = 0; i < 8; i++) record[i] = nonce[4 + i];
-        for (size_t i = 0; i < len; i++) record[8 + i] = ciphertext[i];
+        aes_gcm_encrypt(&gcm, aad, 13, record + 8, len, tag);
         for (int i = 0; i < 16; i++) record[8 + len + i] = tag[i];
         
         int ret = tls_send_record(conn, TLS_CONTENT_APPLICATION_DATA, record, 8 + len + 16);
+        kfree(record);
         conn->client_seq++;
         return ret;
     } else {
         // CBC mode
-        uint8_t mac_input[13 + 16384];
+        uint8_t* mac_input = (uint8_t*)kmalloc(13 + len);
+        if (!mac_input) return -1;
         for (int i = 0; i < 8; i++) {
             mac_input[i] = (conn->client_seq >> ((7 - i) * 8)) & 0xff;
         }
@@ -856,9 +881,12 @@ int tls_send(tls_conn_t* conn, const uint8_t* data, size_t len) {
         
         uint8_t mac[32];
         hmac_sha256(conn->client_write_MAC_key, 32, mac_input, 13 + len, mac);
+        kfree(mac_input);
         
-        // Build plaintext: data || MAC || padding
-        uint8_t plaintext[16384 + 32 + 16];
+        // Build IV || plaintext, then encrypt the plaintext (data || MAC || padding) in place
+        uint8_t* record = (uint8_t*)kmalloc(16 + len + 32 + 16);
+        if (!record) return -1;
+        uint8_t* plaintext = record + 16;
         size_t plain_len = 0;
         for (size_t i = 0; i < len; i++) plaintext[plain_len++] = data[i];
         for (int i = 0; i < 32; i++) plaintext[plain_len++] = mac[i];
@@ -871,27 +899,23 @@ int tls_send(tls_conn_t* conn, const uint8_t* data, size_t len) {
         uint8_t iv[16];
         generate_random(iv, 16);
         
-        aes_cbc_encrypt(&conn->client_aes, iv, plaintext, plain_len);
-        
-        uint8_t record[16 + 16384 + 32 + 16];
         for (int i = 0; i < 16; i++) record[i] = iv[i];
-        for (size_t i = 0; i < plain_len; i++) record[16 + i] = plaintext[i];
+        aes_cbc_encrypt(&conn->client_aes, iv, plaintext, plain_len);
         
         int ret = tls_send_record(conn, TLS_CONTENT_APPLICATION_DATA, record, 16 + plain_len);
+        kfree(record);
         conn->client_seq++;
         return ret;
     }
 }
 
-int tls_recv(tls_conn_t* conn, uint8_t* data, size_t max_len) {
-    if (conn->state != TLS_STATE_ESTABLISHED) {
-        return -1;
-    }
-    
-    uint8_t buffer[16384 + 256];
+#define TLS_RECV_BUFFER (TLS_MAX_FRAGMENT + 256)
+
+// Receive one record into `buffer` (TLS_RECV_BUFFER bytes) and decrypt it into data
+static int tls_recv_decrypt(tls_conn_t* conn, uint8_t* buffer, uint8_t* data, size_t max_len) {
     uint8_t content_type;
     
-    int len = tls_recv_record(conn, &content_type, buffer, sizeof(buffer));
+    int len = tls_recv_record(conn, &content_type, buffer, TLS_RECV_BUFFER);
     if (len < 0) return -1;
     
     if (content_type == TLS_CONTENT_ALERT) {
@@ -967,6 +991,17 @@ int tls_recv(tls_conn_t* conn, uint8_t* data, size_t max_len) {
     }
 }
 
+int tls_recv(tls_conn_t* conn, uint8_t* data, size_t max_len) {
+    if (conn->state != TLS_STATE_ESTABLISHED) {
+        return -1;
+    }
+    uint8_t* buffer = (uint8_t*)kmalloc(TLS_RECV_BUFFER);
+    if (!buffer) return -1;
+    int ret = tls_recv_decrypt(conn, buffer, data, max_len);
+    kfree(buffer);
+    return ret;
+}
+
 void tls_close(tls_conn_t* conn) {
     if (conn->state == TLS_STATE_ESTABLISHED) {
         // Send close_notify alert
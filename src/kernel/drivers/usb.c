@@ -9,6 +9,7 @@
 #include <kernel/drivers/xhci.h>
 #include <kernel/sys/tty.h>
 #include <kernel/sys/kmalloc.h>
+#include <kernel/sys/preempt.h>
 
 // USB Controllers
 #define MAX_USB_CONTROLLERS 8
@@ -164,7 +165,11 @@ static void usb_keyboard_process_report(uint8_t* report) {
                     } else if (c == '\n') {
                         tty_putchar('\n');
                         if (!tty_is_editor_mode()) {
+                            // Commands use FAT32, which has no lock yet: keep user syscalls
+                            // out until the command is done, as for the PS/2 shell in its IRQ
+                            preempt_disable();
                             tty_process_command();
+                            preempt_enable();
                         }
                     } else {
                         tty_putchar(c);
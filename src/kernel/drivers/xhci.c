@@ -7,6 +7,8 @@
 #include <kernel/drivers/usb.h>
 #include <kernel/sys/tty.h>
 #include <kernel/sys/kmalloc.h>
+#include <kernel/sys/string.h>
+#include <kernel/arch/x86_64/pmm.h>
 
 // Forward declarations
 static int xhci_init_controller(usb_controller_t* ctrl);
@@ -99,6 +101,26 @@ static uint64_t xhci_phys(void* ptr) {
     return (uint64_t)(uintptr_t)ptr;
 }
 
+// Order of the smallest buddy block holding `size` bytes
+static unsigned int xhci_dma_order(size_t size) {
+    unsigned int order = 0;
+    while (((size_t)PMM_PAGE_SIZE << order) < size) order++;
+    return order;
+}
+
+// Allocate zeroed, physically contiguous memory the controller can DMA into.
+// Buddy blocks are identity mapped and naturally aligned, which covers every xHCI alignment/boundary rule.
+static void* xhci_dma_alloc(size_t size) {
+    unsigned int order = xhci_dma_order(size);
+    void* p = pmm_alloc_pages(order);
+    if (p) memset_k(p, 0, (size_t)PMM_PAGE_SIZE << order);
+    return p;
+}
+
+static void xhci_dma_free(void* p, size_t size) {
+    if (p) pmm_free_pages_order(p, xhci_dma_order(size));
+}
+
 // Wait for controller not ready to clear
 static int xhci_wait_ready(xhci_controller_t* xhci) {
     for (int i = 0; i < 1000; i++) {
@@ -356,7 +378,7 @@ int xhci_init(usb_controller_t* ctrl, pci_device_t* pci_dev) {
     xhci_op_write32(xhci, XHCI_CONFIG, xhci->num_slots);
     
     // Allocate DCBAA (Device Context Base Address Array)
-    xhci->dcbaa = (uint64_t*)kmalloc_aligned((xhci->num_slots + 1) * sizeof(uint64_t), 64);
+    xhci->dcbaa = (uint64_t*)xhci_dma_alloc((xhci->num_slots + 1) * sizeof(uint64_t));
     if (!xhci->dcbaa) {
         kfree(xhci);
         return -1;
@@ -372,11 +394,11 @@ int xhci_init(usb_controller_t* ctrl, pci_device_t* pci_dev) {
     if (xhci->num_scratchpad > 0) {
         uint32_t page_size = xhci_op_read32(xhci, XHCI_PAGESIZE) << 12;
         
-        xhci->scratchpad_array = (uint64_t*)kmalloc_aligned(xhci->num_scratchpad * sizeof(uint64_t), 64);
+        xhci->scratchpad_array = (uint64_t*)xhci_dma_alloc(xhci->num_scratchpad * sizeof(uint64_t));
         xhci->scratchpad_buffers = (void**)kmalloc(xhci->num_scratchpad * sizeof(void*));
         
         for (int i = 0; i < xhci->num_scratchpad; i++) {
-            xhci->scratchpad_buffers[i] = kmalloc_aligned(page_size, page_size);
+            xhci->scratchpad_buffers[i] = xhci_dma_alloc(page_size);
             xhci->scratchpad_array[i] = xhci_phys(xhci->scratchpad_buffers[i]);
         }
         
@@ -387,7 +409,7 @@ int xhci_init(usb_controller_t* ctrl, pci_device_t* pci_dev) {
     xhci_op_write64(xhci, XHCI_DCBAAP, xhci_phys(xhci->dcbaa));
     
     // Allocate command ring
-    xhci->cmd_ring = (xhci_trb_t*)kmalloc_aligned(CMD_RING_SIZE * sizeof(xhci_trb_t), 64);
+    xhci->cmd_ring = (xhci_trb_t*)xhci_dma_alloc(CMD_RING_SIZE * sizeof(xhci_trb_t));
     for (int i = 0; i < CMD_RING_SIZE; i++) {
         xhci->cmd_ring[i].parameter = 0;
         xhci->cmd_ring[i].status = 0;
@@ -401,7 +423,7 @@ int xhci_init(usb_controller_t* ctrl, pci_device_t* pci_dev) {
     xhci_op_write64(xhci, XHCI_CRCR, crcr);
     
     // Allocate event ring
-    xhci->event_ring = (xhci_trb_t*)kmalloc_aligned(EVENT_RING_SIZE * sizeof(xhci_trb_t), 64);
+    xhci->event_ring = (xhci_trb_t*)xhci_dma_alloc(EVENT_RING_SIZE * sizeof(xhci_trb_t));
     for (int i = 0; i < EVENT_RING_SIZE; i++) {
         xhci->event_ring[i].parameter = 0;
         xhci->event_ring[i].status = 0;
@@ -411,7 +433,7 @@ int xhci_init(usb_controller_t* ctrl, pci_device_t* pci_dev) {
     xhci->event_ring_cycle = 1;
     
     // Allocate ERST (Event Ring Segment Table)
-    xhci->erst = (xhci_erst_entry_t*)kmalloc_aligned(sizeof(xhci_erst_entry_t), 64);
+    xhci->erst = (xhci_erst_entry_t*)xhci_dma_alloc(sizeof(xhci_erst_entry_t));
     xhci->erst[0].ring_base = xhci_phys(xhci->event_ring);
     xhci->erst[0].ring_size = EVENT_RING_SIZE;
     xhci->erst[0].reserved = 0;
@@ -487,18 +509,17 @@ static void xhci_shutdown(usb_controller_t* ctrl) {
     xhci_delay(10);
     
     // Free resources
-    if (xhci->dcbaa) kfree(xhci->dcbaa);
-    if (xhci->cmd_ring) kfree(xhci->cmd_ring);
-    if (xhci->event_ring) kfree(xhci->event_ring);
-    if (xhci->erst) kfree(xhci->erst);
+    xhci_dma_free(xhci->dcbaa, (xhci->num_slots + 1) * sizeof(uint64_t));
+    xhci_dma_free(xhci->cmd_ring, CMD_RING_SIZE * sizeof(xhci_trb_t));
+    xhci_dma_free(xhci->event_ring, EVENT_RING_SIZE * sizeof(xhci_trb_t));
+    xhci_dma_free(xhci->erst, sizeof(xhci_erst_entry_t));
     
     if (xhci->scratchpad_array) {
+        uint32_t page_size = xhci_op_read32(xhci, XHCI_PAGESIZE) << 12;
         for (int i = 0; i < xhci->num_scratchpad; i++) {
-            if (xhci->scratchpad_buffers[i]) {
-                kfree(xhci->scratchpad_buffers[i]);
-            }
+            xhci_dma_free(xhci->scratchpad_buffers[i], page_size);
         }
-        kfree(xhci->scratchpad_array);
+        xhci_dma_free(xhci->scratchpad_array, xhci->num_scratchpad * sizeof(uint64_t));
         kfree(xhci->scratchpad_buffers);
     }
     
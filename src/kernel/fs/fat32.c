@@ -544,6 +544,21 @@ int fat32_read_file(fat32_file_t* file, uint8_t* buffer, uint32_t size) {
     return bytes_read;
 }
 
+// Position a file handle at byte `pos` by walking its cluster chain
+int fat32_seek_file(fat32_file_t* file, uint32_t pos) {
+    if (pos > file->file_size) return -1;
+    uint32_t cluster_size = boot_sector.sectors_per_cluster * 512;
+    uint32_t cluster = file->first_cluster;
+    // A read that ends on a cluster boundary has already stepped to the next cluster
+    for (uint32_t n = pos / cluster_size; n > 0 && pos < file->file_size; n--) {
+        cluster = fat32_get_next_cluster(cluster);
+        if (cluster >= FAT32_EOC) return -1;
+    }
+    file->current_cluster = cluster;
+    file->current_pos = pos;
+    return 0;
+}
+
 // Get current FAT32 date from RTC
 uint16_t fat32_get_current_date(void) {
     rtc_time_t current_time;
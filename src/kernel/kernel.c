@@ -20,9 +20,18 @@
 #include <kernel/net/tcp.h>
 #include <kernel/net/dns.h>
 #include <kernel/drivers/usb.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/arch/x86_64/apic.h>
+#include <kernel/arch/x86_64/fpu.h>
+#include <kernel/arch/x86_64/percpu.h>
+#include <kernel/sys/hrtimer.h>
 #include <cpu/gdt.h>
 
 void kernel_main(void *multiboot_info) {
+    // Per-CPU block behind GS_BASE first of all: every spinlock updates the preempt count there,
+    // and the first interrupt stub needs it too
+    percpu_init(0);
     // Try to initialize framebuffer from Multiboot2 info
     // The bootloader now maps 4GB of memory, so framebuffer should be accessible
     int fb_ok = fb_init_from_multiboot2(multiboot_info);
@@ -59,32 +68,31 @@ void kernel_main(void *multiboot_info) {
     gdt_init();
     // Initialize interrupts
     idt_init();
+    // Calibrate the TSC against the PIT (used by benchmarks and timekeeping)
+    tsc_init();
     // Initialize keyboard
     keyboard_init();
     // Initialize RTC
     rtc_init();
     // Initialize ATA disk driver
     ata_init();
+    // Read the CPU list while the Multiboot2 info is still intact
+    smp_detect(multiboot_info);
     // Initialize physical memory manager (bitmap allocator)
     pmm_init(multiboot_info, 0);
     // Initialize virtual memory manager (page table helpers)
     vmm_init();
+    // Local APIC timer as the clock event behind high-resolution timers
+    if (lapic_init() == 0) hrtimer_cpu_init();
+    // SSE/AVX state, switched lazily between tasks
+    fpu_init();
     // Initialize scheduler
     scheduler_init();
     // Initialize syscall mechanism
     syscall_init();
-    
-    // Disable timer interrupt (IRQ0) for now while debugging user mode
-    extern u8 port_byte_in(u16);
-    extern void port_byte_out(u16, u8);
-    u8 pic_mask = port_byte_in(0x21);
-    pic_mask |= 0x01;  // Disable IRQ0 (timer)
-    port_byte_out(0x21, pic_mask);
-    tty_putstr("[KERNEL] Timer interrupt disabled\n");
-    
-    // Add a simple test kernel thread
-    extern void test_thread(void);
-    scheduler_add_task(test_thread);
+    // Start the application processors, each running its own scheduler
+    smp_init();
+
     // Initialize FAT32 filesystem
     if (fat32_init() != 0) {
         tty_putstr("\nWarning: Filesystem initialization failed.\n");
@@ -109,13 +117,7 @@ void kernel_main(void *multiboot_info) {
     while (1) {
         // Poll USB for keyboard input (works alongside PS/2)
         usb_poll();
-        __asm__ volatile("hlt"); // Halt until next interrupt
+        // Run queued tasks, or halt until the next interrupt
+        scheduler_idle();
     }
 }
-
-void test_thread(void) {
-    while (1) {
-        tty_putstr("[thread] tick\n");
-        for (volatile int i = 0; i < 1000000; ++i) __asm__ volatile ("nop");
-    }
-}
\ No newline at end of file
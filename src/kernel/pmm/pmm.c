@@ -3,50 +3,183 @@
 #include <stddef.h>
 #include <kernel/sys/string.h> // for mem* helpers if available; fallback to local
 #include <kernel/sys/tty.h>
+#include <kernel/sys/kmalloc.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <kernel/arch/x86_64/vmm.h>
+#include <kernel/sys/spinlock.h>
 
-// Simple bitmap physical memory manager.
+// Binary buddy physical memory manager.
 // Layout:
-//  - We'll scan Multiboot2 memory map tags to find usable regions.
-//  - Create a bitmap where each bit represents one 4KiB page.
-//  - The bitmap itself will be placed in a reserved memory region (we'll use first usable region after kernel), but for simplicity
-//    we'll allocate it from a static area in the kernel binary (compile-time array) large enough for moderately sized RAM (e.g., 128 MiB).
+//  - We'll scan Multiboot2 memory map tags to find usable regions, each described by a pmm_region_t.
+//  - Every page of every usable region gets one pmm_frame_t in the frame database. Holes between regions
+//    cost nothing: frame indices are packed region after region.
+//  - A bitmap with one bit per frame (1 = used) stays the authoritative per-page state.
+//  - Free pages are grouped into naturally aligned blocks of 2^order pages kept on per-region, per-order
+//    free lists. The links live in the frame database, so free memory itself is never touched.
+//  - Allocation splits the smallest large-enough block; freeing merges with the buddy block while it is free.
+//  - The frame database and bitmap are sized at boot and placed in the first usable region that fits,
+//    so the kernel image does not grow with installed RAM.
 
-#define MAX_RAM_BYTES (256 * 1024 * 1024ULL) // support up to 256 MiB physical for bitmap sizing convenience
-#define MAX_PAGES (MAX_RAM_BYTES / PMM_PAGE_SIZE)
-#define BITMAP_SIZE_BYTES ((MAX_PAGES + 7) / 8)
+#define PMM_ORDER_NONE 0xFF
+#define PMM_FRAME_NONE 0xFFFFFFFFu
+#define PMM_MAX_REGIONS 32
 
-static uint8_t pmm_bitmap[BITMAP_SIZE_BYTES];
+// The bootloader identity maps the first 4 GiB; the frame database must be reachable before vmm_init runs
+#define PMM_BOOT_MAPPED_LIMIT (4ULL * 1024 * 1024 * 1024)
+// Real-mode memory: BIOS data and the AP start-up trampoline (smp.c) live below 1 MiB
+#define PMM_LOW_RESERVED 0x100000
+
+// Per-frame descriptor
+typedef struct {
+    uint32_t next;      // free-list link (frame index) while this frame heads a free block
+    uint32_t prev;
+    uint8_t  order;     // order of the free block starting at this frame, PMM_ORDER_NONE otherwise
+    uint8_t  flags;
+    uint16_t refs;      // extra owners of an allocated frame shared copy-on-write (0 = single owner)
+} pmm_frame_t;
+
+// One contiguous range of usable RAM
+typedef struct {
+    uintptr_t base;                             // physical base (page aligned)
+    size_t pages;                               // number of frames in the region
+    size_t first_frame;                         // index of the region's first frame in the frame database
+    uint32_t free_lists[PMM_MAX_ORDER + 1];     // heads of the per-order free lists
+    uint32_t nonempty;                          // bit n set when free_lists[n] is not empty
+} pmm_region_t;
+
+static pmm_region_t regions[PMM_MAX_REGIONS];
+static size_t region_count = 0;
+static pmm_frame_t *frames = NULL;
+static uint64_t *pmm_bitmap = NULL;
 static size_t total_pages = 0;
 static size_t free_pages = 0;
-static uintptr_t physical_memory_base = 0; // lowest physical address tracked by bitmap (aligned to page)
+static size_t pmm_scan_hint = 0;    // next-fit cursor: every frame below it is known to be in use
+
+// Covers the free lists, bitmap, reference counts and counters. Innermost lock of the memory
+// allocators: the heap and slab caches call in with theirs held, never the other way round.
+static lock_stat_t pmm_stat = LOCK_STAT_INIT("pmm");
+static spinlock_t pmm_lock = SPINLOCK_INIT_STAT(pmm_stat);
 
 // Kernel-provided symbols from linker script
 extern uint8_t __kernel_start;
 extern uint8_t __kernel_end;
 
 // Helpers
-static inline void bitmap_set(size_t idx) { pmm_bitmap[idx >> 3] |= (1 << (idx & 7)); }
-static inline void bitmap_clear(size_t idx) { pmm_bitmap[idx >> 3] &= ~(1 << (idx & 7)); }
-static inline int bitmap_test(size_t idx) { return (pmm_bitmap[idx >> 3] >> (idx & 7)) & 1; }
+static inline void bitmap_set(size_t idx) { pmm_bitmap[idx >> 6] |= (1ULL << (idx & 63)); }
+static inline void bitmap_clear(size_t idx) { pmm_bitmap[idx >> 6] &= ~(1ULL << (idx & 63)); }
+static inline int bitmap_test(size_t idx) { return (pmm_bitmap[idx >> 6] >> (idx & 63)) & 1; }
+
+// Next frame in [idx, end) whose bit equals `used`, or `end` if there is none.
+// Works a 64-bit word at a time using count-trailing-zeros on the (inverted) word.
+static size_t bitmap_next(size_t idx, size_t end, int used) {
+    while (idx < end) {
+        uint64_t word = pmm_bitmap[idx >> 6];
+        if (!used) word = ~word;
+        word &= ~0ULL << (idx & 63);
+        if (word) {
+            size_t i = (idx & ~(size_t)63) + (size_t)__builtin_ctzll(word);
+            return i < end ? i : end;
+        }
+        idx = (idx | 63) + 1;
+    }
+    return end;
+}
+
+static inline uintptr_t frame_phys(const pmm_region_t *r, size_t idx) {
+    return r->base + (idx - r->first_frame) * PMM_PAGE_SIZE;
+}
+
+// Find the region holding a physical address, or NULL if it is not tracked
+static pmm_region_t *region_of(uintptr_t a) {
+    for (size_t i = 0; i < region_count; ++i) {
+        pmm_region_t *r = &regions[i];
+        if (a >= r->base && a < r->base + r->pages * PMM_PAGE_SIZE) return r;
+    }
+    return NULL;
+}
+
+// Free list helpers
+static void free_list_push(pmm_region_t *r, unsigned int order, size_t idx) {
+    pmm_frame_t *f = &frames[idx];
+    f->prev = PMM_FRAME_NONE;
+    f->next = r->free_lists[order];
+    if (f->next != PMM_FRAME_NONE) frames[f->next].prev = (uint32_t)idx;
+    r->free_lists[order] = (uint32_t)idx;
+    r->nonempty |= 1u << order;
+    f->order = (uint8_t)order;
+}
+
+static void free_list_remove(pmm_region_t *r, unsigned int order, size_t idx) {
+    pmm_frame_t *f = &frames[idx];
+    if (f->prev != PMM_FRAME_NONE) frames[f->prev].next = f->next;
+    else r->free_lists[order] = f->next;
+    if (f->next != PMM_FRAME_NONE) frames[f->next].prev = f->prev;
+    if (r->free_lists[order] == PMM_FRAME_NONE) r->nonempty &= ~(1u << order);
+    f->order = PMM_ORDER_NONE;
+}
+
+// Carve every run of free frames of a region into maximal blocks aligned on physical frame numbers
+static void build_free_lists(pmm_region_t *r) {
+    size_t end = r->first_frame + r->pages;
+    size_t i = r->first_frame;
+    while ((i = bitmap_next(i, end, 0)) < end) {
+        size_t run_end = bitmap_next(i, end, 1);
+        while (i < run_end) {
+            uintptr_t pfn = frame_phys(r, i) / PMM_PAGE_SIZE;
+            unsigned int order = PMM_MAX_ORDER;
+            while (order > 0 && ((pfn & ((1UL << order) - 1)) || i + (1UL << order) > run_end)) order--;
+            free_list_push(r, order, i);
+            i += 1UL << order;
+        }
+    }
+}
 
 // Multiboot2 tag parsing helpers
 struct mb2_tag { uint32_t type; uint32_t size; };
 static inline uint32_t read_u32(const uint8_t *p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); }
 static inline uint64_t read_u64(const uint8_t *p) {
     uint64_t v = 0;
-    for (int i = 0; i < 8; ++i) v |= ((uint64_t)p[8 + i]) << (i*8);
+    for (int i = 0; i < 8; ++i) v |= ((uint64_t)p[i]) << (i*8);
     return v;
 }
 
+// Record one usable range, page aligned and with the first 1 MiB left out
+// (real-mode IVT, BIOS data, and physical page 0 which would read as NULL)
+static void add_region(uint64_t base, uint64_t len) {
+    uint64_t start = (base + PMM_PAGE_SIZE - 1) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+    uint64_t end = (base + len) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+    if (start < 0x100000) start = 0x100000;
+    if (end <= start) return;
+    if (region_count == PMM_MAX_REGIONS) {
+        tty_putstr("[PMM] Too many memory regions, ignoring some RAM\n");
+        return;
+    }
+    // Keep the table sorted by address so allocations prefer low memory
+    size_t pos = region_count;
+    while (pos > 0 && regions[pos - 1].base > start) {
+        regions[pos] = regions[pos - 1];
+        pos--;
+    }
+    regions[pos].base = (uintptr_t)start;
+    regions[pos].pages = (size_t)((end - start) / PMM_PAGE_SIZE);
+    region_count++;
+}
+
+// Bump `start` past [lo, hi) if the candidate range [start, start + size) overlaps it
+static uintptr_t skip_range(uintptr_t start, size_t size, uintptr_t lo, uintptr_t hi) {
+    if (start < hi && start + size > lo) return (hi + PMM_PAGE_SIZE - 1) & ~(uintptr_t)(PMM_PAGE_SIZE - 1);
+    return start;
+}
+
 void pmm_init(void *multiboot_info, size_t memory_size) {
-    // Zero bitmap
-    for (size_t i = 0; i < BITMAP_SIZE_BYTES; ++i) pmm_bitmap[i] = 0xFF; // mark all used first
+    (void)memory_size;
+    region_count = 0;
+    total_pages = 0;
+    free_pages = 0;
+    pmm_scan_hint = 0;
 
     if (!multiboot_info) {
-        // fallback: assume small memory from 1M..MAX_RAM_BYTES
-        physical_memory_base = 0x100000; // 1MiB
-        total_pages = (MAX_RAM_BYTES - physical_memory_base) / PMM_PAGE_SIZE;
-        free_pages = 0;
+        tty_putstr("[PMM] No Multiboot2 info, physical allocator disabled\n");
         return;
     }
 
@@ -54,30 +187,20 @@ void pmm_init(void *multiboot_info, size_t memory_size) {
     uint32_t total_size = read_u32(mb);
     if (total_size == 0) return;
 
-    // We'll scan for memory map (tag type 6) which is multiboot2 memory map
+    // Scan the memory map (tag type 6) and record every available RAM range
     uint32_t offset = 8;
-    uintptr_t highest_addr = 0;
-    uintptr_t lowest_addr = (uintptr_t)-1;
-
-    // First pass to find max physical address so we know how many pages to track
     while (offset + 8 <= total_size) {
         struct mb2_tag *tag = (struct mb2_tag *)(mb + offset);
         if (tag->type == 0) break;
         if (tag->type == 6) {
             uint8_t *t = mb + offset;
             uint32_t entry_size = read_u32(t + 8);
-            uint32_t entry_version = read_u32(t + 12);
             uint32_t pos = 16;
-            while (pos + entry_size <= tag->size) {
-                uint64_t base = 0;
-                for (int i = 0; i < 8; ++i) base |= ((uint64_t)t[16 + pos - 16 + i]) << (i*8);
-                uint64_t len = 0;
-                for (int i = 0; i < 8; ++i) len |= ((uint64_t)t[16 + pos - 16 + 8 + i]) << (i*8);
-                uint32_t type = (uint32_t)t[16 + pos - 16 + 16];
-                if (type == 1) { // available RAM
-                    if (base < lowest_addr) lowest_addr = base;
-                    if (base + len > highest_addr) highest_addr = base + len;
-                }
+            while (entry_size && pos + entry_size <= tag->size) {
+                uint64_t base = read_u64(t + pos);
+                uint64_t len = read_u64(t + pos + 8);
+                uint32_t type = read_u32(t + pos + 16);
+                if (type == 1) add_region(base, len); // available RAM
                 pos += entry_size;
             }
         }
@@ -86,117 +209,285 @@ void pmm_init(void *multiboot_info, size_t memory_size) {
         offset += (sz + 7) & ~7u;
     }
 
-    if (highest_addr == 0 || lowest_addr == (uintptr_t)-1) {
-        // no usable regions found; default
-        physical_memory_base = 0x100000;
-        total_pages = (MAX_RAM_BYTES - physical_memory_base) / PMM_PAGE_SIZE;
-        for (size_t i = 0; i < total_pages; ++i) bitmap_set(i); // mark used
-        free_pages = 0;
+    if (region_count == 0) {
+        tty_putstr("[PMM] No usable memory regions found\n");
         return;
     }
 
-    // Cap tracking to MAX_RAM_BYTES
-    if (highest_addr > MAX_RAM_BYTES) highest_addr = MAX_RAM_BYTES;
-    if (lowest_addr > highest_addr) lowest_addr = 0x100000;
+    for (size_t i = 0; i < region_count; ++i) {
+        regions[i].first_frame = total_pages;
+        total_pages += regions[i].pages;
+    }
 
-    physical_memory_base = lowest_addr & ~(PMM_PAGE_SIZE - 1);
-    total_pages = (highest_addr - physical_memory_base) / PMM_PAGE_SIZE;
-    if (total_pages > MAX_PAGES) total_pages = MAX_PAGES;
+    // Size the frame database and bitmap, then find room for them in the first region that fits
+    size_t bitmap_words = (total_pages + 63) / 64;
+    size_t db_bytes = total_pages * sizeof(pmm_frame_t) + bitmap_words * sizeof(uint64_t);
+    uintptr_t kstart = (uintptr_t)&__kernel_start;
+    uintptr_t kend = (uintptr_t)&__kernel_end;
+    uintptr_t mbstart = (uintptr_t)multiboot_info;
+    uintptr_t mbend = mbstart + total_size;
+    uintptr_t db_base = 0;
+    for (size_t i = 0; i < region_count && !db_base; ++i) {
+        uintptr_t rend = regions[i].base + regions[i].pages * PMM_PAGE_SIZE;
+        uintptr_t start = regions[i].base;
+        // Moving past one range can land on another, so settle all of them
+        for (int pass = 0; pass < 4; ++pass) {
+            start = skip_range(start, db_bytes, 0, PMM_LOW_RESERVED);
+            start = skip_range(start, db_bytes, kstart, kend);
+            start = skip_range(start, db_bytes, mbstart, mbend);
+            start = skip_range(start, db_bytes, VMM_USER_BASE, VMM_USER_IMAGE_END);
+        }
+        if (start + db_bytes <= rend && start + db_bytes <= PMM_BOOT_MAPPED_LIMIT) db_base = start;
+    }
+    if (!db_base) {
+        tty_putstr("[PMM] No room for the frame database\n");
+        region_count = 0;
+        total_pages = 0;
+        return;
+    }
 
-    // Initially mark all pages used; we'll mark available pages free below
-    for (size_t i = 0; i < total_pages; ++i) bitmap_set(i);
-    free_pages = 0;
+    frames = (pmm_frame_t *)db_base;
+    pmm_bitmap = (uint64_t *)(db_base + total_pages * sizeof(pmm_frame_t));
+    for (size_t i = 0; i < bitmap_words; ++i) pmm_bitmap[i] = ~0ULL; // mark all used first
+    for (size_t i = 0; i < total_pages; ++i) {
+        frames[i].next = PMM_FRAME_NONE;
+        frames[i].prev = PMM_FRAME_NONE;
+        frames[i].order = PMM_ORDER_NONE;
+        frames[i].flags = 0;
+        frames[i].refs = 0;
+    }
 
-    // Second pass: mark available regions as free, but skip reserved regions and kernel area
-    offset = 8;
-    while (offset + 8 <= total_size) {
-        struct mb2_tag *tag = (struct mb2_tag *)(mb + offset);
-        if (tag->type == 0) break;
-        if (tag->type == 6) {
-            uint8_t *t = mb + offset;
-            uint32_t entry_size = read_u32(t + 8);
-            uint32_t entry_version = read_u32(t + 12);
-            uint32_t pos = 16;
-            while (pos + entry_size <= tag->size) {
-                uint64_t base = 0;
-                for (int i = 0; i < 8; ++i) base |= ((uint64_t)t[16 + pos - 16 + i]) << (i*8);
-                uint64_t len = 0;
-                for (int i = 0; i < 8; ++i) len |= ((uint64_t)t[16 + pos - 16 + 8 + i]) << (i*8);
-                uint32_t type = (uint32_t)t[16 + pos - 16 + 16];
-                if (type == 1) { // available RAM
-                    uintptr_t start = (uintptr_t)base;
-                    uintptr_t end = (uintptr_t)(base + len);
-                    // clamp to our tracked area
-                    if (end <= physical_memory_base) { pos += entry_size; continue; }
-                    if (start < physical_memory_base) start = physical_memory_base;
-                    if (start >= physical_memory_base + total_pages * PMM_PAGE_SIZE) { pos += entry_size; continue; }
-                    if (end > physical_memory_base + total_pages * PMM_PAGE_SIZE) end = physical_memory_base + total_pages * PMM_PAGE_SIZE;
-                    size_t pstart = (start - physical_memory_base) / PMM_PAGE_SIZE;
-                    size_t pend = (end - physical_memory_base + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE; // one past
-                    for (size_t p = pstart; p < pend && p < total_pages; ++p) {
-                        // Reserve kernel pages
-                        uintptr_t page_phys = physical_memory_base + p * PMM_PAGE_SIZE;
-                        if (page_phys >= (uintptr_t)&__kernel_start && page_phys < (uintptr_t)&__kernel_end) {
-                            bitmap_set(p);
-                        } else {
-                            bitmap_clear(p);
-                            free_pages++;
-                        }
-                    }
-                }
+    // Mark every frame free except real-mode memory, the kernel image, the frame database itself and
+    // the frames whose identity addresses user tables use for program images (the kernel could not reach them there)
+    uintptr_t db_end = db_base + db_bytes;
+    for (size_t i = 0; i < region_count; ++i) {
+        pmm_region_t *r = &regions[i];
+        for (size_t idx = r->first_frame; idx < r->first_frame + r->pages; ++idx) {
+            uintptr_t page_phys = frame_phys(r, idx);
+            if (page_phys < PMM_LOW_RESERVED) continue;
+            if (page_phys + PMM_PAGE_SIZE > kstart && page_phys < kend) continue;
+            if (page_phys + PMM_PAGE_SIZE > db_base && page_phys < db_end) continue;
+            if (page_phys + PMM_PAGE_SIZE > VMM_USER_BASE && page_phys < VMM_USER_IMAGE_END) continue;
+            bitmap_clear(idx);
+            free_pages++;
+        }
+        for (unsigned int o = 0; o <= PMM_MAX_ORDER; ++o) r->free_lists[o] = PMM_FRAME_NONE;
+        r->nonempty = 0;
+        build_free_lists(r);
+    }
 
-                pos += entry_size;
-            }
+    tty_putstr("[PMM] ");
+    tty_putdec((uint32_t)(total_pages / 256));
+    tty_putstr(" MiB in ");
+    tty_putdec((uint32_t)region_count);
+    tty_putstr(" regions, frame database at ");
+    tty_puthex64(db_base);
+    tty_putstr(" (");
+    tty_putdec((uint32_t)(db_bytes / 1024));
+    tty_putstr(" KiB)\n");
+}
+
+static void *alloc_block(unsigned int order) {
+    if (order > PMM_MAX_ORDER) return 0;
+    if (free_pages < (1UL << order)) return 0;
+
+    // Lowest region first; within it, the smallest non-empty list that can satisfy the request
+    for (size_t i = 0; i < region_count; ++i) {
+        pmm_region_t *r = &regions[i];
+        uint32_t avail = r->nonempty >> order;
+        if (!avail) continue;
+        unsigned int o = order + (unsigned int)__builtin_ctz(avail);
+
+        size_t idx = r->free_lists[o];
+        free_list_remove(r, o, idx);
+        // Split down, returning the upper halves to the lower-order lists
+        while (o > order) {
+            o--;
+            free_list_push(r, o, idx + (1UL << o));
         }
-        uint32_t sz = tag->size;
-        if (sz == 0) break;
-        offset += (sz + 7) & ~7u;
+
+        for (size_t p = 0; p < (1UL << order); ++p) bitmap_set(idx + p);
+        free_pages -= 1UL << order;
+        return (void *)frame_phys(r, idx);
     }
+    return 0;
+}
 
-    // Mark first 1MB reserved
-    if (physical_memory_base == 0x100000) {
-        size_t reserve_pages = (0x100000 - physical_memory_base) / PMM_PAGE_SIZE;
-        for (size_t p = 0; p < reserve_pages && p < total_pages; ++p) {
-            if (!bitmap_test(p)) { bitmap_set(p); free_pages--; }
+static void free_block(void *addr, unsigned int order) {
+    if (!addr || order > PMM_MAX_ORDER) return;
+    uintptr_t a = (uintptr_t)addr;
+    pmm_region_t *r = region_of(a);
+    if (!r) return;
+    size_t count = 1UL << order;
+    uintptr_t pfn = a / PMM_PAGE_SIZE;
+    if (pfn & (count - 1)) return; // not the start of an order-sized block
+    size_t idx = r->first_frame + (a - r->base) / PMM_PAGE_SIZE;
+    if (idx + count > r->first_frame + r->pages) return;
+    for (size_t p = 0; p < count; ++p) {
+        if (!bitmap_test(idx + p)) {
+            // double free
+            return;
         }
     }
+    for (size_t p = 0; p < count; ++p) bitmap_clear(idx + p);
+    free_pages += count;
+    if (idx < pmm_scan_hint) pmm_scan_hint = idx;
 
+    // Merge with the buddy for as long as it is a free block of the same order inside this region
+    uintptr_t region_first_pfn = r->base / PMM_PAGE_SIZE;
+    while (order < PMM_MAX_ORDER) {
+        uintptr_t buddy_pfn = pfn ^ (1UL << order);
+        if (buddy_pfn < region_first_pfn || buddy_pfn + (1UL << order) > region_first_pfn + r->pages) break;
+        size_t buddy = r->first_frame + (buddy_pfn - region_first_pfn);
+        if (frames[buddy].order != order) break;
+        free_list_remove(r, order, buddy);
+        if (buddy_pfn < pfn) {
+            pfn = buddy_pfn;
+            idx = buddy;
+        }
+        order++;
+    }
+    free_list_push(r, order, idx);
+}
+
+void *pmm_alloc_pages(unsigned int order) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    void *p = alloc_block(order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return p;
+}
+
+void pmm_free_pages_order(void *addr, unsigned int order) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    free_block(addr, order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
 void *pmm_alloc_page(void) {
-    if (free_pages == 0) return 0;
-    for (size_t i = 0; i < total_pages; ++i) {
-        if (!bitmap_test(i)) {
-            bitmap_set(i);
-            free_pages--;
-            return (void *)(uintptr_t)(physical_memory_base + i * PMM_PAGE_SIZE);
-        }
-    }
-    return 0;
+    return pmm_alloc_pages(0);
 }
 
-void pmm_free_page(void *addr) {
-    if (!addr) return;
+// Frame database index of an allocated page, or (size_t)-1 if the page is untracked or free
+static size_t used_frame_index(void *addr) {
     uintptr_t a = (uintptr_t)addr;
-    if (a < physical_memory_base) return;
-    size_t idx = (a - physical_memory_base) / PMM_PAGE_SIZE;
-    if (idx >= total_pages) return;
-    if (!bitmap_test(idx)) {
-        // double free
-        return;
+    pmm_region_t *r = region_of(a);
+    if (!r || (a & (PMM_PAGE_SIZE - 1))) return (size_t)-1;
+    size_t idx = r->first_frame + (a - r->base) / PMM_PAGE_SIZE;
+    return bitmap_test(idx) ? idx : (size_t)-1;
+}
+
+void pmm_free_page(void *addr) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    size_t idx = used_frame_index(addr);
+    if (idx != (size_t)-1 && frames[idx].refs) {
+        // Still mapped elsewhere: only this owner goes away
+        frames[idx].refs--;
+    } else {
+        free_block(addr, 0);
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+int pmm_page_ref(void *addr) {
+    int rc = -1;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    size_t idx = used_frame_index(addr);
+    if (idx != (size_t)-1 && frames[idx].refs != 0xFFFF) {
+        frames[idx].refs++;
+        rc = 0;
     }
-    bitmap_clear(idx);
-    free_pages++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return rc;
+}
+
+uint32_t pmm_page_refcount(void *addr) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    size_t idx = used_frame_index(addr);
+    uint32_t refs = idx == (size_t)-1 ? 0 : (uint32_t)frames[idx].refs + 1;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return refs;
 }
 
 size_t pmm_total_pages(void) { return total_pages; }
 size_t pmm_free_pages(void) { return free_pages; }
 
+size_t pmm_region_count(void) { return region_count; }
+
+int pmm_get_region(size_t i, uintptr_t *base, size_t *pages) {
+    if (i >= region_count) return -1;
+    if (base) *base = regions[i].base;
+    if (pages) *pages = regions[i].pages;
+    return 0;
+}
+
 // External helper used by some code paths: find first zero bit in bitmap starting at idx
 // Return index of bit found or -1 (size_t max) if none.
 size_t ffs64_find_zero(size_t start_idx) {
-    for (size_t i = start_idx; i < total_pages; ++i) {
+    size_t from = start_idx < pmm_scan_hint ? pmm_scan_hint : start_idx;
+    size_t i = bitmap_next(from, total_pages, 0);
+    // Everything between the cursor and the result is in use, so later scans can start there
+    if (start_idx <= pmm_scan_hint) pmm_scan_hint = i;
+    return i < total_pages ? i : (size_t)-1;
+}
+
+// Reference implementation of the original allocator's search: one bit at a time from index 0
+static size_t bitscan_find_zero(void) {
+    for (size_t i = 0; i < total_pages; ++i) {
         if (!bitmap_test(i)) return i;
     }
     return (size_t)-1;
 }
+
+void pmm_benchmark(size_t count, pmm_bench_t *out) {
+    out->count = 0;
+    out->bitscan_cycles = out->wordscan_cycles = out->buddy_cycles = 0;
+    if (count > free_pages) count = free_pages;
+    if (count == 0) return;
+
+    size_t *idx = (size_t *)kmalloc(count * sizeof(size_t));
+    if (!idx) return;
+
+    // Frames are claimed behind the buddy allocator's back below, so nothing else may allocate meanwhile
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    // Original search: claim `count` frames, each found with a bit-by-bit scan from frame 0
+    uint64_t t0 = rdtsc();
+    size_t n = 0;
+    for (; n < count; ++n) {
+        size_t i = bitscan_find_zero();
+        if (i == (size_t)-1) break;
+        bitmap_set(i);
+        idx[n] = i;
+    }
+    out->bitscan_cycles = rdtsc() - t0;
+    for (size_t k = 0; k < n; ++k) bitmap_clear(idx[k]);
+
+    // Same claims through the word-at-a-time scan and its next-fit cursor
+    size_t saved_hint = pmm_scan_hint;
+    t0 = rdtsc();
+    size_t m = 0;
+    for (; m < n; ++m) {
+        size_t i = ffs64_find_zero(0);
+        if (i == (size_t)-1) break;
+        bitmap_set(i);
+        idx[m] = i;
+    }
+    out->wordscan_cycles = rdtsc() - t0;
+    for (size_t k = 0; k < m; ++k) bitmap_clear(idx[k]);
+    pmm_scan_hint = saved_hint;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    // Real allocations through the buddy free lists
+    t0 = rdtsc();
+    size_t b = 0;
+    for (; b < n; ++b) {
+        void *p = pmm_alloc_page();
+        if (!p) break;
+        idx[b] = (size_t)(uintptr_t)p;
+    }
+    out->buddy_cycles = rdtsc() - t0;
+    for (size_t k = 0; k < b; ++k) pmm_free_page((void *)(uintptr_t)idx[k]);
+
+    kfree(idx);
+    out->count = n;
+}
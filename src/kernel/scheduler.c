@@ -1,19 +1,41 @@
 #include <kernel/sys/scheduler.h>
 #include <kernel/sys/kmalloc.h>
-#include <kernel/arch/x86_64/pmm.h>
+#include <kernel/sys/slab.h>
+#include <kernel/sys/syscall.h>
+#include <kernel/arch/x86_64/kstack.h>
+#include <kernel/arch/x86_64/fpu.h>
 #include <kernel/arch/x86_64/vmm.h>
+#include <kernel/arch/x86_64/mm.h>
+#include <kernel/arch/x86_64/apic.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/sys/spinlock.h>
+#include <kernel/sys/hrtimer.h>
+#include <kernel/sys/waitqueue.h>
+#include <kernel/arch/x86_64/tsc.h>
 #include <kernel/sys/tty.h>
 #include <cpu/ports.h>
 #include <cpu/gdt.h>
+#include <kernel/arch/x86_64/percpu.h>
 #include <kernel/sys/string.h>
 #include <stdint.h>
 #include <stddef.h>
 
-extern uint64_t temp_kernel_rsp;
+// Priority scheduler for kernel threads and user processes: one FIFO run queue per nice level and
+// a bitmap of the non-empty levels, so the next task is found with a single bit scan. The most
+// favourable non-empty level always runs; tasks of the same level take turns.
+// Every CPU has its own set of queues behind its own lock. A CPU only arms its slice timer while
+// another task waits for it, so an idle or single-task CPU takes no scheduler interrupts.
+// New tasks go to the least loaded CPU, and a CPU whose queues run dry steals from the busiest one.
+// A task waiting for an event marks itself blocked and yields; it leaves the run queues until a
+// wake-up (wait queue or timer) puts it back on a run queue.
+// An exiting task stays a zombie until its parent collects its status (scheduler_wait); tasks
+// nobody waits for go straight to the reaper thread, which frees their memory once they are off
+// the CPU for good.
+// The kernel is preemptible: when a slice runs out or a wake-up asks for it, the task is switched
+// out on the next interrupt return, unless its preempt count says it holds a lock; the switch is
+// then made when the count drops back to zero (preempt.h).
 
-// Simple round-robin scheduler for kernel threads and user processes
-
-typedef enum { TASK_UNUSED = 0, TASK_RUNNABLE, TASK_RUNNING, TASK_ZOMBIE } task_state_t;
+typedef enum { TASK_UNUSED = 0, TASK_RUNNABLE, TASK_RUNNING, TASK_BLOCKED, TASK_ZOMBIE } task_state_t;
 
 typedef enum { TASK_KERNEL = 0, TASK_USER } task_type_t;
 
@@ -23,49 +45,370 @@ typedef struct task_struct {
     uint64_t cr3;           // page table base
     task_state_t state;
     task_type_t type;       // kernel thread or user process
-    void *stack_base;       // allocated stack base (virtual/identity)
+    void *stack_base;       // lowest address of the kstack_alloc stack; NULL for boot and idle tasks
     uint64_t user_rsp;      // user stack pointer (for user processes)
     uint64_t user_rip;      // user instruction pointer (for user processes)
+    uint16_t pcid;          // TLB tag of a user address space (0 until first switch)
+    uint32_t pcid_gen;      // PCID generation the tag was issued in
+    int pid;
+    int nice;               // SCHED_NICE_MIN (most favoured) .. SCHED_NICE_MAX
+    struct task_struct *run_next;   // run queue links, valid while on_rq
+    struct task_struct *run_prev;
+    int on_rq;
+    int cpu;                // CPU whose queues hold the task, or that last ran it
+    int pinned;             // never moved off `cpu`
+    int idle;               // an AP's idle loop: runs only when nothing else can, never queued
+    volatile int on_cpu;    // its stack is in use by a CPU, so no other CPU may run it yet
+    hrtimer_t timer;        // ends a timed wait
+    struct task_struct *parent;     // told about the exit; NULL if nobody collects the status
+    int exit_status;
+    int autoreap;           // handed to the reaper as soon as it is off the CPU after exiting
+    wait_queue_t child_exit;        // the task sleeps here in scheduler_wait
+    struct task_struct *reap_next;  // reaper list link
+    int32_t preempt_count;          // saved from the per-CPU block while the task is off the CPU
+    struct syscall_frame *syscall_frame;    // frame of its syscall in progress, likewise
+    fpu_ctx_t fpu;          // vector register state, loaded lazily (fpu.c)
 } task_struct_t;
 
-static task_struct_t *task_list = NULL;
-static task_struct_t *current = NULL;
+#define SCHED_LEVELS (SCHED_NICE_MAX - SCHED_NICE_MIN + 1)
+#define SCHED_SLICE_NS 5000000ULL   // 5 ms
+
+typedef struct {
+    task_struct_t *head;
+    task_struct_t *tail;
+} run_queue_t;
+
+// Per-CPU scheduler state. The lock covers the queues; `current`, `idle`, `prev` and `idling`
+// are only touched by the owning CPU. Switch requests go through need_resched in the per-CPU block.
+typedef struct {
+    spinlock_t lock;
+    run_queue_t queues[SCHED_LEVELS];
+    uint64_t bitmap;            // bit n set when queues[n] is not empty
+    uint32_t nr_queued;
+    task_struct_t *current;
+    task_struct_t *idle;        // fallback when nothing is runnable
+    task_struct_t *prev;        // switched away from, until the IRQ stub has left its stack
+    hrtimer_t slice;            // end of the running task's time slice
+    int slicing;                // time slices on; otherwise tasks run until they give up the CPU
+    volatile int idling;        // the idle task waits in hlt (scheduler_idle)
+    uint64_t switches;
+    uint64_t steals;
+    uint64_t preemptions;       // switches forced on a task that was still running
+    uint64_t deferred;          // preemptions held off because the task held a lock
+} cpu_rq_t;
+
+static task_struct_t *task_list = NULL;    // every task, circular, in creation order
+static spinlock_t task_list_lock = SPINLOCK_INIT;
+static kmem_cache_t *task_cache = NULL;
+static int next_pid = 1;
+static cpu_rq_t cpu_rqs[SMP_MAX_CPUS];
+
+// Dead tasks whose memory can go, and the reaper thread freeing them
+static task_struct_t *reap_list = NULL;
+static spinlock_t reap_lock = SPINLOCK_INIT;
+static wait_queue_t reap_wait = WAIT_QUEUE_INIT;
+static uint64_t reaped_count = 0;
+static void reaper_thread(void);
+static inline cpu_rq_t *this_rq(void) {
+    return &cpu_rqs[smp_cpu_id()];
+}
+
+// The task running on the calling CPU, mirrored from its run queue into the per-CPU block
+static inline task_struct_t *current_task(void) {
+    return (task_struct_t *)this_cpu()->current;
+}
+
+// Task structs come from their own cache pre-zeroed; task_free restores that state
+static void task_ctor(void *obj) {
+    memset_k(obj, 0, sizeof(task_struct_t));
+}
+
+static task_struct_t *task_alloc(void) {
+    if (!task_cache) task_cache = kmem_cache_create("task_struct", sizeof(task_struct_t), 0, task_ctor);
+    if (!task_cache) return NULL;
+    task_struct_t *t = (task_struct_t *)kmem_cache_alloc(task_cache);
+    if (t) t->pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
+    return t;
+}
+
+static void task_free(task_struct_t *t) {
+    task_ctor(t);
+    kmem_cache_free(task_cache, t);
+}
+
+static inline int nice_level(int nice) {
+    return nice - SCHED_NICE_MIN;
+}
+
+static int clamp_nice(int nice) {
+    if (nice < SCHED_NICE_MIN) return SCHED_NICE_MIN;
+    if (nice > SCHED_NICE_MAX) return SCHED_NICE_MAX;
+    return nice;
+}
+
+// Append a runnable task to the tail of its level on CPU `cpu`. Caller holds that CPU's lock.
+static void rq_enqueue(int cpu, task_struct_t *t) {
+    if (t->on_rq) return;
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    run_queue_t *q = &rq->queues[nice_level(t->nice)];
+    t->run_next = NULL;
+    t->run_prev = q->tail;
+    if (q->tail) q->tail->run_next = t;
+    else q->head = t;
+    q->tail = t;
+    t->on_rq = 1;
+    t->cpu = cpu;
+    rq->bitmap |= 1ULL << nice_level(t->nice);
+    rq->nr_queued++;
+}
+
+// Caller holds the lock of the CPU queuing the task (t->cpu)
+static void rq_remove(task_struct_t *t) {
+    if (!t->on_rq) return;
+    cpu_rq_t *rq = &cpu_rqs[t->cpu];
+    run_queue_t *q = &rq->queues[nice_level(t->nice)];
+    if (t->run_prev) t->run_prev->run_next = t->run_next;
+    else q->head = t->run_next;
+    if (t->run_next) t->run_next->run_prev = t->run_prev;
+    else q->tail = t->run_prev;
+    t->run_next = t->run_prev = NULL;
+    t->on_rq = 0;
+    rq->nr_queued--;
+    if (!q->head) rq->bitmap &= ~(1ULL << nice_level(t->nice));
+}
+
+// Take the head of the most favoured non-empty level, or NULL if nothing is runnable
+static task_struct_t *rq_pick(cpu_rq_t *rq) {
+    if (!rq->bitmap) return NULL;
+    task_struct_t *t = rq->queues[__builtin_ctzll(rq->bitmap)].head;
+    rq_remove(t);
+    return t;
+}
+
+// Lock the queues currently holding `t`; they can change under us while it is being stolen
+static cpu_rq_t *task_rq_lock(task_struct_t *t, uint64_t *flags) {
+    for (;;) {
+        int cpu = t->cpu;
+        *flags = spin_lock_irqsave(&cpu_rqs[cpu].lock);
+        if (t->cpu == cpu) return &cpu_rqs[cpu];
+        spin_unlock_irqrestore(&cpu_rqs[cpu].lock, *flags);
+    }
+}
+
+// CPU for a new task: the one with the fewest queued tasks. The BSP already runs the shell and
+// every user process, so work that may move goes to the APs while any is online.
+static int select_cpu(task_struct_t *t) {
+    if (t->pinned) return t->cpu;
+    int best = -1;
+    for (int i = 1; i < SMP_MAX_CPUS; ++i) {
+        if (!cpu_rqs[i].current) continue;
+        if (best < 0 || cpu_rqs[i].nr_queued < cpu_rqs[best].nr_queued) best = i;
+    }
+    return best < 0 ? 0 : best;
+}
+
+// Start or stop the calling CPU's slice timer: it only runs while some task waits for the CPU
+static void slice_update(cpu_rq_t *rq, int restart) {
+    if (!rq->slicing) return;
+    if (!rq->nr_queued) hrtimer_cancel(&rq->slice);
+    else if (restart || !rq->slice.queued) hrtimer_start_ns(&rq->slice, SCHED_SLICE_NS);
+}
+
+static void slice_expired(hrtimer_t *timer) {
+    percpu_of((int)((cpu_rq_t *)timer->data - cpu_rqs))->need_resched = 1;
+}
+
+// Nothing useful runs on the CPU: its idle loop, or a blocked or dead task that had nowhere to
+// switch to and waits in hlt
+static int rq_idle(cpu_rq_t *rq) {
+    task_struct_t *cur = rq->current;
+    if (cur && cur == rq->idle && rq->idling) return 1;
+    return cur && (cur->idle || cur->state == TASK_BLOCKED || cur->state == TASK_ZOMBIE);
+}
+
+// Make CPU `cpu` run its scheduler soon: an idle CPU switches at once, a busy one starts its slice timer
+static void rq_kick(int cpu) {
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    int idle = rq_idle(rq);
+    if (!rq->slicing && !idle) return;
+    if (cpu == smp_cpu_id()) {
+        if (idle) {
+            // Called from an interrupt: the scheduler runs when the handler returns
+            this_cpu()->need_resched = 1;
+            return;
+        }
+        uint64_t flags = irq_save();
+        slice_update(rq, 0);
+        irq_restore(flags);
+        return;
+    }
+    lapic_send_ipi(smp_cpu_apic_id(cpu), LAPIC_RESCHED_VECTOR);
+}
+
+// Wake one idle CPU with empty queues so it can steal from `cpu`
+static void kick_idle_cpu(int cpu) {
+    for (int i = 1; i < SMP_MAX_CPUS; ++i) {
+        cpu_rq_t *rq = &cpu_rqs[i];
+        if (i == cpu || !rq->current || !rq->current->idle || rq->nr_queued) continue;
+        rq_kick(i);
+        return;
+    }
+}
+
+// Link a new task into the task list and make it runnable
+static void task_insert(task_struct_t *t) {
+    uint64_t flags = spin_lock_irqsave(&task_list_lock);
+    if (!task_list) {
+        task_list = t;
+        t->next = t;
+    } else {
+        t->next = task_list->next;
+        task_list->next = t;
+    }
+    spin_unlock_irqrestore(&task_list_lock, flags);
+    t->state = TASK_RUNNABLE;
+    int cpu = select_cpu(t);
+    flags = spin_lock_irqsave(&cpu_rqs[cpu].lock);
+    rq_enqueue(cpu, t);
+    int first = cpu_rqs[cpu].nr_queued == 1;
+    spin_unlock_irqrestore(&cpu_rqs[cpu].lock, flags);
+    // With more tasks already waiting the CPU has a slice timer running
+    if (first) rq_kick(cpu);
+}
+
+// Make a blocked task runnable again on the CPU it last ran on. Safe from interrupt context and
+// from any CPU; a task that is not blocked is left alone.
+static void task_wake(task_struct_t *t) {
+    uint64_t flags;
+    cpu_rq_t *rq = task_rq_lock(t, &flags);
+    if (t->state != TASK_BLOCKED) {
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+    if (rq->current == t) {
+        // It has not switched away yet, or had nowhere to switch to and waits in hlt: let it go on
+        t->state = TASK_RUNNING;
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+    t->state = TASK_RUNNABLE;
+    int cpu = t->cpu;
+    if (!t->pinned && !t->on_cpu) {
+        // Off every CPU and on no queue: it may as well start over on the least loaded one.
+        // Lockers of its old queue see t->cpu change and follow it.
+        int target = select_cpu(t);
+        if (target != cpu) {
+            t->cpu = target;
+            spin_unlock(&rq->lock);
+            cpu = target;
+            rq = &cpu_rqs[cpu];
+            spin_lock(&rq->lock);
+        }
+    }
+    rq_enqueue(cpu, t);
+    int kick = rq->nr_queued == 1 || rq_idle(rq);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    if (kick) rq_kick(cpu);
+}
+
+// Take a task off the busiest other CPU for `cpu`. Only tasks that may move and whose stack is
+// free qualify; the most favoured one wins. Runs from the timer tick, so a contended lock is
+// left for the next tick instead of spun on.
+static task_struct_t *steal_task(int cpu) {
+    int victim = -1;
+    for (int i = 0; i < SMP_MAX_CPUS; ++i) {
+        if (i == cpu || !cpu_rqs[i].nr_queued) continue;
+        if (victim < 0 || cpu_rqs[i].nr_queued > cpu_rqs[victim].nr_queued) victim = i;
+    }
+    if (victim < 0) return NULL;
+    cpu_rq_t *rq = &cpu_rqs[victim];
+    if (!spin_trylock(&rq->lock)) return NULL;
+    task_struct_t *t = NULL;
+    for (uint64_t levels = rq->bitmap; levels && !t; levels &= levels - 1) {
+        for (task_struct_t *c = rq->queues[__builtin_ctzll(levels)].head; c; c = c->run_next) {
+            if (!c->pinned && !c->on_cpu) {
+                t = c;
+                break;
+            }
+        }
+    }
+    if (t) {
+        rq_remove(t);
+        t->cpu = cpu;
+        cpu_rqs[cpu].steals++;
+    }
+    spin_unlock(&rq->lock);
+    return t;
+}
 
 // Registers layout: matches pushes in irq_common_stub before calling C handler
 // We will store rsp pointing to where the first pushed register (rax) is located.
 
 void scheduler_init(void) {
+    for (int i = 0; i < SMP_MAX_CPUS; ++i) {
+        spin_lock_init(&cpu_rqs[i].lock);
+        hrtimer_init(&cpu_rqs[i].slice, slice_expired, &cpu_rqs[i]);
+    }
+    // The BSP slices like the APs (scheduler_init_cpu), so the boot task, which polls the USB
+    // keyboard and runs its commands, gets the CPU back within a slice of any other task
+    cpu_rqs[0].slicing = hrtimer_ready();
     // Pre-allocate a current task structure to avoid malloc during interrupts
-    current = (task_struct_t *)kmalloc(sizeof(task_struct_t));
-    if (current) {
-        for (size_t i = 0; i < sizeof(task_struct_t); ++i) ((char*)current)[i] = 0;
-        current->type = TASK_KERNEL;
-        current->state = TASK_RUNNING;
-        current->next = current;  // Point to itself for now
-        
+    task_struct_t *boot = task_alloc();
+    if (boot) {
+        boot->type = TASK_KERNEL;
+        boot->state = TASK_RUNNING;
+        boot->next = boot;  // Point to itself for now
+        // The boot task runs the shell on the BSP and idles there when nothing else is runnable
+        boot->cpu = 0;
+        boot->pinned = 1;
+        boot->on_cpu = 1;
+        boot->cr3 = vmm_get_cr3() & VMM_CR3_ADDR_MASK;
+        cpu_rqs[0].current = boot;
+        this_cpu()->current = boot;
+        cpu_rqs[0].idle = boot;
+
         // Initialize task_list to current kernel task
-        task_list = current;
+        task_list = boot;
+    }
+    // The allocators take locks now, but the address-space list in mm.c and page-table teardown
+    // do not, so the reaper frees from the BSP, next to the code that creates address spaces
+    if (scheduler_add_task_on(reaper_thread, SCHED_NICE_DEFAULT, 0) != 0) {
+        tty_putstr("[SCHED] No reaper thread, dead tasks will leak\n");
     }
 }
 
-// helper to allocate a stack (one page)
-static void *alloc_stack(void) {
-    void *p = pmm_alloc_page();
-    if (!p) return NULL;
-    // Use top of page as initial stack pointer
-    return p;
+void scheduler_init_cpu(int cpu) {
+    if (cpu <= 0 || cpu >= SMP_MAX_CPUS) return;
+    task_struct_t *idle = task_alloc();
+    if (!idle) {
+        tty_putstr("[SCHED] No idle task for an AP\n");
+        return;
+    }
+    // The AP's boot context becomes its idle task; it is never queued, so it stays off the task list
+    idle->type = TASK_KERNEL;
+    idle->state = TASK_RUNNING;
+    idle->cpu = cpu;
+    idle->pinned = 1;
+    idle->idle = 1;
+    idle->on_cpu = 1;
+    idle->nice = SCHED_NICE_MAX;
+    idle->cr3 = vmm_get_cr3() & VMM_CR3_ADDR_MASK;
+    cpu_rqs[cpu].idle = idle;
+    cpu_rqs[cpu].slicing = hrtimer_ready();
+    this_cpu()->current = idle;
+    // Publishing `current` makes the CPU eligible for new tasks
+    __atomic_store_n(&cpu_rqs[cpu].current, idle, __ATOMIC_RELEASE);
 }
 
-int scheduler_add_task(void (*func)(void)) {
-    // allocate task struct from kmalloc (or simple static pool)
-    task_struct_t *t = (task_struct_t *)kmalloc(sizeof(task_struct_t));
+int scheduler_add_task_on(void (*func)(void), int nice, int cpu) {
+    task_struct_t *t = task_alloc();
     if (!t) {
         return -1;
     }
-    for (size_t i = 0; i < sizeof(task_struct_t); ++i) ((char*)t)[i] = 0;
-    void *stack = alloc_stack();
+    void *stack = kstack_alloc();
     if (!stack) {
-        tty_putstr("[SCHED] alloc_stack failed\n");
+        tty_putstr("[SCHED] kstack_alloc failed\n");
+        task_free(t);
         return -1;
     }
     t->stack_base = stack;
@@ -74,16 +417,17 @@ int scheduler_add_task(void (*func)(void)) {
 
     // Build initial stack so that when the IRQ return sequence runs (restores registers, cleans error+int, then iretq)
     // the iretq will pop RIP/CS/RFLAGS from the stack and start executing our thread wrapper.
-    uint64_t *stack_top = (uint64_t *)((char*)stack + 4096);
+    uint64_t *stack_top = (uint64_t *)((char*)stack + KSTACK_SIZE);
     // align
     stack_top = (uint64_t *)((uintptr_t)stack_top & ~0xF);
-    // We need space for: saved regs (15*8=120), error(8), int_no(8), RIP(8), CS(8), RFLAGS(8) = 160 bytes -> 20 uint64_t
-    stack_top -= 20;
+    // We need space for: saved regs (15*8=120), int_no(8), error(8), RIP, CS, RFLAGS, RSP, SS (5*8) = 176 bytes -> 22 uint64_t.
+    // iretq in long mode pops RSP and SS even without a privilege change.
+    stack_top -= 22;
     uint64_t *sp = stack_top;
     // zero saved registers
     for (int i = 0; i < 15; ++i) sp[i] = 0;
-    // place function pointer into rdi position (index 5) so wrapper can pick it up
-    sp[5] = (uint64_t)func; // rdi
+    // place function pointer into rdi position (index 9, r15 is popped first) so wrapper can pick it up
+    sp[9] = (uint64_t)func; // rdi
     // int_no and error code (match IRQ stub push order: push 0; push IRQ -> IRQ at lower address)
     sp[15] = 32; // int_no - we mark as timer so handler logic is consistent
     sp[16] = 0; // error code
@@ -92,28 +436,32 @@ int scheduler_add_task(void (*func)(void)) {
     sp[17] = (uint64_t)task_start_wrapper; // RIP
     sp[18] = 0x08; // kernel code segment
     sp[19] = 0x202; // RFLAGS with interrupts enabled
+    sp[20] = (uint64_t)((uintptr_t)((char*)stack + KSTACK_SIZE) & ~0xFULL); // RSP: the thread starts on an empty stack
+    sp[21] = 0x10;  // kernel data segment
 
     t->type = TASK_KERNEL;
     t->rsp = (uint64_t)sp;
     tty_putstr("[SCHED] task rsp=0x");
     tty_puthex64(t->rsp);
     tty_putstr("\n");
-    t->cr3 = vmm_get_cr3();
-    t->state = TASK_RUNNABLE;
-
-    // insert into circular list
-    if (!task_list) {
-        task_list = t;
-        t->next = t;
-    } else {
-        t->next = task_list->next;
-        task_list->next = t;
+    t->cr3 = vmm_get_cr3() & VMM_CR3_ADDR_MASK;
+    t->nice = clamp_nice(nice);
+    // Kernel threads have no parent and are reaped as soon as they return
+    t->parent = NULL;
+    if (cpu >= 0) {
+        t->cpu = cpu;
+        t->pinned = 1;
     }
+    task_insert(t);
 
     return 0;
 }
 
-int scheduler_create_user_process(void *entry_point, void *user_stack_top, uint64_t cr3) {
+int scheduler_add_task(void (*func)(void), int nice) {
+    return scheduler_add_task_on(func, nice, -1);
+}
+
+int scheduler_create_user_process(void *entry_point, void *user_stack_top, uint64_t cr3, int nice) {
     tty_putstr("[SCHED] Creating user process\n");
     tty_putstr("  Entry: ");
     tty_puthex64((uint64_t)entry_point);
@@ -124,18 +472,17 @@ int scheduler_create_user_process(void *entry_point, void *user_stack_top, uint6
     tty_putstr("\n");
 
     // Allocate task structure
-    task_struct_t *t = (task_struct_t *)kmalloc(sizeof(task_struct_t));
+    task_struct_t *t = task_alloc();
     if (!t) {
         tty_putstr("[SCHED] Task malloc failed\n");
         return -1;
     }
-    memset_k(t, 0, sizeof(task_struct_t));
 
     // Allocate kernel stack for this process
-    void *kstack = alloc_stack();
+    void *kstack = kstack_alloc();
     if (!kstack) {
         tty_putstr("[SCHED] Kernel stack alloc failed\n");
-        kfree(t);
+        task_free(t);
         return -1;
     }
     t->stack_base = kstack;
@@ -148,7 +495,7 @@ int scheduler_create_user_process(void *entry_point, void *user_stack_top, uint6
     //  r8(56), r9(64), r10(72), r11(80), r12(88), r13(96), r14(104), r15(112),
     //  error(120), int_no(128), RIP(136), CS(144), RFLAGS(152), RSP(160), SS(168)]
 
-    uint64_t *stack_ptr = (uint64_t *)((uintptr_t)kstack + 4096);
+    uint64_t *stack_ptr = (uint64_t *)((uintptr_t)kstack + KSTACK_SIZE);
     stack_ptr = (uint64_t *)((uintptr_t)stack_ptr & ~0xF);  // 16-byte align
     stack_ptr -= 22;  // Reserve space for 22 uint64_t values
 
@@ -172,35 +519,404 @@ int scheduler_create_user_process(void *entry_point, void *user_stack_top, uint6
     t->cr3 = cr3;
     t->user_rip = (uint64_t)entry_point;
     t->user_rsp = (uint64_t)user_stack_top;
-    t->state = TASK_RUNNABLE;
+    t->nice = clamp_nice(nice);
+    // A program started by a user process is its child; one started from the shell is reaped on exit
+    task_struct_t *cur = current_task();
+    t->parent = (cur && cur->type == TASK_USER) ? cur : NULL;
+    // Entry state is per CPU and the allocators are locked, but the address-space list, FAT32 and
+    // TLB shootdown are not ready for two CPUs at once: user processes stay on the BSP
+    t->cpu = 0;
+    t->pinned = 1;
+    task_insert(t);
 
-    // Add to task list
-    if (!task_list) {
-        task_list = t;
-        t->next = t;
-    } else {
-        t->next = task_list->next;
-        task_list->next = t;
+    tty_putstr("[SCHED] User process created\n");
+    return 0;
+}
+
+int scheduler_fork_user_process(const struct syscall_frame *frame, uint64_t cr3) {
+    task_struct_t *t = task_alloc();
+    if (!t) {
+        tty_putstr("[SCHED] Task malloc failed\n");
+        return -1;
+    }
+    void *kstack = kstack_alloc();
+    if (!kstack) {
+        tty_putstr("[SCHED] Kernel stack alloc failed\n");
+        task_free(t);
+        return -1;
+    }
+    t->stack_base = kstack;
+    task_struct_t *parent = current_task();
+    if (parent && fpu_fork(&t->fpu, &parent->fpu) != 0) {
+        tty_putstr("[SCHED] FPU state alloc failed\n");
+        kstack_free(kstack);
+        task_free(t);
+        return -1;
     }
 
-    tty_putstr("[SCHED] User process created\n");
+    // The child resumes after its parent's syscall instruction with the parent's registers and
+    // rax = 0. irq_common_stub pushed rax first, so the saved registers sit at the top of the
+    // frame in reverse: [r15(0) ... r8(56), rbp(64), rdi(72), rsi(80), rdx(88), rcx(96), rbx(104), rax(112),
+    //  int_no(120), error(128), RIP(136), CS(144), RFLAGS(152), RSP(160), SS(168)]
+    uint64_t *sp = (uint64_t *)(((uintptr_t)kstack + KSTACK_SIZE) & ~0xFULL);
+    sp -= 22;
+    sp[0] = frame->r15;
+    sp[1] = frame->r14;
+    sp[2] = frame->r13;
+    sp[3] = frame->r12;
+    sp[4] = frame->r11;
+    sp[5] = frame->r10;
+    sp[6] = frame->r9;
+    sp[7] = frame->r8;
+    sp[8] = frame->rbp;
+    sp[9] = frame->rdi;
+    sp[10] = frame->rsi;
+    sp[11] = frame->rdx;
+    sp[12] = frame->rcx;
+    sp[13] = frame->rbx;
+    sp[14] = 0;                 // fork() returns 0 in the child
+    sp[15] = 32;
+    sp[16] = 0;
+    sp[17] = frame->rip;
+    sp[18] = 0x23;              // user code, RPL 3
+    sp[19] = frame->rflags | 0x200;
+    sp[20] = frame->rsp;
+    sp[21] = 0x1B;              // user data, RPL 3
+
+    t->type = TASK_USER;
+    t->rsp = (uint64_t)sp;
+    t->cr3 = cr3 & VMM_CR3_ADDR_MASK;
+    t->user_rip = frame->rip;
+    t->user_rsp = frame->rsp;
+    t->nice = parent ? parent->nice : 0;   // the child inherits its parent's priority
+    t->parent = parent;
+    t->cpu = 0;
+    t->pinned = 1;
+    task_insert(t);
+    return t->pid;
+}
+
+int scheduler_current_pid(void) {
+    task_struct_t *cur = current_task();
+    return cur ? cur->pid : 0;
+}
+
+int scheduler_set_nice(int pid, int nice) {
+    uint64_t flags = spin_lock_irqsave(&task_list_lock);
+    task_struct_t *t = task_list;
+    if (t) {
+        do {
+            if (t->pid == pid) break;
+            t = t->next;
+        } while (t != task_list);
+        if (t->pid != pid) t = NULL;
+    }
+    spin_unlock_irqrestore(&task_list_lock, flags);
+    if (!t) return -1;
+    // A queued task moves to the tail of its new level
+    cpu_rq_t *rq = task_rq_lock(t, &flags);
+    int queued = t->on_rq;
+    rq_remove(t);
+    t->nice = clamp_nice(nice);
+    if (queued) rq_enqueue(t->cpu, t);
+    spin_unlock_irqrestore(&rq->lock, flags);
     return 0;
 }
 
-// Minimal trampoline placed in C; will call the passed function then loop
-static __attribute__((noreturn)) void task_trampoline_c(void (*func)(void)) {
-    // call the function
+int scheduler_cpu_info(int cpu, sched_cpu_info_t *out) {
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS || !out || !cpu_rqs[cpu].current) return -1;
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    out->queued = rq->nr_queued;
+    out->running_pid = rq->current->idle ? 0 : rq->current->pid;
+    out->switches = rq->switches;
+    out->steals = rq->steals;
+    out->preemptions = rq->preemptions;
+    out->deferred = rq->deferred;
+    return 0;
+}
+
+void scheduler_yield(void) {
+    __asm__ volatile ("int %0" :: "i"(SCHED_YIELD_VECTOR) : "memory");
+}
+
+void preempt_schedule(void) {
+    // Unlike a yield, this never puts a task that marked itself blocked to sleep
+    if (current_task()) __asm__ volatile ("int %0" :: "i"(SCHED_PREEMPT_VECTOR) : "memory");
+}
+
+void scheduler_idle(void) {
+    cpu_rq_t *rq = this_rq();
+    uint64_t flags = irq_save();
+    if (rq->nr_queued) {
+        irq_restore(flags);
+        scheduler_yield();
+        return;
+    }
+    // A wake-up now finds the CPU idle and switches at once; sti takes effect after hlt starts
+    rq->idling = 1;
+    __asm__ volatile ("sti; hlt; cli" ::: "memory");
+    rq->idling = 0;
+    irq_restore(flags);
+}
+
+static void wait_timeout(hrtimer_t *timer) {
+    task_wake((task_struct_t *)timer->data);
+}
+
+// Queue the calling task on `wq` (once) and mark it blocked. The wake-up side takes the same
+// lock, so it either sees the task blocked or happened before it was queued.
+static void wait_prepare(wait_queue_t *wq, wait_entry_t *w) {
+    uint64_t flags = 0;
+    if (wq) flags = spin_lock_irqsave(&wq->lock);
+    else flags = irq_save();
+    if (wq && !w->queued) {
+        w->next = wq->head;
+        wq->head = w;
+        w->queued = 1;
+    }
+    w->task->state = TASK_BLOCKED;
+    if (wq) spin_unlock_irqrestore(&wq->lock, flags);
+    else irq_restore(flags);
+}
+
+static void wait_finish(wait_queue_t *wq, wait_entry_t *w) {
+    uint64_t flags = 0;
+    if (wq) flags = spin_lock_irqsave(&wq->lock);
+    else flags = irq_save();
+    if (wq && w->queued) {
+        for (wait_entry_t **pp = &wq->head; *pp; pp = &(*pp)->next) {
+            if (*pp == w) {
+                *pp = w->next;
+                break;
+            }
+        }
+        w->queued = 0;
+    }
+    w->task->state = TASK_RUNNING;
+    if (wq) spin_unlock_irqrestore(&wq->lock, flags);
+    else irq_restore(flags);
+}
+
+static uint64_t ns_to_tsc(uint64_t ns) {
+    uint64_t khz = tsc_khz();
+    return ns / 1000000 * khz + ns % 1000000 * khz / 1000000;
+}
+
+int wait_event_timeout(wait_queue_t *wq, int (*cond)(void *arg), void *arg, uint64_t timeout_ns) {
+    uint64_t deadline = timeout_ns ? rdtsc() + ns_to_tsc(timeout_ns) : 0;
+    task_struct_t *cur = current_task();
+    if (!cur || !hrtimer_ready()) {
+        // No scheduler or clock event on this CPU yet: poll
+        while (!(cond && cond(arg))) {
+            if (deadline && rdtsc() >= deadline) return 0;
+            __asm__ volatile ("pause");
+        }
+        return 1;
+    }
+
+    wait_entry_t w = { NULL, cur, 0 };
+    int done = 0;
+    hrtimer_init(&cur->timer, wait_timeout, cur);
+    for (;;) {
+        wait_prepare(wq, &w);
+        if (cond && cond(arg)) {
+            done = 1;
+            break;
+        }
+        if (deadline && rdtsc() >= deadline) break;
+        if (deadline) hrtimer_start(&cur->timer, deadline);
+        scheduler_yield();
+        // Still blocked: there was nothing to switch to. Sleep until an interrupt; sti only takes
+        // effect after the next instruction, so a wake-up can't slip in between the check and hlt.
+        uint64_t flags = irq_save();
+        if (cur->state == TASK_BLOCKED) __asm__ volatile ("sti; hlt; cli" ::: "memory");
+        irq_restore(flags);
+    }
+    hrtimer_cancel(&cur->timer);
+    wait_finish(wq, &w);
+    return done;
+}
+
+int wake_up_all(wait_queue_t *wq) {
+    int woken = 0;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    while (wq->head) {
+        wait_entry_t *w = wq->head;
+        wq->head = w->next;
+        w->next = NULL;
+        w->queued = 0;
+        // The entry stays valid until its task takes the lock in wait_finish
+        task_wake(w->task);
+        woken++;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
+
+void scheduler_sleep_ns(uint64_t ns) {
+    if (!ns) {
+        scheduler_yield();
+        return;
+    }
+    wait_event_timeout(NULL, NULL, NULL, ns);
+}
+
+// Hand a dead task to the reaper. Its stack may still be in use; the reaper waits for on_cpu to clear.
+static void reap_queue(task_struct_t *t) {
+    uint64_t flags = spin_lock_irqsave(&reap_lock);
+    t->reap_next = reap_list;
+    reap_list = t;
+    spin_unlock_irqrestore(&reap_lock, flags);
+    wake_up_all(&reap_wait);
+}
+
+// Something on the reap list is off the CPU for good
+static int reap_ready(void *arg) {
+    (void)arg;
+    uint64_t flags = spin_lock_irqsave(&reap_lock);
+    task_struct_t *t = reap_list;
+    while (t && __atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE)) t = t->reap_next;
+    spin_unlock_irqrestore(&reap_lock, flags);
+    return t != NULL;
+}
+
+// Caller holds task_list_lock
+static void task_list_remove(task_struct_t *t) {
+    task_struct_t *p = task_list;
+    if (!p) return;
+    while (p->next != t) {
+        p = p->next;
+        if (p == task_list) return;
+    }
+    p->next = t->next;
+    if (task_list == t) task_list = (t->next == t) ? NULL : t->next;
+}
+
+// Free what a dead task owns: its address space, kernel stack and task struct
+static void task_destroy(task_struct_t *t) {
+    uint64_t flags = spin_lock_irqsave(&task_list_lock);
+    task_list_remove(t);
+    spin_unlock_irqrestore(&task_list_lock, flags);
+    if (t->type == TASK_USER) {
+        uint64_t cr3 = t->cr3 & VMM_CR3_ADDR_MASK;
+        mm_destroy(mm_find(cr3));
+        vmm_destroy_table(cr3);
+    }
+    if (t->stack_base) kstack_free(t->stack_base);
+    fpu_release(&t->fpu);
+    task_free(t);
+}
+
+// Frees dead tasks in task context, never on the stack of the task being freed
+static void reaper_thread(void) {
+    for (;;) {
+        wait_event_timeout(&reap_wait, reap_ready, NULL, 0);
+        uint64_t flags = spin_lock_irqsave(&reap_lock);
+        task_struct_t *dead = NULL;
+        for (task_struct_t **pp = &reap_list; *pp;) {
+            task_struct_t *t = *pp;
+            if (__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE)) {
+                pp = &t->reap_next;
+                continue;
+            }
+            *pp = t->reap_next;
+            t->reap_next = dead;
+            dead = t;
+        }
+        spin_unlock_irqrestore(&reap_lock, flags);
+        while (dead) {
+            task_struct_t *t = dead;
+            dead = t->reap_next;
+            task_destroy(t);
+            reaped_count++;
+        }
+    }
+}
+
+void scheduler_exit(int status) {
+    task_struct_t *cur = current_task();
+    if (!cur || cur->idle || cur == cpu_rqs[0].idle) {
+        tty_putstr("[SCHED] The boot task cannot exit\n");
+        return;
+    }
+    // Interrupts stay off until the task is gone, so it is never switched out half dead
+    __asm__ volatile ("cli" ::: "memory");
+    spin_lock(&task_list_lock);
+    task_struct_t *t = task_list;
+    do {
+        if (t->parent == cur) {
+            // Orphans have nobody to collect them: dead ones go to the reaper now, the others
+            // when they exit
+            t->parent = NULL;
+            if (t->state == TASK_ZOMBIE) reap_queue(t);
+        }
+        t = t->next;
+    } while (t != task_list);
+    cur->exit_status = status;
+    cur->autoreap = cur->parent == NULL;
+    cur->state = TASK_ZOMBIE;
+    if (cur->parent) wake_up_all(&cur->parent->child_exit);
+    spin_unlock(&task_list_lock);
+    for (;;) {
+        scheduler_yield();
+        // Nothing else could run yet: wait for something to become runnable
+        __asm__ volatile ("sti; hlt; cli" ::: "memory");
+    }
+}
+
+typedef struct {
+    task_struct_t *self;
+    task_struct_t *zombie;      // the collected child
+    int children;
+} child_wait_t;
+
+// Look for a dead child of w->self and take it. Done once one is found or there is no child left.
+static int child_exited(void *arg) {
+    child_wait_t *w = (child_wait_t *)arg;
+    uint64_t flags = spin_lock_irqsave(&task_list_lock);
+    w->children = 0;
+    task_struct_t *t = task_list;
+    do {
+        if (t->parent == w->self) {
+            w->children++;
+            if (t->state == TASK_ZOMBIE && !w->zombie) {
+                // Collected: it is nobody's child any more
+                t->parent = NULL;
+                w->zombie = t;
+            }
+        }
+        t = t->next;
+    } while (t != task_list);
+    spin_unlock_irqrestore(&task_list_lock, flags);
+    return w->zombie != NULL || w->children == 0;
+}
+
+int scheduler_wait(int *status) {
+    task_struct_t *cur = current_task();
+    if (!cur) return -1;
+    child_wait_t w = { cur, NULL, 0 };
+    wait_event_timeout(&cur->child_exit, child_exited, &w, 0);
+    if (!w.zombie) return -1;
+    int pid = w.zombie->pid;
+    if (status) *status = w.zombie->exit_status;
+    reap_queue(w.zombie);
+    return pid;
+}
+
+uint64_t scheduler_reaped(void) {
+    return reaped_count;
+}
+
+// Entry of every kernel thread (called by task_start_wrapper): a thread that returns exits
+__attribute__((noreturn)) void task_trampoline_c(void (*func)(void)) {
     func();
-    // if it returns, set state to zombie and halt
-    current->state = TASK_ZOMBIE;
-    while (1) __asm__ volatile ("hlt");
+    scheduler_exit(0);
+    // Only the boot task gets here, and it never runs through the trampoline
+    for (;;) __asm__ volatile ("hlt");
 }
 
 // The low-level entry `task_start_wrapper` is implemented in assembly in task_trampoline.S
 
-// Forward declare global for next CR3 to be consumed by IRQ stub
-uint64_t sched_next_cr3 = 0;
-
 // scheduler_switch: called with 'regs' pointing to saved registers area (rsp). Return pointer to regs for next task
 void *scheduler_switch(void *regs) {
     // Determine IRQ number from saved stack: irq_common_stub passed irq number then regs; but we always call scheduler on every IRQ
@@ -212,54 +928,127 @@ void *scheduler_switch(void *regs) {
         irq_no = *(uint64_t *)((char*)regs + 120);
     }
 
-    // Only perform time-slice on timer IRQ (32)
-    if (irq_no != 32) {
+    int cpu = smp_cpu_id();
+    cpu_rq_t *rq = &cpu_rqs[cpu];
+    percpu_t *pc = this_cpu();
+    // Switch when the slice timer ran out, another CPU asked for it or the task gave up the CPU;
+    // other IRQs return to the interrupted task
+    int yield = irq_no == SCHED_YIELD_VECTOR;
+    if (!yield && irq_no != LAPIC_RESCHED_VECTOR && irq_no != SCHED_PREEMPT_VECTOR && !pc->need_resched) {
         // return same regs
         return regs;
     }
-
-    // If no tasks, return same regs
-    if (!task_list) return regs;
-
-    // Save current task context: if current is NULL, skip (should not happen now)
-    if (!current) {
-        tty_putstr("[SCHED] ERROR: current is NULL in scheduler_switch\n");
+    // A task holding a lock is not preempted; the preempt_enable releasing it makes the switch
+    if (!yield && pc->preempt_count) {
+        if (!pc->need_resched) rq->deferred++;
+        pc->need_resched = 1;
         return regs;
     }
-    
-    // Save regs into current->rsp
-    current->rsp = (uint64_t)regs;
-    current->cr3 = vmm_get_cr3();
-    current->state = TASK_RUNNABLE;
+    pc->need_resched = 0;
 
-    // Select next runnable task
-    task_struct_t *t = current->next ? current->next : task_list;
-    size_t scanned = 0;
-    while (scanned <  (1<<20)) { // prevent infinite loops
-        if (t->state == TASK_RUNNABLE || t->state == TASK_RUNNING) break;
-        t = t->next; scanned++;
+    // A CPU that has not set up its scheduler yet keeps running what it runs
+    task_struct_t *prev = rq->current;
+    if (!prev) return regs;
+
+    // Save regs into the outgoing task
+    prev->rsp = (uint64_t)regs;
+    prev->cr3 = vmm_get_cr3() & VMM_CR3_ADDR_MASK;
+    spin_lock(&rq->lock);
+    // A task that is still running goes to the back of its level; blocked and zombie tasks stay off
+    // the run queues until something makes them runnable again. Only a task's own yield puts it to
+    // sleep: one preempted between marking itself blocked and yielding is still runnable.
+    if (!prev->idle && (prev->state == TASK_RUNNING || (prev->state == TASK_BLOCKED && !yield))) {
+        prev->state = TASK_RUNNABLE;
+        rq_enqueue(cpu, prev);
+    }
+    task_struct_t *t = rq_pick(rq);
+    int kick = t && rq->nr_queued;
+    if (!t) {
+        spin_unlock(&rq->lock);
+        t = steal_task(cpu);
+        spin_lock(&rq->lock);
+        // prev may have been woken while the lock was dropped
+        if (prev->state == TASK_RUNNING && !prev->idle) {
+            if (t) {
+                prev->state = TASK_RUNNABLE;
+                rq_enqueue(cpu, prev);
+            } else {
+                t = prev;
+            }
+        }
+    }
+    if (!t) {
+        // Nothing runnable: fall back to the CPU's idle task. Without one that can run, prev keeps
+        // the CPU; if it is blocked it waits for its wake-up in hlt (wait_event_timeout).
+        t = rq->idle;
+        if (!t || t->state == TASK_BLOCKED || t->state == TASK_ZOMBIE) {
+            spin_unlock(&rq->lock);
+            return regs;
+        }
     }
-    if (!t) return regs;
+    t->state = TASK_RUNNING;
+    // Wake-ups decide between queuing a task and letting it run on by looking at `current`,
+    // so it changes under the lock
+    rq->current = t;
+    this_cpu()->current = t;
+    spin_unlock(&rq->lock);
+    // Tasks left waiting here could run on an idle CPU instead
+    if (kick) kick_idle_cpu(cpu);
+    slice_update(rq, 1);
+    if (t == prev) return regs;
+
+    rq->switches++;
+    if (prev->state == TASK_RUNNABLE && !yield) rq->preemptions++;
+    // prev's stack stays in use until the IRQ stub has switched away from it (scheduler_finish_switch)
+    rq->prev = prev;
+    t->on_cpu = 1;
+    // The preempt count and the syscall frame belong to the task, not the CPU
+    prev->preempt_count = pc->preempt_count;
+    prev->syscall_frame = pc->syscall_frame;
+    pc->preempt_count = t->preempt_count;
+    pc->syscall_frame = t->syscall_frame;
+    // prev's vector state is saved before any other CPU can pick prev up
+    fpu_switch(&prev->fpu, &t->fpu);
 
-    // Prepare new CR3 in global variable so assembly stub can load it at the right moment
-    extern uint64_t sched_next_cr3;
-    sched_next_cr3 = t->cr3;
+    // The kernel is mapped in every table, so the new address space can be loaded right here.
+    // Staying in the same address space needs no reload; otherwise a PCID-tagged CR3 keeps the
+    // TLB entries of a recently run process.
+    if ((t->cr3 & VMM_CR3_ADDR_MASK) != prev->cr3) {
+        if (t->type == TASK_USER) vmm_set_cr3(vmm_pcid_cr3(t->cr3, &t->pcid, &t->pcid_gen));
+        else vmm_set_cr3(vmm_pcid_cr3(t->cr3, NULL, NULL));
+    }
 
     // For user processes, set TSS RSP0 to the kernel stack
     if (t->type == TASK_USER) {
-        uint64_t kernel_stack_top = (uint64_t)t->stack_base + 4096;
+        uint64_t kernel_stack_top = (uint64_t)t->stack_base + KSTACK_SIZE;
         
         tss_set_stack(kernel_stack_top);
         
-        // CRITICAL: Update the variable used by syscall_entry.S
-        temp_kernel_rsp = kernel_stack_top;
+        // CRITICAL: Update the stack syscall_entry.S switches to on this CPU
+        this_cpu()->kernel_rsp = kernel_stack_top;
         
         // Set segment registers for user mode
-        // DS/ES/FS/GS should be USER DATA (0x1B), not user code (0x23)
-        __asm__ volatile("mov $0x1B, %%ax; mov %%ax, %%ds; mov %%ax, %%es; mov %%ax, %%fs; mov %%ax, %%gs" : : : "ax", "memory");
+        // DS/ES/FS should be USER DATA (0x1B), not user code (0x23). GS is left alone: loading
+        // it would clear the per-CPU base, and the return to user mode swaps in the user one.
+        __asm__ volatile("mov $0x1B, %%ax; mov %%ax, %%ds; mov %%ax, %%es; mov %%ax, %%fs" : : : "ax", "memory");
     }
 
-    t->state = TASK_RUNNING;
-    current = t;
     return (void *)t->rsp;
 }
+
+void scheduler_fpu_trap(void) {
+    task_struct_t *cur = current_task();
+    fpu_trap(cur ? &cur->fpu : NULL);
+}
+
+void scheduler_finish_switch(void) {
+    cpu_rq_t *rq = this_rq();
+    task_struct_t *prev = rq->prev;
+    if (!prev) return;
+    rq->prev = NULL;
+    // Once on_cpu clears the reaper may free a dead task, so look at it first
+    int dead = prev->state == TASK_ZOMBIE;
+    if (dead && prev->autoreap) reap_queue(prev);
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    if (dead) wake_up_all(&reap_wait);
+}
@@ -0,0 +1,255 @@
+// Latency microbenchmarks behind the `bench` command. Every sample is the TSC delta around one
+// operation, taken as close to it as possible: user-mode loops read the TSC themselves, so the
+// syscall and switch numbers include no kernel-side bookkeeping of the benchmark.
+#include <kernel/sys/bench.h>
+#include <kernel/sys/scheduler.h>
+#include <kernel/sys/hrtimer.h>
+#include <kernel/sys/string.h>
+#include <kernel/sys/spinlock.h>
+#include <kernel/arch/x86_64/apic.h>
+#include <kernel/arch/x86_64/mm.h>
+#include <kernel/arch/x86_64/pmm.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <kernel/arch/x86_64/vmm.h>
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+
+// Layout of a benchmark process: shared code and data pages, then a private page of samples
+#define BENCH_CODE_VA    VMM_USER_BASE
+#define BENCH_DATA_VA    (VMM_USER_BASE + PAGE_SIZE)
+#define BENCH_SAMPLES_VA (VMM_USER_BASE + 2 * PAGE_SIZE)
+// Each process fills its samples page once
+#define BENCH_USER_SAMPLES (PAGE_SIZE / sizeof(uint64_t))
+
+// Offsets in the data page
+#define BENCH_DATA_STAMP 0
+#define BENCH_DATA_DONE  1
+
+#define BENCH_POLL_NS    1000000ULL
+#define BENCH_TIMEOUT_NS 2000000000ULL
+
+// r12 = samples, r13 = BENCH_USER_SAMPLES; each iteration stores the cycles of one getpid.
+// Then lock inc [BENCH_DATA_VA + 8] and exit(0).
+static const uint8_t syscall_loop[] = {
+    0x49, 0xc7, 0xc4, 0x00, 0x20, 0x40, 0x00,   // mov r12, BENCH_SAMPLES_VA
+    0x41, 0xbd, 0x00, 0x02, 0x00, 0x00,         // mov r13d, 512
+    0x0f, 0x31,                                 // 1: rdtsc
+    0x48, 0xc1, 0xe2, 0x20,                     // shl rdx, 32
+    0x48, 0x09, 0xc2,                           // or rdx, rax
+    0x49, 0x89, 0xd6,                           // mov r14, rdx
+    0xb8, 0x27, 0x00, 0x00, 0x00,               // mov eax, SYS_GETPID
+    0x0f, 0x05,                                 // syscall
+    0x0f, 0x31,                                 // rdtsc
+    0x48, 0xc1, 0xe2, 0x20,                     // shl rdx, 32
+    0x48, 0x09, 0xc2,                           // or rdx, rax
+    0x4c, 0x29, 0xf2,                           // sub rdx, r14
+    0x49, 0x89, 0x14, 0x24,                     // mov [r12], rdx
+    0x49, 0x83, 0xc4, 0x08,                     // add r12, 8
+    0x41, 0xff, 0xcd,                           // dec r13d
+    0x75, 0xd4,                                 // jnz 1b
+    0x49, 0xc7, 0xc7, 0x00, 0x10, 0x40, 0x00,   // mov r15, BENCH_DATA_VA
+    0xf0, 0x49, 0xff, 0x47, 0x08,               // lock inc qword [r15 + 8]
+    0xb8, 0x3c, 0x00, 0x00, 0x00,               // mov eax, SYS_EXIT
+    0x31, 0xff,                                 // xor edi, edi
+    0x0f, 0x05,                                 // syscall
+    0xeb, 0xfe,                                 // jmp .
+};
+
+// Same frame for two processes yielding to each other: each stamps [BENCH_DATA_VA] before
+// sched_yield and stores the time since the other one's stamp when it runs again.
+static const uint8_t yield_loop[] = {
+    0x49, 0xc7, 0xc4, 0x00, 0x20, 0x40, 0x00,   // mov r12, BENCH_SAMPLES_VA
+    0x41, 0xbd, 0x00, 0x02, 0x00, 0x00,         // mov r13d, 512
+    0x49, 0xc7, 0xc7, 0x00, 0x10, 0x40, 0x00,   // mov r15, BENCH_DATA_VA
+    0x0f, 0x31,                                 // 1: rdtsc
+    0x48, 0xc1, 0xe2, 0x20,                     // shl rdx, 32
+    0x48, 0x09, 0xc2,                           // or rdx, rax
+    0x49, 0x89, 0x17,                           // mov [r15], rdx
+    0xb8, 0x18, 0x00, 0x00, 0x00,               // mov eax, SYS_SCHED_YIELD
+    0x0f, 0x05,                                 // syscall
+    0x0f, 0x31,                                 // rdtsc
+    0x48, 0xc1, 0xe2, 0x20,                     // shl rdx, 32
+    0x48, 0x09, 0xc2,                           // or rdx, rax
+    0x49, 0x2b, 0x17,                           // sub rdx, [r15]
+    0x49, 0x89, 0x14, 0x24,                     // mov [r12], rdx
+    0x49, 0x83, 0xc4, 0x08,                     // add r12, 8
+    0x41, 0xff, 0xcd,                           // dec r13d
+    0x75, 0xd4,                                 // jnz 1b
+    0xf0, 0x49, 0xff, 0x47, 0x08,               // lock inc qword [r15 + 8]
+    0xb8, 0x3c, 0x00, 0x00, 0x00,               // mov eax, SYS_EXIT
+    0x31, 0xff,                                 // xor edi, edi
+    0x0f, 0x05,                                 // syscall
+    0xeb, 0xfe,                                 // jmp .
+};
+
+// Sleep until `*done` reaches `want`. Returns 0, or -1 on timeout.
+static int bench_wait(volatile uint64_t *done, uint64_t want) {
+    for (uint64_t waited = 0; waited < BENCH_TIMEOUT_NS; waited += BENCH_POLL_NS) {
+        if (__atomic_load_n(done, __ATOMIC_ACQUIRE) >= want) return 0;
+        scheduler_sleep_ns(BENCH_POLL_NS);
+    }
+    return __atomic_load_n(done, __ATOMIC_ACQUIRE) >= want ? 0 : -1;
+}
+
+int bench_rdtsc(uint64_t *samples, uint32_t max) {
+    for (uint32_t i = 0; i < max; ++i) {
+        uint64_t t0 = rdtsc();
+        samples[i] = rdtsc() - t0;
+    }
+    return (int)max;
+}
+
+// Map the benchmark frames into a new address space, each mapping owning a reference so the
+// reaper's vmm_destroy_table leaves our own. Returns the CR3, or 0 on failure.
+static uint64_t bench_space(uint8_t *code, uint8_t *data, uint8_t *samples) {
+    uint64_t cr3 = vmm_clone_table(vmm_get_cr3());
+    if (!cr3) return 0;
+    uint64_t va[3] = {BENCH_CODE_VA, BENCH_DATA_VA, BENCH_SAMPLES_VA};
+    uint8_t *frame[3] = {code, data, samples};
+    uint64_t flags[3] = {
+        VMM_PFLAG_PRESENT | VMM_PFLAG_USER,
+        VMM_PFLAG_PRESENT | VMM_PFLAG_USER | VMM_PFLAG_WRITE,
+        VMM_PFLAG_PRESENT | VMM_PFLAG_USER | VMM_PFLAG_WRITE,
+    };
+    for (int i = 0; i < 3; ++i) {
+        if (pmm_page_ref(frame[i]) != 0) {
+            vmm_destroy_table(cr3);
+            return 0;
+        }
+        if (vmm_map_page_in_table(cr3, va[i], (uint64_t)(uintptr_t)frame[i], flags[i]) != 0) {
+            pmm_free_page(frame[i]);
+            vmm_destroy_table(cr3);
+            return 0;
+        }
+    }
+    return cr3;
+}
+
+// Run `procs` copies of `blob` on CPU 0 and gather their samples
+static int bench_user(const uint8_t *blob, uint32_t len, int procs, uint64_t *samples, uint32_t max) {
+    if (!hrtimer_ready() || smp_cpu_id() != 0) return -1;
+    uint8_t *code = (uint8_t *)pmm_alloc_page();
+    uint8_t *data = (uint8_t *)pmm_alloc_page();
+    uint8_t *pages[2] = {NULL, NULL};
+    for (int i = 0; i < procs; ++i) pages[i] = (uint8_t *)pmm_alloc_page();
+    int ok = code && data && pages[0] && (procs < 2 || pages[1]);
+    int started = 0;
+    if (ok) {
+        memset_k(code, 0, PAGE_SIZE);
+        memset_k(data, 0, PAGE_SIZE);
+        for (uint32_t i = 0; i < len; ++i) code[i] = blob[i];
+        for (int i = 0; i < procs; ++i) {
+            uint64_t cr3 = bench_space(code, data, pages[i]);
+            if (!cr3) break;
+            if (scheduler_create_user_process((void *)BENCH_CODE_VA, (void *)(BENCH_SAMPLES_VA + PAGE_SIZE),
+                                              cr3, SCHED_NICE_DEFAULT) != 0) {
+                vmm_destroy_table(cr3);
+                break;
+            }
+            started++;
+        }
+    }
+
+    int count = -1;
+    if (started > 0 && bench_wait(&((volatile uint64_t *)data)[BENCH_DATA_DONE], (uint64_t)started) != 0) {
+        // The processes still use the frames: leave our references behind
+        return -1;
+    }
+    if (ok && started == procs) {
+        count = 0;
+        for (int i = 0; i < procs; ++i) {
+            const uint64_t *s = (const uint64_t *)pages[i];
+            for (uint32_t j = 0; j < BENCH_USER_SAMPLES && (uint32_t)count < max; ++j) samples[count++] = s[j];
+        }
+    }
+    if (code) pmm_free_page(code);
+    if (data) pmm_free_page(data);
+    for (int i = 0; i < procs; ++i) {
+        if (pages[i]) pmm_free_page(pages[i]);
+    }
+    return count;
+}
+
+int bench_null_syscall(uint64_t *samples, uint32_t max) {
+    return bench_user(syscall_loop, sizeof(syscall_loop), 1, samples, max);
+}
+
+int bench_user_switch(uint64_t *samples, uint32_t max) {
+    return bench_user(yield_loop, sizeof(yield_loop), 2, samples, max);
+}
+
+// Kernel ping-pong state; the threads only run on CPU 0, one at a time
+static volatile uint64_t kswitch_stamp;
+static volatile uint64_t kswitch_done = 2;
+static uint64_t kswitch_samples[BENCH_MAX_SAMPLES];
+static uint32_t kswitch_count;
+
+static void kswitch_thread(void) {
+    for (uint32_t i = 0; i < BENCH_MAX_SAMPLES / 2; ++i) {
+        kswitch_stamp = rdtsc();
+        scheduler_yield();
+        uint64_t delta = rdtsc() - kswitch_stamp;
+        if (kswitch_count < BENCH_MAX_SAMPLES) kswitch_samples[kswitch_count++] = delta;
+    }
+    __atomic_fetch_add(&kswitch_done, 1, __ATOMIC_RELEASE);
+}
+
+int bench_kernel_switch(uint64_t *samples, uint32_t max) {
+    if (!hrtimer_ready() || smp_cpu_id() != 0) return -1;
+    // A run that timed out may still be going
+    if (__atomic_load_n(&kswitch_done, __ATOMIC_ACQUIRE) < 2) return -1;
+    kswitch_count = 0;
+    kswitch_done = 0;
+    int started = 0;
+    for (int i = 0; i < 2; ++i) {
+        if (scheduler_add_task_on(kswitch_thread, SCHED_NICE_DEFAULT, 0) == 0) started++;
+    }
+    // A missing thread counts as finished
+    __atomic_fetch_add(&kswitch_done, (uint64_t)(2 - started), __ATOMIC_RELEASE);
+    if (bench_wait(&kswitch_done, 2) != 0 || started < 2) return -1;
+    uint32_t count = kswitch_count < max ? kswitch_count : max;
+    for (uint32_t i = 0; i < count; ++i) samples[i] = kswitch_samples[i];
+    return (int)count;
+}
+
+int bench_irq(uint64_t *samples, uint32_t max) {
+    uint64_t flags = irq_save();
+    for (uint32_t i = 0; i < max; ++i) {
+        uint64_t t0 = rdtsc();
+        __asm__ volatile ("int %0" :: "i"(LAPIC_SPURIOUS_VECTOR) : "memory");
+        samples[i] = rdtsc() - t0;
+    }
+    irq_restore(flags);
+    return (int)max;
+}
+
+int bench_page_fault(uint64_t *samples, uint32_t max) {
+    uint64_t cr3 = vmm_clone_table(vmm_get_cr3());
+    if (!cr3) return -1;
+    mm_t *mm = mm_create(cr3);
+    if (!mm || mm_add_region(mm, VMM_USER_HIGH_BASE, VMM_USER_HIGH_BASE + (uint64_t)max * PAGE_SIZE,
+                             VMM_PFLAG_PRESENT | VMM_PFLAG_USER | VMM_PFLAG_WRITE, NULL, 0, 0, 0) != 0) {
+        if (mm) mm_destroy(mm);
+        vmm_destroy_table(cr3);
+        return -1;
+    }
+
+    // Nothing may switch tasks while the benchmark's table is loaded
+    uint64_t flags = irq_save();
+    uint64_t saved = vmm_get_cr3();
+    vmm_set_cr3(cr3);
+    for (uint32_t i = 0; i < max; ++i) {
+        volatile uint64_t *page = (volatile uint64_t *)(uintptr_t)(VMM_USER_HIGH_BASE + (uint64_t)i * PAGE_SIZE);
+        uint64_t t0 = rdtsc();
+        *page = i;
+        samples[i] = rdtsc() - t0;
+    }
+    vmm_set_cr3(saved);
+    irq_restore(flags);
+
+    mm_destroy(mm);
+    vmm_destroy_table(cr3);
+    return (int)max;
+}
@@ -0,0 +1,151 @@
+// High-resolution timers. Each CPU keeps its pending timers sorted by deadline and programs its
+// APIC timer for the earliest one only, so a CPU with nothing pending takes no timer interrupts.
+#include <kernel/sys/hrtimer.h>
+#include <kernel/sys/spinlock.h>
+#include <kernel/arch/x86_64/apic.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <stddef.h>
+
+typedef struct {
+    spinlock_t lock;
+    hrtimer_t *head;        // sorted by expires, earliest first
+    uint64_t armed;         // deadline the hardware holds, 0 if stopped
+    hrtimer_t *running;     // timer whose callback runs right now, with the lock dropped
+    int ready;
+    hrtimer_stats_t stats;
+} hrtimer_base_t;
+
+static hrtimer_base_t bases[SMP_MAX_CPUS];
+
+void hrtimer_cpu_init(void) {
+    hrtimer_base_t *b = &bases[smp_cpu_id()];
+    if (!lapic_present() || !tsc_khz() || (!lapic_timer_khz() && !lapic_timer_tsc_deadline())) return;
+    spin_lock_init(&b->lock);
+    lapic_timer_init();
+    b->ready = 1;
+}
+
+int hrtimer_ready(void) {
+    return bases[smp_cpu_id()].ready;
+}
+
+void hrtimer_init(hrtimer_t *timer, void (*fn)(hrtimer_t *timer), void *data) {
+    timer->next = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->data = data;
+    timer->cpu = 0;
+    timer->queued = 0;
+}
+
+// Program the hardware for the head of the queue if that changed. Caller holds the lock.
+static void rearm(hrtimer_base_t *b) {
+    uint64_t next = b->head ? b->head->expires : 0;
+    if (next == b->armed) return;
+    b->armed = next;
+    lapic_timer_arm(next);
+    b->stats.programmed++;
+}
+
+static void dequeue(hrtimer_base_t *b, hrtimer_t *timer) {
+    for (hrtimer_t **pp = &b->head; *pp; pp = &(*pp)->next) {
+        if (*pp == timer) {
+            *pp = timer->next;
+            break;
+        }
+    }
+    timer->next = NULL;
+    timer->queued = 0;
+}
+
+// Lock the queue currently holding `timer`; it can move while we wait
+static hrtimer_base_t *timer_base_lock(hrtimer_t *timer, uint64_t *flags) {
+    for (;;) {
+        int cpu = timer->cpu;
+        *flags = spin_lock_irqsave(&bases[cpu].lock);
+        if (timer->cpu == cpu) return &bases[cpu];
+        spin_unlock_irqrestore(&bases[cpu].lock, *flags);
+    }
+}
+
+int hrtimer_start(hrtimer_t *timer, uint64_t expires) {
+    // Stay on this CPU from reading its id until its base is re-armed
+    uint64_t irq = irq_save();
+    uint64_t flags;
+    hrtimer_base_t *old = timer_base_lock(timer, &flags);
+    if (timer->queued) dequeue(old, timer);
+    spin_unlock_irqrestore(&old->lock, flags);
+
+    int cpu = smp_cpu_id();
+    hrtimer_base_t *b = &bases[cpu];
+    if (!b->ready) {
+        irq_restore(irq);
+        return -1;
+    }
+    spin_lock(&b->lock);
+    timer->expires = expires;
+    timer->cpu = cpu;
+    hrtimer_t **pp = &b->head;
+    while (*pp && (*pp)->expires <= expires) pp = &(*pp)->next;
+    timer->next = *pp;
+    *pp = timer;
+    timer->queued = 1;
+    rearm(b);
+    spin_unlock(&b->lock);
+    irq_restore(irq);
+    return 0;
+}
+
+int hrtimer_start_ns(hrtimer_t *timer, uint64_t ns) {
+    return hrtimer_start(timer, rdtsc() + ns * tsc_khz() / 1000000);
+}
+
+int hrtimer_cancel(hrtimer_t *timer) {
+    int pending = 0;
+    for (;;) {
+        uint64_t flags;
+        hrtimer_base_t *b = timer_base_lock(timer, &flags);
+        int local = b == &bases[smp_cpu_id()];
+        if (timer->queued) {
+            dequeue(b, timer);
+            pending = 1;
+            // Leaving a stale deadline armed only costs one empty interrupt, but skip it when local
+            if (local) rearm(b);
+        }
+        // A callback running on another CPU may still use the timer and its data: wait for it,
+        // then dequeue again in case it restarted the timer. On this CPU it is our caller.
+        int busy = b->running == timer && !local;
+        spin_unlock_irqrestore(&b->lock, flags);
+        if (!busy) return pending;
+        while (__atomic_load_n(&b->running, __ATOMIC_ACQUIRE) == timer) __asm__ volatile ("pause");
+    }
+}
+
+void hrtimer_interrupt(void) {
+    hrtimer_base_t *b = &bases[smp_cpu_id()];
+    if (!b->ready) return;
+    spin_lock(&b->lock);
+    b->stats.interrupts++;
+    // The hardware has fired, whatever it held is no longer armed
+    b->armed = 0;
+    while (b->head && b->head->expires <= rdtsc()) {
+        hrtimer_t *t = b->head;
+        dequeue(b, t);
+        b->stats.expired++;
+        // The callback may restart its own timer; hrtimer_cancel waits for it through `running`
+        b->running = t;
+        spin_unlock(&b->lock);
+        if (t->fn) t->fn(t);
+        spin_lock(&b->lock);
+        b->running = NULL;
+    }
+    rearm(b);
+    spin_unlock(&b->lock);
+}
+
+int hrtimer_get_stats(int cpu, hrtimer_stats_t *out) {
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS || !bases[cpu].ready || !out) return -1;
+    *out = bases[cpu].stats;
+    return 0;
+}
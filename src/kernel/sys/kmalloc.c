@@ -3,118 +3,272 @@
 #include <kernel/arch/x86_64/pmm.h>
 #include <kernel/arch/x86_64/vmm.h>
 #include <kernel/sys/string.h>
+#include <kernel/sys/slab.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <kernel/sys/spinlock.h>
 #include <stdint.h>
 
 #define KERNEL_HEAP_BASE 0xFFFF800000000000ULL
 #define PAGE_SIZE 4096
 #define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((a) - 1))
 
+// Every block carries a header and a matching footer (boundary tags), so kfree can find and merge
+// both physical neighbours in constant time. Free blocks sit on segregated lists binned by log2(size).
 typedef struct block_header {
-    size_t size;
-    struct block_header *next;
+    size_t size;                // payload bytes
     int free;
+    uint16_t site;              // allocation-site slot of the owner while in use
+    struct block_header *next;  // free-list links, only meaningful while the block is free
+    struct block_header *prev;
 } block_header_t;
 
+typedef struct block_footer {
+    size_t size;
+    int free;
+} block_footer_t;
+
+#define HEAP_BINS 48
+#define BLOCK_OVERHEAD (sizeof(block_header_t) + sizeof(block_footer_t))
+#define MIN_PAYLOAD 16
+
+// Covers the heap, its bins and the call-site table. A ticket lock: every CPU allocates, and
+// one that frees and allocates in a loop must not keep the others out. Lock order: heap, then
+// a slab cache, then the PMM.
+static lock_stat_t heap_stat = LOCK_STAT_INIT("kmalloc");
+static ticketlock_t heap_lock = TICKETLOCK_INIT_STAT(heap_stat);
+
 static uintptr_t heap_start = (uintptr_t)KERNEL_HEAP_BASE;
 static uintptr_t heap_end = (uintptr_t)KERNEL_HEAP_BASE;
-static block_header_t *free_list = NULL;
+static block_header_t *bins[HEAP_BINS];
+static uint64_t bins_nonempty = 0;
+
+// Per-call-site accounting, keyed by the return address of the kmalloc call.
+// Slot 0 collects allocations whose site could not get a slot of its own.
+static kmalloc_site_t sites[KMALLOC_SITES];
+static int sites_used = 1;
+static uint64_t search_count = 0;
+static uint64_t search_cycles = 0;
+static uint64_t search_max_cycles = 0;
+
+static uint16_t site_lookup(uintptr_t caller) {
+    uint32_t h = (uint32_t)((caller >> 2) * 0x9E3779B1U) % (KMALLOC_SITES - 1);
+    for (int probe = 0; probe < KMALLOC_SITES - 1; ++probe) {
+        uint16_t idx = (uint16_t)(1 + (h + probe) % (KMALLOC_SITES - 1));
+        if (sites[idx].caller == caller) return idx;
+        if (sites[idx].caller == 0) {
+            sites[idx].caller = caller;
+            sites_used++;
+            return idx;
+        }
+    }
+    return 0;
+}
+
+static void site_account_alloc(uint16_t idx, size_t bytes) {
+    kmalloc_site_t *st = &sites[idx];
+    st->allocs++;
+    st->live_count++;
+    st->live_bytes += bytes;
+    if (st->live_bytes > st->peak_bytes) st->peak_bytes = st->live_bytes;
+}
+
+static void site_account_free(uint16_t idx, size_t bytes) {
+    kmalloc_site_t *st = &sites[idx];
+    st->frees++;
+    if (st->live_count) st->live_count--;
+    st->live_bytes = (st->live_bytes > bytes) ? st->live_bytes - bytes : 0;
+}
+
+static int bin_index(size_t size) {
+    int idx = 63 - __builtin_clzll((unsigned long long)size);
+    return idx < HEAP_BINS ? idx : HEAP_BINS - 1;
+}
+
+static block_footer_t *block_footer(block_header_t *hdr) {
+    return (block_footer_t *)((uintptr_t)hdr + sizeof(block_header_t) + hdr->size);
+}
+
+static void block_set(block_header_t *hdr, size_t size, int free) {
+    hdr->size = size;
+    hdr->free = free;
+    block_footer_t *ftr = block_footer(hdr);
+    ftr->size = size;
+    ftr->free = free;
+}
+
+static void bin_insert(block_header_t *hdr) {
+    int idx = bin_index(hdr->size);
+    hdr->prev = NULL;
+    hdr->next = bins[idx];
+    if (bins[idx]) bins[idx]->prev = hdr;
+    bins[idx] = hdr;
+    bins_nonempty |= 1ULL << idx;
+}
+
+static void bin_remove(block_header_t *hdr) {
+    int idx = bin_index(hdr->size);
+    if (hdr->prev) hdr->prev->next = hdr->next;
+    else bins[idx] = hdr->next;
+    if (hdr->next) hdr->next->prev = hdr->prev;
+    if (!bins[idx]) bins_nonempty &= ~(1ULL << idx);
+    hdr->next = hdr->prev = NULL;
+}
+
+// Mark `hdr` free, merge it with free physical neighbours and file the result in its bin
+static void block_release(block_header_t *hdr) {
+    size_t size = hdr->size;
+    uintptr_t next_addr = (uintptr_t)hdr + BLOCK_OVERHEAD + size;
+    if (next_addr < heap_end) {
+        block_header_t *next = (block_header_t *)next_addr;
+        if (next->free) {
+            bin_remove(next);
+            size += BLOCK_OVERHEAD + next->size;
+        }
+    }
+    if ((uintptr_t)hdr > heap_start) {
+        block_footer_t *pftr = (block_footer_t *)((uintptr_t)hdr - sizeof(block_footer_t));
+        if (pftr->free) {
+            block_header_t *prev = (block_header_t *)((uintptr_t)pftr - pftr->size - sizeof(block_header_t));
+            bin_remove(prev);
+            size += BLOCK_OVERHEAD + prev->size;
+            hdr = prev;
+        }
+    }
+    block_set(hdr, size, 1);
+    bin_insert(hdr);
+}
 
 static int heap_expand(size_t bytes) {
     if (bytes == 0) return 0;
     size_t need = ALIGN_UP(bytes, PAGE_SIZE);
     size_t pages = need / PAGE_SIZE;
-    for (size_t i = 0; i < pages; ++i) {
-        void *p = pmm_alloc_page();
-        if (!p) return -1;
-        uintptr_t pa = (uintptr_t)p;
-        uintptr_t va = heap_end + i * PAGE_SIZE;
-        if (vmm_map_page(va, pa, VMM_PFLAG_WRITE) != 0) {
-            pmm_free_page((void *)pa);
-            for (size_t j = 0; j < i; ++j) vmm_unmap_page(heap_end + j * PAGE_SIZE);
-            return -1;
+    size_t mapped = 0;
+    int rc = 0;
+    // Grab physically contiguous buddy blocks, largest first. Blocks of 2 MiB and up that land
+    // on a 2 MiB aligned heap address get a single large-page mapping.
+    while (mapped < pages) {
+        unsigned int order = 0;
+        while (order < PMM_MAX_ORDER && (1UL << (order + 1)) <= pages - mapped) order++;
+        void *p = pmm_alloc_pages(order);
+        while (!p && order > 0) p = pmm_alloc_pages(--order);
+        if (!p) { rc = -1; break; }
+        size_t n = 1UL << order;
+        if (vmm_map_range(heap_end + mapped * PAGE_SIZE, (uintptr_t)p, n * PAGE_SIZE, VMM_PFLAG_WRITE) != 0) {
+            pmm_free_pages_order(p, order);
+            rc = -1;
+            break;
         }
+        mapped += n;
+    }
+    if (mapped == 0) return -1;
+    // Keep whatever was mapped as free heap, even if the full request could not be met.
+    // The new block merges with a free block that ended at the old heap_end.
+    block_header_t *hdr = (block_header_t *)heap_end;
+    heap_end += mapped * PAGE_SIZE;
+    block_set(hdr, mapped * PAGE_SIZE - BLOCK_OVERHEAD, 0);
+    block_release(hdr);
+    return rc;
+}
+
+static block_header_t *find_fit_walk(size_t asize) {
+    // The block's own bin may hold smaller blocks, so scan it; any block in a higher bin fits
+    int idx = bin_index(asize);
+    for (block_header_t *cur = bins[idx]; cur; cur = cur->next) {
+        if (cur->size >= asize) return cur;
     }
-    heap_end += pages * PAGE_SIZE;
-    if (!free_list) {
-        block_header_t *hdr = (block_header_t *)heap_start;
-        hdr->size = (heap_end - heap_start) - sizeof(block_header_t);
-        hdr->next = NULL;
-        hdr->free = 1;
-        free_list = hdr;
+    uint64_t mask = (idx + 1 < 64) ? bins_nonempty & ~((1ULL << (idx + 1)) - 1) : 0;
+    if (!mask) return NULL;
+    return bins[__builtin_ctzll(mask)];
+}
+
+static block_header_t *find_fit(size_t asize) {
+    uint64_t t0 = rdtsc();
+    block_header_t *hdr = find_fit_walk(asize);
+    uint64_t dt = rdtsc() - t0;
+    search_count++;
+    search_cycles += dt;
+    if (dt > search_max_cycles) search_max_cycles = dt;
+    return hdr;
+}
+
+static void *block_take(block_header_t *hdr, size_t asize, uint16_t site) {
+    bin_remove(hdr);
+    size_t remainder = hdr->size - asize;
+    if (remainder >= BLOCK_OVERHEAD + MIN_PAYLOAD) {
+        block_set(hdr, asize, 0);
+        block_header_t *rest = (block_header_t *)((uintptr_t)block_footer(hdr) + sizeof(block_footer_t));
+        block_set(rest, remainder - BLOCK_OVERHEAD, 1);
+        bin_insert(rest);
     } else {
-        block_header_t *hdr = (block_header_t *)(heap_end - pages * PAGE_SIZE);
-        hdr->size = (pages * PAGE_SIZE) - sizeof(block_header_t);
-        hdr->free = 1;
-        hdr->next = NULL;
-        block_header_t *cur = free_list;
-        while (cur->next) cur = cur->next;
-        cur->next = hdr;
+        block_set(hdr, hdr->size, 0);
     }
-    return 0;
+    hdr->site = site;
+    site_account_alloc(site, hdr->size);
+    return (void *)((uintptr_t)hdr + sizeof(block_header_t));
 }
 
-void *kmalloc(size_t size) {
+static int in_heap(void *ptr) {
+    return (uintptr_t)ptr >= heap_start && (uintptr_t)ptr < heap_end;
+}
+
+static void *kmalloc_site(size_t size, uintptr_t caller) {
     if (size == 0) return NULL;
-    size_t asize = ALIGN_UP(size, 8);
-    size_t total = asize + sizeof(block_header_t);
-    block_header_t *prev = NULL;
-    block_header_t *cur = free_list;
-    while (cur) {
-        if (cur->free && cur->size >= asize) {
-            size_t remainder = cur->size - asize;
-            if (remainder > sizeof(block_header_t) + 8) {
-                block_header_t *newb = (block_header_t *)((uintptr_t)cur + sizeof(block_header_t) + asize);
-                newb->size = remainder - sizeof(block_header_t);
-                newb->free = 1;
-                newb->next = cur->next;
-                cur->size = asize;
-                cur->next = newb;
-            }
-            cur->free = 0;
-            return (void *)((uintptr_t)cur + sizeof(block_header_t));
+    uint16_t site = site_lookup(caller);
+    // Small requests come from the size-class slabs; only large ones use the boundary-tag heap
+    if (size <= SLAB_MAX_SIZE) {
+        void *obj = slab_alloc(size, site);
+        if (obj) {
+            size_t class_size = SLAB_MIN_SIZE;
+            while (class_size < size) class_size <<= 1;
+            site_account_alloc(site, class_size);
+            return obj;
         }
-        prev = cur;
-        cur = cur->next;
     }
-    size_t expand_bytes = ALIGN_UP(total, PAGE_SIZE);
-    if (expand_bytes == 0) expand_bytes = PAGE_SIZE;
-    if (heap_expand(expand_bytes) != 0) return NULL;
-    cur = free_list;
-    while (cur && cur->next) cur = cur->next;
-    if (!cur || !cur->free || cur->size < asize) return NULL;
-    size_t remainder = cur->size - asize;
-    if (remainder > sizeof(block_header_t) + 8) {
-        block_header_t *newb = (block_header_t *)((uintptr_t)cur + sizeof(block_header_t) + asize);
-        newb->size = remainder - sizeof(block_header_t);
-        newb->free = 1;
-        newb->next = cur->next;
-        cur->size = asize;
-        cur->next = newb;
+    size_t asize = ALIGN_UP(size, 8);
+    if (asize < MIN_PAYLOAD) asize = MIN_PAYLOAD;
+    block_header_t *hdr = find_fit(asize);
+    if (!hdr) {
+        // A partial expansion is still kept, so look again whatever heap_expand returned
+        heap_expand(asize + BLOCK_OVERHEAD);
+        hdr = find_fit(asize);
+        if (!hdr) return NULL;
     }
-    cur->free = 0;
-    return (void *)((uintptr_t)cur + sizeof(block_header_t));
+    return block_take(hdr, asize, site);
+}
+
+static void *kmalloc_locked(size_t size, uintptr_t caller) {
+    uint64_t flags = ticket_lock_irqsave(&heap_lock);
+    void *p = kmalloc_site(size, caller);
+    ticket_unlock_irqrestore(&heap_lock, flags);
+    return p;
+}
+
+void *kmalloc(size_t size) {
+    return kmalloc_locked(size, (uintptr_t)__builtin_return_address(0));
 }
 
 void kfree(void *ptr) {
     if (!ptr) return;
-    block_header_t *hdr = (block_header_t *)((uintptr_t)ptr - sizeof(block_header_t));
-    hdr->free = 1;
-    block_header_t *cur = free_list;
-    while (cur && cur->next) {
-        if (cur->free && cur->next->free) {
-            cur->size += sizeof(block_header_t) + cur->next->size;
-            cur->next = cur->next->next;
-            continue;
+    uint64_t flags = ticket_lock_irqsave(&heap_lock);
+    if (!in_heap(ptr)) {
+        uint16_t site;
+        size_t bytes;
+        if (slab_free(ptr, &site, &bytes) == 0) site_account_free(site, bytes);
+    } else {
+        block_header_t *hdr = (block_header_t *)((uintptr_t)ptr - sizeof(block_header_t));
+        if (!hdr->free) {
+            site_account_free(hdr->site, hdr->size);
+            block_release(hdr);
         }
-        cur = cur->next;
     }
+    ticket_unlock_irqrestore(&heap_lock, flags);
 }
 
 void *kmalloc_aligned(size_t size, size_t alignment) {
     if (size == 0 || alignment == 0) return NULL;
     if (alignment < 8) alignment = 8;
     size_t total = size + alignment + sizeof(void*);
-    void *raw = kmalloc(total);
+    void *raw = kmalloc_locked(total, (uintptr_t)__builtin_return_address(0));
     if (!raw) return NULL;
     uintptr_t raw_addr = (uintptr_t)raw;
     uintptr_t aligned_addr = (raw_addr + sizeof(void*) + alignment - 1) & ~(alignment - 1);
@@ -127,3 +281,32 @@ void kfree_aligned(void *ptr) {
     void *raw = *((void**)((uintptr_t)ptr - sizeof(void*)));
     kfree(raw);
 }
+
+int kmalloc_site_info(int index, kmalloc_site_t *out) {
+    if (index < 0 || index >= KMALLOC_SITES || !out) return -1;
+    uint64_t flags = ticket_lock_irqsave(&heap_lock);
+    *out = sites[index];
+    ticket_unlock_irqrestore(&heap_lock, flags);
+    return 0;
+}
+
+void kmalloc_heap_stats(kmalloc_heap_stats_t *out) {
+    if (!out) return;
+    memset_k(out, 0, sizeof(*out));
+    uint64_t flags = ticket_lock_irqsave(&heap_lock);
+    out->heap_bytes = heap_end - heap_start;
+    uint64_t t0 = rdtsc();
+    for (int b = 0; b < HEAP_BINS; ++b) {
+        for (block_header_t *cur = bins[b]; cur; cur = cur->next) {
+            out->free_blocks++;
+            out->free_bytes += cur->size;
+            if (cur->size > out->largest_free) out->largest_free = cur->size;
+        }
+    }
+    out->walk_cycles = rdtsc() - t0;
+    out->search_count = search_count;
+    out->search_cycles = search_cycles;
+    out->search_max_cycles = search_max_cycles;
+    out->sites_used = (uint32_t)sites_used;
+    ticket_unlock_irqrestore(&heap_lock, flags);
+}
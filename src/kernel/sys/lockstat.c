@@ -0,0 +1,53 @@
+// Lock statistics (see lockstat.h). Stats register themselves on first use with a lock-free push,
+// so a lock can be declared with its stats anywhere without an init call.
+#include <kernel/sys/lockstat.h>
+#include <kernel/arch/x86_64/tsc.h>
+#include <stddef.h>
+
+static lock_stat_t *registry = NULL;
+
+static void lock_stat_register(lock_stat_t *s) {
+    if (__atomic_exchange_n(&s->registered, 1, __ATOMIC_ACQ_REL)) return;
+    lock_stat_t *head = __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+    do {
+        s->next = head;
+    } while (!__atomic_compare_exchange_n(&registry, &head, s, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+void lock_stat_acquired(lock_stat_t *s, uint64_t start, int waited) {
+    uint64_t now = rdtsc();
+    if (!s->registered) lock_stat_register(s);
+    s->acquisitions++;
+    if (waited) {
+        uint64_t wait = now - start;
+        s->contended++;
+        s->wait_cycles += wait;
+        if (wait > s->max_wait_cycles) s->max_wait_cycles = wait;
+    }
+    s->held_since = now;
+}
+
+void lock_stat_released(lock_stat_t *s) {
+    uint64_t hold = rdtsc() - s->held_since;
+    s->hold_cycles += hold;
+    if (hold > s->max_hold_cycles) s->max_hold_cycles = hold;
+    int b = (63 - __builtin_clzll(hold | 1)) - LOCK_HIST_SHIFT;
+    if (b < 0) b = 0;
+    if (b >= LOCK_HIST_BUCKETS) b = LOCK_HIST_BUCKETS - 1;
+    s->hold_hist[b]++;
+}
+
+lock_stat_t *lock_stat_next(lock_stat_t *prev) {
+    return prev ? prev->next : __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+}
+
+void lock_stat_reset(void) {
+    uint64_t now = rdtsc();
+    for (lock_stat_t *s = lock_stat_next(NULL); s; s = s->next) {
+        s->acquisitions = s->contended = 0;
+        s->wait_cycles = s->max_wait_cycles = 0;
+        s->hold_cycles = s->max_hold_cycles = 0;
+        for (int b = 0; b < LOCK_HIST_BUCKETS; ++b) s->hold_hist[b] = 0;
+        s->held_since = now;
+    }
+}
@@ -0,0 +1,268 @@
+// Slab allocator: power-of-two kmalloc classes plus typed object caches.
+// Each slab is one naturally aligned buddy block taken straight from the PMM (identity mapped),
+// with its header at the start, so the owning slab of any object is found by masking the address.
+#include <kernel/sys/slab.h>
+#include <kernel/sys/kmalloc.h>
+#include <kernel/arch/x86_64/pmm.h>
+#include <kernel/sys/spinlock.h>
+#include <kernel/sys/string.h>
+#include <stdint.h>
+
+#define SLAB_ORDER 3
+#define SLAB_BYTES ((uintptr_t)PMM_PAGE_SIZE << SLAB_ORDER)
+#define SLAB_MAGIC 0x51AB51ABU
+#define SLAB_CLASSES 9 // 16, 32, ... 4096
+#define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((a) - 1))
+
+typedef struct slab {
+    uint32_t magic;
+    uint32_t inuse;
+    struct slab *next;
+    struct slab *prev;
+    struct kmem_cache *cache;
+    void *freelist;
+    uint16_t *tags;       // per-object owner tags, only for tagged caches
+} slab_t;
+
+struct kmem_cache {
+    const char *name;
+    size_t obj_size;      // requested object size
+    size_t stride;        // distance between objects, a multiple of the alignment
+    size_t link_offset;   // where the free-list link lives inside a free object
+    size_t first_offset;  // offset of the first object inside a slab
+    uint32_t per_slab;
+    int tagged;           // keep a 16-bit tag per object in a side array after the slab header
+    void (*ctor)(void *obj);
+    slab_t *partial;      // slabs with at least one free object
+    slab_t *full;         // slabs with no free object
+    slab_t *empty;        // at most one fully free slab kept around to absorb alloc/free churn
+    uint64_t live;
+    uint64_t peak;
+    uint64_t slabs;
+    struct kmem_cache *next_cache;
+    spinlock_t lock;      // covers the slab lists and counters; taken with interrupts off
+    lock_stat_t stat;
+};
+
+static kmem_cache_t caches[SLAB_CLASSES];
+static kmem_cache_t *cache_list = NULL;
+static int slab_ready = 0;
+// Covers cache_list
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+
+static const char *class_names[SLAB_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1024", "kmalloc-2048", "kmalloc-4096"
+};
+
+static int cache_setup(kmem_cache_t *c, const char *name, size_t size, size_t align, void (*ctor)(void *), int tagged) {
+    c->name = name;
+    c->tagged = tagged;
+    c->obj_size = size;
+    c->ctor = ctor;
+    // A constructed object must survive being on the free list, so its link goes after the payload
+    c->link_offset = ctor ? ALIGN_UP(size, sizeof(void *)) : 0;
+    size_t span = ctor ? c->link_offset + sizeof(void *) : size;
+    if (span < sizeof(void *)) span = sizeof(void *);
+    c->stride = ALIGN_UP(span, align);
+    c->first_offset = ALIGN_UP(sizeof(slab_t), align);
+    if (c->first_offset + c->stride > SLAB_BYTES) return -1;
+    c->per_slab = (uint32_t)((SLAB_BYTES - c->first_offset) / c->stride);
+    if (tagged) {
+        // Make room for the tag array between the header and the first object
+        c->per_slab = (uint32_t)((SLAB_BYTES - sizeof(slab_t)) / (c->stride + sizeof(uint16_t)));
+        for (;;) {
+            c->first_offset = ALIGN_UP(sizeof(slab_t) + c->per_slab * sizeof(uint16_t), align);
+            if (c->first_offset + (size_t)c->per_slab * c->stride <= SLAB_BYTES) break;
+            c->per_slab--;
+        }
+        if (c->per_slab == 0) return -1;
+    }
+    c->partial = c->full = c->empty = NULL;
+    c->live = c->peak = c->slabs = 0;
+    memset_k(&c->stat, 0, sizeof(c->stat));
+    c->stat.name = name;
+    spin_lock_init_stat(&c->lock, &c->stat);
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    c->next_cache = cache_list;
+    cache_list = c;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    return 0;
+}
+
+// Runs from the first kmalloc, long before the APs are started, so it needs no lock of its own
+static void slab_init(void) {
+    slab_ready = 1;
+    // Classes are aligned to their own size; link them so the smallest is listed first
+    for (int i = SLAB_CLASSES - 1; i >= 0; --i) {
+        size_t size = (size_t)SLAB_MIN_SIZE << i;
+        cache_setup(&caches[i], class_names[i], size, size, NULL, 1);
+    }
+}
+
+static int size_class(size_t size) {
+    if (size <= SLAB_MIN_SIZE) return 0;
+    // ceil(log2(size)) - log2(SLAB_MIN_SIZE)
+    return (64 - __builtin_clzll((unsigned long long)(size - 1))) - 4;
+}
+
+static void list_remove(slab_t **head, slab_t *s) {
+    if (s->prev) s->prev->next = s->next;
+    else *head = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+static void list_push(slab_t **head, slab_t *s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) (*head)->prev = s;
+    *head = s;
+}
+
+#define OBJ_LINK(c, obj) ((void **)((uintptr_t)(obj) + (c)->link_offset))
+
+static slab_t *slab_create(kmem_cache_t *c) {
+    slab_t *s = (slab_t *)pmm_alloc_pages(SLAB_ORDER);
+    if (!s) return NULL;
+    s->magic = SLAB_MAGIC;
+    s->inuse = 0;
+    s->next = s->prev = NULL;
+    s->cache = c;
+    s->tags = c->tagged ? (uint16_t *)((uintptr_t)s + sizeof(slab_t)) : NULL;
+    // Construct every object once and thread the free list through them, lowest address first
+    uintptr_t base = (uintptr_t)s + c->first_offset;
+    void *head = NULL;
+    for (uint32_t i = c->per_slab; i-- > 0;) {
+        void *obj = (void *)(base + (uintptr_t)i * c->stride);
+        if (c->ctor) c->ctor(obj);
+        *OBJ_LINK(c, obj) = head;
+        head = obj;
+    }
+    s->freelist = head;
+    c->slabs++;
+    return s;
+}
+
+static void *cache_alloc_locked(kmem_cache_t *c, uint16_t tag) {
+    slab_t *s = c->partial;
+    if (!s) {
+        if (c->empty) {
+            s = c->empty;
+            c->empty = NULL;
+        } else {
+            s = slab_create(c);
+            if (!s) return NULL;
+        }
+        list_push(&c->partial, s);
+    }
+    void *obj = s->freelist;
+    s->freelist = *OBJ_LINK(c, obj);
+    s->inuse++;
+    if (!s->freelist) {
+        list_remove(&c->partial, s);
+        list_push(&c->full, s);
+    }
+    if (++c->live > c->peak) c->peak = c->live;
+    if (s->tags) s->tags[((uintptr_t)obj - (uintptr_t)s - c->first_offset) / c->stride] = tag;
+    return obj;
+}
+
+// Caches are used from the #NM handler (FPU state), so their locks keep interrupts off
+static void *cache_alloc(kmem_cache_t *c, uint16_t tag) {
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    void *obj = cache_alloc_locked(c, tag);
+    spin_unlock_irqrestore(&c->lock, flags);
+    return obj;
+}
+
+static slab_t *slab_of(void *ptr) {
+    slab_t *s = (slab_t *)((uintptr_t)ptr & ~(SLAB_BYTES - 1));
+    if (s->magic != SLAB_MAGIC || (uintptr_t)ptr < (uintptr_t)s + s->cache->first_offset) return NULL;
+    return s;
+}
+
+static void cache_free(kmem_cache_t *c, slab_t *s, void *obj) {
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    int was_full = (s->freelist == NULL);
+    *OBJ_LINK(c, obj) = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    c->live--;
+    if (was_full) {
+        list_remove(&c->full, s);
+        list_push(&c->partial, s);
+    }
+    if (s->inuse == 0) {
+        list_remove(&c->partial, s);
+        if (!c->empty) {
+            c->empty = s;
+        } else {
+            s->magic = 0;
+            c->slabs--;
+            pmm_free_pages_order(s, SLAB_ORDER);
+        }
+    }
+    spin_unlock_irqrestore(&c->lock, flags);
+}
+
+void *slab_alloc(size_t size, uint16_t tag) {
+    if (size == 0 || size > SLAB_MAX_SIZE) return NULL;
+    if (!slab_ready) slab_init();
+    return cache_alloc(&caches[size_class(size)], tag);
+}
+
+int slab_free(void *ptr, uint16_t *tag, size_t *size) {
+    if (!ptr || !slab_ready) return -1;
+    slab_t *s = slab_of(ptr);
+    if (!s) return -1;
+    kmem_cache_t *c = s->cache;
+    if (tag) *tag = s->tags ? s->tags[((uintptr_t)ptr - (uintptr_t)s - c->first_offset) / c->stride] : 0;
+    if (size) *size = c->stride;
+    cache_free(c, s, ptr);
+    return 0;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj)) {
+    if (size == 0) return NULL;
+    if (!slab_ready) slab_init();
+    if (align < KMEM_CACHE_LINE) align = KMEM_CACHE_LINE;
+    if (align & (align - 1)) return NULL;
+    kmem_cache_t *c = (kmem_cache_t *)kmalloc(sizeof(kmem_cache_t));
+    if (!c) return NULL;
+    if (cache_setup(c, name, size, align, ctor, 0) != 0) {
+        kfree(c);
+        return NULL;
+    }
+    return c;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    if (!cache) return NULL;
+    return cache_alloc(cache, 0);
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!cache || !obj) return;
+    slab_t *s = slab_of(obj);
+    if (!s || s->cache != cache) return;
+    cache_free(cache, s, obj);
+}
+
+int kmem_cache_info(int index, kmem_cache_info_t *out) {
+    if (!slab_ready) slab_init();
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    kmem_cache_t *c = cache_list;
+    while (c && index-- > 0) c = c->next_cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    if (!c || !out) return -1;
+    // Caches are never destroyed, so the pointer stays good; the counters are a snapshot
+    out->name = c->name;
+    out->obj_size = c->obj_size;
+    out->stride = c->stride;
+    out->per_slab = c->per_slab;
+    out->live = c->live;
+    out->peak = c->peak;
+    out->slabs = c->slabs;
+    return 0;
+}
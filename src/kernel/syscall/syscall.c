@@ -14,27 +14,26 @@
 #include <kernel/sys/scheduler.h>
 #include <kernel/sys/string.h>
 #include <kernel/drivers/elf.h>
+#include <kernel/arch/x86_64/vmm.h>
+#include <kernel/arch/x86_64/pmm.h>
+#include <kernel/arch/x86_64/mm.h>
+#include <kernel/arch/x86_64/percpu.h>
+#include <kernel/sys/spinlock.h>
+#include <cpu/msr.h>
 
 // File descriptor table
 static file_descriptor_t fd_table[MAX_OPEN_FILES];
+// Guards claiming and releasing slots; an open descriptor is only used by its owner
+static lock_stat_t fd_stat = LOCK_STAT_INIT("fd_table");
+static spinlock_t fd_lock = SPINLOCK_INIT_STAT(fd_stat);
 
 // Standard file descriptors
 #define STDIN_FILENO  0
 #define STDOUT_FILENO 1
 #define STDERR_FILENO 2
 
-// Helper functions for MSR access
-static inline void wrmsr(uint32_t msr, uint64_t value) {
-    uint32_t low = (uint32_t)value;
-    uint32_t high = (uint32_t)(value >> 32);
-    __asm__ volatile("wrmsr" : : "c"(msr), "a"(low), "d"(high));
-}
-
-static inline uint64_t rdmsr(uint32_t msr) {
-    uint32_t low, high;
-    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
-    return ((uint64_t)high << 32) | low;
-}
+// Longest path, NUL included, a syscall copies in from user space
+#define SYSCALL_PATH_MAX 256
 
 // Initialize syscall subsystem
 void syscall_init(void) {
@@ -53,6 +52,14 @@ void syscall_init(void) {
     fd_table[STDERR_FILENO].in_use = 1;
     fd_table[STDERR_FILENO].flags = O_WRONLY;
     
+    syscall_init_cpu();
+    
+    tty_putstr("[SYSCALL] Initialized. LSTAR=0x");
+    tty_puthex64((uint64_t)syscall_entry);
+    tty_putstr("\n");
+}
+
+void syscall_init_cpu(void) {
     // Setup syscall/sysret MSRs
     // MSR_STAR: bits 32-47 = kernel CS (0x08), bits 48-63 = user CS base for SYSRET
     
@@ -79,8 +86,9 @@ void syscall_init(void) {
     // MSR_LSTAR: syscall entry point (64-bit mode)
     wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
     
-    // MSR_SYSCALL_MASK: clear IF (interrupt flag) on syscall entry
-    wrmsr(MSR_SYSCALL_MASK, 0x200); // Disable interrupts during syscall
+    // MSR_SYSCALL_MASK: clear IF (interrupt flag) on syscall entry; syscall_entry turns it back
+    // on once the frame is saved, so syscalls are preemptible
+    wrmsr(MSR_SYSCALL_MASK, 0x200);
     
     // Enable EFER.SCE (System Call Enable) - bit 0
     #define MSR_EFER 0xC0000080
@@ -89,18 +97,14 @@ void syscall_init(void) {
     if (!(efer & EFER_SCE)) {
         wrmsr(MSR_EFER, efer | EFER_SCE);
     }
-    
-    tty_putstr("[SYSCALL] Initialized. LSTAR=0x");
-    tty_puthex64((uint64_t)syscall_entry);
-    tty_putstr("\n");
 }
 
-// Syscall dispatcher
-int64_t syscall_handler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, 
-                        uint64_t arg3, uint64_t arg4, uint64_t arg5) {
-    (void)arg4;
-    (void)arg5;
-    
+syscall_frame_t* syscall_current_frame(void) {
+    return this_cpu()->syscall_frame;
+}
+
+static int64_t syscall_dispatch(uint64_t syscall_num, uint64_t arg1, uint64_t arg2,
+                                uint64_t arg3) {
     switch (syscall_num) {
         case SYS_READ:      // 0
             return sys_read((int)arg1, (void*)arg2, (size_t)arg3);
@@ -116,6 +120,8 @@ int64_t syscall_handler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2,
             return sys_seek((int)arg1, (int64_t)arg2, (int)arg3);
         case SYS_BRK:       // 12 - not implemented, return 0
             return 0;
+        case SYS_SCHED_YIELD: // 24
+            return sys_sched_yield();
         case SYS_NANOSLEEP: // 35
             return sys_sleep((uint32_t)(arg1 / 1000000)); // Convert ns to ms
         case SYS_GETPID:    // 39
@@ -155,14 +161,70 @@ int64_t syscall_handler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2,
     }
 }
 
-// Find a free file descriptor
+// FAT32, the terminal and the address-space list have no lock, and the PS/2 shell uses them from
+// the keyboard IRQ, so calls reaching them run with interrupts off as before. Only the calls
+// listed here are preemptible; anything else, including a syscall added later, is not.
+static int syscall_preemptible(uint64_t syscall_num, uint64_t arg1) {
+    switch (syscall_num) {
+        case SYS_READ:
+            return (int)arg1 == STDIN_FILENO;  // waits for keys and must let the keyboard IRQ in
+        case SYS_CLOSE:         // fd_lock only
+        case SYS_BRK:
+        case SYS_SCHED_YIELD:
+        case SYS_NANOSLEEP:
+        case SYS_GETPID:
+        case SYS_WAIT:
+        case SYS_GETCHAR:
+        case SYS_TIME:          // cmos_lock (rtc.c)
+        case SYS_GETLINE:       // echoes with interrupts off (sys_getline)
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Syscall dispatcher. Entered with interrupts on (syscall_entry.S).
+int64_t syscall_handler(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, 
+                        uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+    (void)arg4;
+    (void)arg5;
+
+    if (syscall_preemptible(syscall_num, arg1))
+        return syscall_dispatch(syscall_num, arg1, arg2, arg3);
+    uint64_t flags = irq_save();
+    int64_t ret = syscall_dispatch(syscall_num, arg1, arg2, arg3);
+    irq_restore(flags);
+    // A slice that ran out meanwhile is acted on now rather than at the next timer interrupt
+    preempt_check_resched();
+    return ret;
+}
+
+// Find a free file descriptor and claim it, so two CPUs opening at once cannot get the same one
 static int find_free_fd(void) {
+    int fd = -1;
+    uint64_t flags = spin_lock_irqsave(&fd_lock);
     for (int i = 3; i < MAX_OPEN_FILES; i++) { // Start from 3 (after stdin/stdout/stderr)
         if (!fd_table[i].in_use) {
-            return i;
+            fd_table[i].in_use = 1;
+            fd = i;
+            break;
         }
     }
-    return -1; // No free file descriptors
+    spin_unlock_irqrestore(&fd_lock, flags);
+    return fd; // -1: no free file descriptors
+}
+
+// Give back a descriptor claimed by find_free_fd
+static void release_fd(int fd) {
+    uint64_t flags = spin_lock_irqsave(&fd_lock);
+    fd_table[fd].in_use = 0;
+    fd_table[fd].first_cluster = 0;
+    fd_table[fd].file_size = 0;
+    fd_table[fd].current_pos = 0;
+    fd_table[fd].current_cluster = 0;
+    fd_table[fd].flags = 0;
+    fd_table[fd].filename[0] = '\0';
+    spin_unlock_irqrestore(&fd_lock, flags);
 }
 
 /**
@@ -180,6 +242,9 @@ int64_t sys_read(int fd, void* buf, size_t count) {
     if (buf == NULL || count == 0) {
         return 0;
     }
+    if (!mm_access_ok(buf, count, 1)) {
+        return -1;
+    }
     
     // Handle stdin
     if (fd == STDIN_FILENO) {
@@ -244,6 +309,9 @@ int64_t sys_write(int fd, const void* buf, size_t count) {
     if (buf == NULL || count == 0) {
         return 0;
     }
+    if (!mm_access_ok(buf, count, 0)) {
+        return -1;
+    }
     
     // Handle stdout/stderr
     if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
@@ -281,8 +349,9 @@ int64_t sys_write(int fd, const void* buf, size_t count) {
  * @flags: open flags (O_RDONLY, O_WRONLY, O_RDWR, O_CREAT, etc.)
  * @return: file descriptor, or -1 on error
  */
-int64_t sys_open(const char* pathname, int flags) {
-    if (pathname == NULL) {
+int64_t sys_open(const char* upath, int flags) {
+    char pathname[SYSCALL_PATH_MAX];
+    if (upath == NULL || strncpy_from_user(pathname, upath, sizeof(pathname)) < 0) {
         return -1;
     }
     
@@ -299,14 +368,17 @@ int64_t sys_open(const char* pathname, int flags) {
         if (flags & O_CREAT) {
             // Create the file
             if (fat32_create_file(pathname, NULL, 0) != 0) {
+                release_fd(fd);
                 return -1;
             }
             // Try opening again
             result = fat32_open_file(pathname, &file);
             if (result != 0) {
+                release_fd(fd);
                 return -1;
             }
         } else {
+            release_fd(fd);
             return -1;
         }
     }
@@ -318,8 +390,7 @@ int64_t sys_open(const char* pathname, int flags) {
         file.current_pos = 0;
     }
     
-    // Fill in file descriptor
-    fd_table[fd].in_use = 1;
+    // Fill in file descriptor (find_free_fd already marked it in use)
     fd_table[fd].first_cluster = file.first_cluster;
     fd_table[fd].file_size = file.file_size;
     fd_table[fd].current_pos = 0;
@@ -356,14 +427,7 @@ int64_t sys_close(int fd) {
         return -1;
     }
     
-    fd_table[fd].in_use = 0;
-    fd_table[fd].first_cluster = 0;
-    fd_table[fd].file_size = 0;
-    fd_table[fd].current_pos = 0;
-    fd_table[fd].current_cluster = 0;
-    fd_table[fd].flags = 0;
-    fd_table[fd].filename[0] = '\0';
-    
+    release_fd(fd);
     return 0;
 }
 
@@ -374,12 +438,13 @@ int64_t sys_close(int fd) {
  * @return: number of characters read, or -1 on error
  */
 int64_t sys_getline(char* buf, size_t max_len) {
-    if (buf == NULL || max_len == 0) {
+    if (buf == NULL || max_len == 0 || !mm_access_ok(buf, max_len, 1)) {
         return -1;
     }
     
     size_t pos = 0;
     
+    // Runs preemptible while it waits for keys; the terminal is only touched with interrupts off
     while (pos < max_len - 1) {
         char c = keyboard_getchar();
         
@@ -387,9 +452,11 @@ int64_t sys_getline(char* buf, size_t max_len) {
             continue; // No key pressed, keep waiting
         }
         
+        uint64_t flags = irq_save();
         if (c == '\n' || c == '\r') {
             buf[pos++] = '\n';
             tty_putchar('\n');
+            irq_restore(flags);
             break;
         }
         
@@ -398,12 +465,14 @@ int64_t sys_getline(char* buf, size_t max_len) {
                 pos--;
                 tty_backspace();
             }
+            irq_restore(flags);
             continue;
         }
         
         // Regular character
         buf[pos++] = c;
         tty_putchar(c); // Echo
+        irq_restore(flags);
     }
     
     buf[pos] = '\0';
@@ -437,14 +506,11 @@ int64_t sys_getchar(void) {
  * @status: exit status code
  */
 void sys_exit(int status) {
-    (void)status;
-    // In a simple kernel, we might just halt or return to shell
-    // For now, just print a message
     tty_putstr("Process exited with status: ");
     tty_putdec((uint32_t)status);
     tty_putstr("\n");
-    
-    // TODO: Actually terminate the process when scheduler is implemented
+    // Does not come back; the reaper frees the address space and kernel stack
+    scheduler_exit(status);
 }
 
 /**
@@ -454,7 +520,12 @@ void sys_exit(int status) {
  * @envp: environment vector
  * @return: -1 on error (never returns on success)
  */
-int64_t sys_exec(const char* path, char* const argv[], char* const envp[]) {
+int64_t sys_exec(const char* upath, char* const argv[], char* const envp[]) {
+    char path[SYSCALL_PATH_MAX];
+    if (upath == NULL || strncpy_from_user(path, upath, sizeof(path)) < 0) {
+        return -1;
+    }
+
     // Load the ELF binary
     struct proc newproc;
     memset_k(&newproc, 0, sizeof(struct proc));
@@ -465,8 +536,10 @@ int64_t sys_exec(const char* path, char* const argv[], char* const envp[]) {
     }
     
     // Create the user process
-    if (scheduler_create_user_process((void*)newproc.entry, (void*)newproc.user_rsp, newproc.cr3) != 0) {
+    if (scheduler_create_user_process((void*)newproc.entry, (void*)newproc.user_rsp, newproc.cr3, SCHED_NICE_DEFAULT) != 0) {
         tty_putstr("exec: failed to create user process\n");
+        mm_destroy(mm_find(newproc.cr3));
+        vmm_destroy_table(newproc.cr3);
         return -1;
     }
     
@@ -481,9 +554,32 @@ int64_t sys_exec(const char* path, char* const argv[], char* const envp[]) {
  * @return: 0 in child, child PID in parent, -1 on error
  */
 int64_t sys_fork(void) {
-    // TODO: Implement fork when scheduler supports it
-    tty_putstr("fork: not yet implemented\n");
-    return -1;
+    mm_t *parent = mm_find(vmm_get_cr3());
+    syscall_frame_t *frame = syscall_current_frame();
+    if (!parent || !frame) {
+        tty_putstr("fork: caller has no user address space\n");
+        return -1;
+    }
+    uint64_t child_cr3 = vmm_clone_table(parent->cr3);
+    if (!child_cr3) {
+        tty_putstr("fork: out of memory\n");
+        return -1;
+    }
+    // Nothing is copied here: both sides share every page until one of them writes to it
+    mm_t *child = mm_fork(parent, child_cr3);
+    if (!child) {
+        tty_putstr("fork: failed to share address space\n");
+        vmm_destroy_table(child_cr3);
+        return -1;
+    }
+    int pid = scheduler_fork_user_process(frame, child_cr3);
+    if (pid < 0) {
+        tty_putstr("fork: failed to create child process\n");
+        mm_destroy(child);
+        vmm_destroy_table(child_cr3);
+        return -1;
+    }
+    return pid;
 }
 
 /**
@@ -492,10 +588,11 @@ int64_t sys_fork(void) {
  * @return: PID of terminated child, or -1 on error
  */
 int64_t sys_wait(int* status) {
-    (void)status;
-    // TODO: Implement wait when scheduler supports it
-    tty_putstr("wait: not yet implemented\n");
-    return -1;
+    if (status && !mm_access_ok(status, sizeof(int), 1)) return -1;
+    int code = 0;
+    int pid = scheduler_wait(&code);
+    if (pid >= 0 && status && copy_to_user(status, &code, sizeof(int)) != 0) return -1;
+    return pid;
 }
 
 /**
@@ -503,8 +600,16 @@ int64_t sys_wait(int* status) {
  * @return: current process ID
  */
 int64_t sys_getpid(void) {
-    // TODO: Return actual PID when scheduler is implemented
-    return 1; // Return 1 as the kernel process
+    return scheduler_current_pid();
+}
+
+/**
+ * sys_sched_yield - Give the CPU to the next runnable task
+ * @return: 0
+ */
+int64_t sys_sched_yield(void) {
+    scheduler_yield();
+    return 0;
 }
 
 /**
@@ -530,8 +635,9 @@ void sys_free(void* ptr) {
  * @statbuf: buffer to store file status
  * @return: 0 on success, -1 on error
  */
-int64_t sys_stat(const char* pathname, stat_t* statbuf) {
-    if (pathname == NULL || statbuf == NULL) {
+int64_t sys_stat(const char* upath, stat_t* statbuf) {
+    char pathname[SYSCALL_PATH_MAX];
+    if (upath == NULL || statbuf == NULL || strncpy_from_user(pathname, upath, sizeof(pathname)) < 0) {
         return -1;
     }
     
@@ -540,13 +646,15 @@ int64_t sys_stat(const char* pathname, stat_t* statbuf) {
         return -1;
     }
     
-    statbuf->st_size = file.file_size;
-    statbuf->st_mode = file.attributes;
-    statbuf->st_ctime = 0; // TODO: Get actual timestamps from FAT32
-    statbuf->st_mtime = 0;
-    statbuf->st_atime = 0;
+    stat_t st;
+    memset_k(&st, 0, sizeof st);   // no stack bytes in the padding
+    st.st_size = file.file_size;
+    st.st_mode = file.attributes;
+    st.st_ctime = 0; // TODO: Get actual timestamps from FAT32
+    st.st_mtime = 0;
+    st.st_atime = 0;
     
-    return 0;
+    return copy_to_user(statbuf, &st, sizeof(stat_t));
 }
 
 /**
@@ -554,8 +662,9 @@ int64_t sys_stat(const char* pathname, stat_t* statbuf) {
  * @pathname: path for the new directory
  * @return: 0 on success, -1 on error
  */
-int64_t sys_mkdir(const char* pathname) {
-    if (pathname == NULL) {
+int64_t sys_mkdir(const char* upath) {
+    char pathname[SYSCALL_PATH_MAX];
+    if (upath == NULL || strncpy_from_user(pathname, upath, sizeof(pathname)) < 0) {
         return -1;
     }
     return fat32_create_directory(pathname);
@@ -566,8 +675,9 @@ int64_t sys_mkdir(const char* pathname) {
  * @pathname: path to the directory
  * @return: 0 on success, -1 on error
  */
-int64_t sys_rmdir(const char* pathname) {
-    if (pathname == NULL) {
+int64_t sys_rmdir(const char* upath) {
+    char pathname[SYSCALL_PATH_MAX];
+    if (upath == NULL || strncpy_from_user(pathname, upath, sizeof(pathname)) < 0) {
         return -1;
     }
     return fat32_remove_directory(pathname);
@@ -578,8 +688,9 @@ int64_t sys_rmdir(const char* pathname) {
  * @pathname: path to the file
  * @return: 0 on success, -1 on error
  */
-int64_t sys_unlink(const char* pathname) {
-    if (pathname == NULL) {
+int64_t sys_unlink(const char* upath) {
+    char pathname[SYSCALL_PATH_MAX];
+    if (upath == NULL || strncpy_from_user(pathname, upath, sizeof(pathname)) < 0) {
         return -1;
     }
     return fat32_delete_file(pathname);
@@ -590,8 +701,9 @@ int64_t sys_unlink(const char* pathname) {
  * @path: path to the new directory
  * @return: 0 on success, -1 on error
  */
-int64_t sys_chdir(const char* path) {
-    if (path == NULL) {
+int64_t sys_chdir(const char* upath) {
+    char path[SYSCALL_PATH_MAX];
+    if (upath == NULL || strncpy_from_user(path, upath, sizeof(path)) < 0) {
         return -1;
     }
     return fat32_change_directory_path(path);
@@ -607,6 +719,9 @@ int64_t sys_getcwd(char* buf, size_t size) {
     if (buf == NULL || size == 0) {
         return -1;
     }
+    if (!mm_access_ok(buf, size, 1)) {
+        return -1;
+    }
     fat32_get_current_path(buf, (int)size);
     return 0;
 }
@@ -617,12 +732,8 @@ int64_t sys_getcwd(char* buf, size_t size) {
  * @return: 0 on success
  */
 int64_t sys_sleep(uint32_t milliseconds) {
-    // Simple busy-wait implementation
-    // TODO: Use proper timer interrupt for better sleeping
-    volatile uint32_t i;
-    for (i = 0; i < milliseconds * 10000; i++) {
-        __asm__ volatile("nop");
-    }
+    // The task blocks on a timer and the CPU runs something else meanwhile
+    scheduler_sleep_ns((uint64_t)milliseconds * 1000000);
     return 0;
 }
 
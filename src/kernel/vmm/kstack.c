@@ -0,0 +1,112 @@
+/* src/kernel/vmm/kstack.c */
+// Kernel stacks mapped in the kernel half, one slot per stack: an unmapped guard page followed by
+// KSTACK_SIZE bytes of stack. There is no cross-CPU TLB shootdown, so a stack is never unmapped
+// once made; freed stacks go to a small per-CPU cache, then to a shared pool, and are reused.
+#include <kernel/arch/x86_64/kstack.h>
+#include <kernel/arch/x86_64/vmm.h>
+#include <kernel/arch/x86_64/pmm.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/sys/spinlock.h>
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+#define KSTACK_SLOT (KSTACK_SIZE + PAGE_SIZE)
+// Virtual room for stacks; slots are handed out in order and only take memory once used
+#define KSTACK_MAX_SLOTS 65536
+
+typedef struct {
+    void *stacks[KSTACK_CACHE];
+    int count;
+    uint64_t hits;
+} kstack_cache_t;
+
+static kstack_cache_t caches[SMP_MAX_CPUS];
+
+// Pooled stacks are linked through their lowest word
+static spinlock_t pool_lock = SPINLOCK_INIT;
+static void *pool = NULL;
+static uint64_t pooled = 0;
+static uint64_t pool_hits = 0;
+static uint64_t slots_used = 0;
+
+// Map a fresh slot. Called with pool_lock held.
+static void *kstack_create(void) {
+    if (slots_used >= KSTACK_MAX_SLOTS) return NULL;
+    void *frames = pmm_alloc_pages(KSTACK_ORDER);
+    if (!frames) return NULL;
+    // The slot's first page stays unmapped as the guard
+    uint64_t base = VMM_KSTACK_BASE + slots_used * KSTACK_SLOT + PAGE_SIZE;
+    if (vmm_map_range(base, (uint64_t)(uintptr_t)frames, KSTACK_SIZE, VMM_PFLAG_WRITE) != 0) {
+        pmm_free_pages_order(frames, KSTACK_ORDER);
+        return NULL;
+    }
+    slots_used++;
+    return (void *)(uintptr_t)base;
+}
+
+void *kstack_alloc(void) {
+    uint64_t flags = irq_save();
+    kstack_cache_t *c = &caches[smp_cpu_id()];
+    void *stack = NULL;
+    if (c->count > 0) {
+        stack = c->stacks[--c->count];
+        c->hits++;
+    }
+    irq_restore(flags);
+    if (stack) return stack;
+
+    flags = spin_lock_irqsave(&pool_lock);
+    if (pool) {
+        stack = pool;
+        pool = *(void **)stack;
+        pooled--;
+        pool_hits++;
+    } else {
+        stack = kstack_create();
+    }
+    spin_unlock_irqrestore(&pool_lock, flags);
+    return stack;
+}
+
+void kstack_free(void *base) {
+    if (!base) return;
+    uint64_t flags = irq_save();
+    kstack_cache_t *c = &caches[smp_cpu_id()];
+    int kept = 0;
+    if (c->count < KSTACK_CACHE) {
+        c->stacks[c->count++] = base;
+        kept = 1;
+    }
+    irq_restore(flags);
+    if (kept) return;
+
+    flags = spin_lock_irqsave(&pool_lock);
+    *(void **)base = pool;
+    pool = base;
+    pooled++;
+    spin_unlock_irqrestore(&pool_lock, flags);
+}
+
+int kstack_is_guard(uint64_t addr) {
+    if (addr < VMM_KSTACK_BASE) return 0;
+    uint64_t slot = (addr - VMM_KSTACK_BASE) / KSTACK_SLOT;
+    if (slot >= __atomic_load_n(&slots_used, __ATOMIC_RELAXED)) return 0;
+    return (addr - VMM_KSTACK_BASE) % KSTACK_SLOT < PAGE_SIZE;
+}
+
+void kstack_get_stats(kstack_stats_t *out) {
+    if (!out) return;
+    out->cached = 0;
+    out->cache_hits = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+        out->cached += (uint64_t)caches[cpu].count;
+        out->cache_hits += caches[cpu].hits;
+    }
+    uint64_t flags = spin_lock_irqsave(&pool_lock);
+    out->created = slots_used;
+    out->pooled = pooled;
+    out->pool_hits = pool_hits;
+    spin_unlock_irqrestore(&pool_lock, flags);
+    uint64_t idle = out->cached + out->pooled;
+    out->in_use = out->created > idle ? out->created - idle : 0;
+}
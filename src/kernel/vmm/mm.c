@@ -0,0 +1,206 @@
+/* src/kernel/vmm/mm.c */
+// Demand paging for user address spaces: regions are recorded when an image is loaded
+// and their pages are allocated and filled from the page-fault handler on first touch.
+#include <kernel/arch/x86_64/mm.h>
+#include <kernel/arch/x86_64/vmm.h>
+#include <kernel/arch/x86_64/pmm.h>
+#include <kernel/sys/kmalloc.h>
+#include <kernel/sys/string.h>
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+
+// Page-fault error code bits
+#define PF_PRESENT 0x1
+#define PF_WRITE   0x2
+
+static mm_t *mm_list = NULL;
+
+mm_t *mm_create(uint64_t cr3) {
+    mm_t *mm = (mm_t *)kmalloc(sizeof(mm_t));
+    if (!mm) return NULL;
+    mm->cr3 = cr3 & VMM_CR3_ADDR_MASK;
+    mm->regions = NULL;
+    mm->faults = 0;
+    mm->cow_faults = 0;
+    mm->next = mm_list;
+    mm_list = mm;
+    return mm;
+}
+
+mm_t *mm_find(uint64_t cr3) {
+    cr3 &= VMM_CR3_ADDR_MASK;
+    for (mm_t *mm = mm_list; mm; mm = mm->next) {
+        if (mm->cr3 == cr3) return mm;
+    }
+    return NULL;
+}
+
+int mm_add_region(mm_t *mm, uint64_t start, uint64_t end, uint64_t pte_flags,
+                  const fat32_file_t *file, uint64_t file_va, uint64_t file_end, uint32_t file_offset) {
+    if (!mm || start >= end || ((start | end) & (PAGE_SIZE - 1))) return -1;
+    if (!vmm_is_user_range(start, end - start)) return -1;
+    vm_region_t *r = (vm_region_t *)kmalloc(sizeof(vm_region_t));
+    if (!r) return -1;
+    r->start = start;
+    r->end = end;
+    r->pte_flags = pte_flags;
+    r->has_file = (file != NULL && file_end > file_va);
+    r->file_va = file_va;
+    r->file_end = file_end;
+    r->file_offset = file_offset;
+    if (r->has_file) r->file = *file;
+    // Keep regions in load order. Segments rounded out to pages may share their edge page with the
+    // next one; such a page gets the bytes and flags of every region covering it (mm_handle_fault).
+    r->next = NULL;
+    vm_region_t **pp = &mm->regions;
+    while (*pp) pp = &(*pp)->next;
+    *pp = r;
+    return 0;
+}
+
+void mm_destroy(mm_t *mm) {
+    if (!mm) return;
+    for (mm_t **pp = &mm_list; *pp; pp = &(*pp)->next) {
+        if (*pp == mm) {
+            *pp = mm->next;
+            break;
+        }
+    }
+    vm_region_t *r = mm->regions;
+    while (r) {
+        vm_region_t *next = r->next;
+        kfree(r);
+        r = next;
+    }
+    kfree(mm);
+}
+
+mm_t *mm_fork(mm_t *src, uint64_t cr3) {
+    if (!src) return NULL;
+    mm_t *mm = mm_create(cr3);
+    if (!mm) return NULL;
+    for (vm_region_t *r = src->regions; r; r = r->next) {
+        if (mm_add_region(mm, r->start, r->end, r->pte_flags, r->has_file ? &r->file : NULL,
+                          r->file_va, r->file_end, r->file_offset) != 0) {
+            mm_destroy(mm);
+            return NULL;
+        }
+    }
+    // Pages the parent has not touched yet stay lazy in the child as well
+    if (vmm_cow_share(mm->cr3, src->cr3) != 0) {
+        vmm_unmap_user(mm->cr3, 1);
+        mm_destroy(mm);
+        return NULL;
+    }
+    return mm;
+}
+
+// Copy the file-backed part of the page at `page_va` into the frame at `frame`
+static int fill_from_file(vm_region_t *r, uint64_t page_va, uint8_t *frame) {
+    uint64_t from = page_va > r->file_va ? page_va : r->file_va;
+    uint64_t to = page_va + PAGE_SIZE < r->file_end ? page_va + PAGE_SIZE : r->file_end;
+    if (from >= to) return 0;
+    fat32_file_t f = r->file;
+    if (fat32_seek_file(&f, r->file_offset + (uint32_t)(from - r->file_va)) != 0) return -1;
+    uint32_t want = (uint32_t)(to - from);
+    int got = fat32_read_file(&f, frame + (from - page_va), want);
+    return (got == (int)want) ? 0 : -1;
+}
+
+// PTE flags for the page holding `addr`: those of every region covering it, or 0 if none does.
+// `end` gets the end of the nearest covering region, which the caller may skip to.
+static uint64_t region_flags_at(mm_t *mm, uint64_t addr, uint64_t *end) {
+    uint64_t flags = 0;
+    uint64_t stop = UINT64_MAX;
+    for (vm_region_t *r = mm->regions; r; r = r->next) {
+        if (addr < r->start || addr >= r->end) continue;
+        flags |= r->pte_flags;
+        if (r->end < stop) stop = r->end;
+    }
+    if (end) *end = stop;
+    return flags;
+}
+
+int mm_handle_fault(uint64_t cr3, uint64_t addr, uint64_t error_code) {
+    mm_t *mm = mm_find(cr3);
+    if (!mm) return -1;
+    if (error_code & PF_PRESENT) {
+        // A write to a page shared by fork gets its own copy; other protection faults are real errors
+        if (!(error_code & PF_WRITE) || vmm_cow_fault(mm->cr3, addr) != 0) return -1;
+        mm->cow_faults++;
+        return 0;
+    }
+    uint64_t pte_flags = region_flags_at(mm, addr, NULL);
+    if (!pte_flags) return -1;
+
+    uint64_t page_va = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint8_t *frame = (uint8_t *)pmm_alloc_page();
+    if (!frame) return -1;
+    memset_k(frame, 0, PAGE_SIZE);
+    // Regions are page-aligned, so those covering `addr` are exactly those overlapping the page
+    for (vm_region_t *r = mm->regions; r; r = r->next) {
+        if (addr < r->start || addr >= r->end || !r->has_file) continue;
+        if (fill_from_file(r, page_va, frame) != 0) {
+            pmm_free_page(frame);
+            return -1;
+        }
+    }
+    // Not-present entries are never cached, so the new mapping needs no flush
+    if (vmm_map_page_in_table(mm->cr3, page_va, (uint64_t)(uintptr_t)frame, pte_flags) != 0) {
+        pmm_free_page(frame);
+        return -1;
+    }
+    mm->faults++;
+    return 0;
+}
+
+int mm_access_ok(const void *uaddr, size_t len, int write) {
+    mm_t *mm = mm_find(vmm_get_cr3());
+    // Kernel threads run on the kernel table and hand in kernel buffers
+    if (!mm) return 1;
+    uint64_t addr = (uint64_t)(uintptr_t)uaddr;
+    if (len == 0) return 1;
+    if (!vmm_is_user_range(addr, len)) return 0;
+    // Every byte must fall in a region; its pages may still be lazy or shared, the fault handler sorts that out
+    uint64_t end = addr + len;
+    while (addr < end) {
+        uint64_t next;
+        uint64_t flags = region_flags_at(mm, addr, &next);
+        if (!flags || (write && !(flags & VMM_PFLAG_WRITE))) return 0;
+        addr = next;
+    }
+    return 1;
+}
+
+int copy_to_user(void *udst, const void *src, size_t len) {
+    if (!mm_access_ok(udst, len, 1)) return -1;
+    uint8_t *d = (uint8_t *)udst;
+    const uint8_t *s = (const uint8_t *)src;
+    while (len--) *d++ = *s++;
+    return 0;
+}
+
+int copy_from_user(void *dst, const void *usrc, size_t len) {
+    if (!mm_access_ok(usrc, len, 0)) return -1;
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)usrc;
+    while (len--) *d++ = *s++;
+    return 0;
+}
+
+int strncpy_from_user(char *dst, const char *usrc, size_t max) {
+    uint64_t addr = (uint64_t)(uintptr_t)usrc;
+    size_t len = 0;
+    // The string's length is unknown up front: check it a page at a time, never past `max`
+    while (len < max) {
+        size_t chunk = PAGE_SIZE - (size_t)((addr + len) & (PAGE_SIZE - 1));
+        if (chunk > max - len) chunk = max - len;
+        if (!mm_access_ok(usrc + len, chunk, 0)) return -1;
+        for (size_t end = len + chunk; len < end; ++len) {
+            dst[len] = usrc[len];
+            if (!dst[len]) return (int)len;
+        }
+    }
+    return -1;
+}
@@ -4,6 +4,11 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <kernel/sys/string.h>
+#include <kernel/sys/tty.h>
+#include <cpu/cpuid.h>
+#include <kernel/sys/kmalloc.h>
+#include <kernel/sys/spinlock.h>
+#include <kernel/arch/x86_64/tsc.h>
 
 // Each page table is 4096 bytes and contains 512 8-byte entries
 #define ENTRIES_PER_TABLE 512
@@ -51,8 +56,128 @@ void vmm_set_cr3(uint64_t cr3) {
     __asm__ volatile ("mov %0, %%cr3" :: "r" (cr3));
 }
 
-void vmm_init(void) {
-    // Nothing required if bootloader already created identity page tables and enabled paging
+// Top-level table of the active address space (CR3 minus PCID bits)
+static inline uint64_t *active_pml4(void) {
+    return (uint64_t *)(uintptr_t)(vmm_get_cr3() & ENTRY_ADDR_MASK);
+}
+
+// PCID support: user address spaces get a 12-bit tag so switching to them does not flush the TLB.
+// PCID 0 belongs to the kernel. Tags are handed out in order; when they run out the generation
+// is bumped, every PCID is flushed once and address spaces pick up fresh tags on their next switch.
+#define CR0_WP (1ULL << 16)
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+#define PCID_MAX 4095
+
+static int pcid_enabled = 0;
+static int pge_enabled = 0;
+static uint64_t cr3_switch_count = 0;
+static uint64_t cr3_flushing_count = 0;
+static uint16_t pcid_next = 1;
+static uint32_t pcid_generation = 1;
+static int pcid_kernel_stale = 0;   // kernel mappings were invalidated under another PCID
+static uint64_t *kernel_pml4 = NULL; // table every user address space shares its kernel mappings with
+
+static inline uint64_t read_cr4(void) {
+    uint64_t v;
+    __asm__ volatile ("mov %%cr4, %0" : "=r" (v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v) {
+    __asm__ volatile ("mov %0, %%cr4" :: "r" (v) : "memory");
+}
+
+// Drop TLB entries of every PCID. Toggling CR4.PGE does this without touching CR3.
+static void flush_all_pcids(void) {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
+static void pcid_init(void) {
+    uint32_t ecx = 0;
+    cpuid(1, 0, 0, 0, &ecx, 0);
+    // CR4.PCIDE may only be set while CR3[11:0] is zero, which holds for the boot tables
+    if (!((ecx >> 17) & 1) || (vmm_get_cr3() & 0xFFF)) return;
+    write_cr4(read_cr4() | CR4_PCIDE);
+    pcid_enabled = 1;
+}
+
+int vmm_pcid_enabled(void) {
+    return pcid_enabled;
+}
+
+static uint64_t pcid_cr3(uint64_t cr3, uint16_t *pcid, uint32_t *gen) {
+    cr3 &= ENTRY_ADDR_MASK;
+    if (!pcid_enabled) return cr3;
+    if (!pcid) {
+        // Kernel address space: keep its TLB entries unless something was invalidated behind its back
+        if (pcid_kernel_stale) {
+            pcid_kernel_stale = 0;
+            return cr3;
+        }
+        return cr3 | VMM_CR3_NOFLUSH;
+    }
+    if (*pcid && *gen == pcid_generation) return cr3 | *pcid | VMM_CR3_NOFLUSH;
+    if (pcid_next > PCID_MAX) {
+        pcid_generation++;
+        pcid_next = 1;
+        flush_all_pcids();
+    }
+    *pcid = pcid_next++;
+    *gen = pcid_generation;
+    // First load under a recycled tag flushes whatever its previous owner left behind
+    return cr3 | *pcid;
+}
+
+uint64_t vmm_pcid_cr3(uint64_t cr3, uint16_t *pcid, uint32_t *gen) {
+    uint64_t v = pcid_cr3(cr3, pcid, gen);
+    // A flushing load costs the target a TLB refill of everything that is not global
+    cr3_switch_count++;
+    if (!(v & VMM_CR3_NOFLUSH)) cr3_flushing_count++;
+    return v;
+}
+
+// The bootloader identity maps the first 4 GiB with 2 MiB pages
+#define BOOT_IDENTITY_LIMIT (4ULL * 1024 * 1024 * 1024)
+#define PAGE_4K 4096ULL
+#define PAGE_2M (2ULL * 1024 * 1024)
+#define PAGE_1G (1024ULL * 1024 * 1024)
+
+// Leaf flag bits we pass through: the low 12 bits and NX
+#define LEAF_FLAGS_MASK (0xFFFULL | (1ULL << 63))
+// PAT selector sits in bit 7 of a 4 KiB PTE but in bit 12 of a 2 MiB/1 GiB leaf
+#define PTE_PAT_4K (1ULL << 7)
+#define PTE_PAT_LARGE (1ULL << 12)
+
+static int gib_pages_supported = 0;
+static uint64_t split_count[2];      // [0] 2 MiB -> 4 KiB, [1] 1 GiB -> 2 MiB
+static uint64_t invlpg_count = 0;
+static uint64_t full_flush_count = 0;
+static uint64_t cow_shared_count = 0;
+static uint64_t cow_copy_count = 0;
+static uint64_t cow_reuse_count = 0;
+
+// Only for translations that were present: not-present entries are never cached. Removing a
+// kernel mapping also needs a new PCID generation, which the gather takes care of (gather_flush).
+static inline void invlpg(uint64_t va) {
+    __asm__ volatile ("invlpg (%0)" :: "r" (va) : "memory");
+    invlpg_count++;
+    // invlpg only reaches the current PCID; make the kernel's next switch-in flush
+    if (pcid_enabled && (vmm_get_cr3() & 0xFFF)) pcid_kernel_stale = 1;
+}
+
+// Drop every non-global TLB entry of the current address space
+static void flush_tlb_local(void) {
+    uint64_t cr3 = vmm_get_cr3();
+    vmm_set_cr3(cr3 & ~VMM_CR3_NOFLUSH);
+    full_flush_count++;
+    if (pcid_enabled && (cr3 & 0xFFF)) pcid_kernel_stale = 1;
+}
+
+static inline uint64_t *entry_table(uint64_t entry) {
+    return (uint64_t *)(uintptr_t)(entry & ENTRY_ADDR_MASK);
 }
 
 // Ensure the physical page for 'entry' exists and return pointer to its table
@@ -76,69 +201,486 @@ static uint64_t *ensure_table(uint64_t *entry) {
     return (uint64_t *)(uintptr_t)pa;
 }
 
-int vmm_map_page(uint64_t vaddr, uint64_t paddr, uint64_t flags) {
-    uint64_t *pml4 = (uint64_t *)(uintptr_t)vmm_get_cr3();
-    
-    size_t i4 = idx_pml4(vaddr);
-    uint64_t *pdp = ensure_table(&pml4[i4]); 
+// Replace a 1 GiB (level 3) or 2 MiB (level 2) leaf by a table of 512 next-size leaves
+// covering the same memory with the same attributes
+static uint64_t *split_large(uint64_t *entry, int level) {
+    uint64_t old = *entry;
+    uint64_t *tbl = alloc_table();
+    if (!tbl) return NULL;
+    uint64_t base = old & ENTRY_ADDR_MASK & ~(PTE_PAT_LARGE);
+    uint64_t step = (level == 3) ? PAGE_2M : PAGE_4K;
+    uint64_t attrs = old & LEAF_FLAGS_MASK;
+    if (level == 2) {
+        // 4 KiB PTEs have no PS bit; move PAT to where a PTE keeps it
+        attrs &= ~VMM_PFLAG_HUGE;
+        if (old & PTE_PAT_LARGE) attrs |= PTE_PAT_4K;
+    } else {
+        attrs |= (old & PTE_PAT_LARGE);
+    }
+    for (int i = 0; i < ENTRIES_PER_TABLE; ++i) tbl[i] = (base + (uint64_t)i * step) | attrs;
+    *entry = ((uint64_t)(uintptr_t)tbl & ENTRY_ADDR_MASK) | (old & (VMM_PFLAG_PRESENT | VMM_PFLAG_WRITE | VMM_PFLAG_USER));
+    split_count[level - 2]++;
+    return tbl;
+}
+
+// Page-table edits collect their work in a gather: the addresses to invalidate, the page-table
+// pages that were dropped and, optionally, the frames behind the removed leaves. Nothing is freed
+// before the TLB has been flushed, and the flush happens once per batch instead of per page.
+#define GATHER_LEAVES 32   // past this many leaves a full flush is cheaper than invlpg each
+#define GATHER_TABLES 32
+#define GATHER_FRAMES 64
+
+typedef struct {
+    int active;            // the tables being edited are the live ones
+    int free_frames;
+    int full_flush;
+    int shared;            // a kernel mapping shared with the user tables was removed or replaced
+    uint32_t nr_leaves;
+    uint32_t nr_tables;
+    uint32_t nr_frames;
+    uint64_t leaf_va[GATHER_LEAVES];
+    uint64_t *tables[GATHER_TABLES];
+    uint64_t frame_pa[GATHER_FRAMES];
+    uint64_t frame_pages[GATHER_FRAMES];
+} vmm_gather_t;
+
+static void gather_flush(vmm_gather_t *g) {
+    if (g->active) {
+        if (g->full_flush && g->shared && pge_enabled) {
+            // A CR3 reload keeps global entries; toggling PGE drops them too
+            flush_all_pcids();
+            full_flush_count++;
+        } else if (g->full_flush) {
+            flush_tlb_local();
+        } else {
+            for (uint32_t i = 0; i < g->nr_leaves; ++i) invlpg(g->leaf_va[i]);
+        }
+    } else if (pcid_enabled && (g->nr_leaves || g->full_flush)) {
+        // The edited space may still have entries cached under its own PCID
+        flush_all_pcids();
+        full_flush_count++;
+    }
+    // Start a new PCID generation so user address spaces flush their copies of shared entries
+    if (g->shared && pcid_enabled) pcid_generation++;
+    for (uint32_t i = 0; i < g->nr_tables; ++i) pmm_free_page(g->tables[i]);
+    for (uint32_t i = 0; i < g->nr_frames; ++i) {
+        for (uint64_t p = 0; p < g->frame_pages[i]; ++p) pmm_free_page((void *)(uintptr_t)(g->frame_pa[i] + p * PAGE_4K));
+    }
+    g->full_flush = g->shared = 0;
+    g->nr_leaves = g->nr_tables = g->nr_frames = 0;
+}
+
+static void gather_leaf(vmm_gather_t *g, uint64_t va, uint64_t entry, uint64_t size) {
+    if (g->nr_leaves < GATHER_LEAVES) g->leaf_va[g->nr_leaves++] = va;
+    else g->full_flush = 1;
+    if (!vmm_is_user_range(va, size)) g->shared = 1;
+    if (!g->free_frames) return;
+    uint64_t pa = entry & ENTRY_ADDR_MASK;
+    if (size != PAGE_4K) pa &= ~PTE_PAT_LARGE;
+    // Physically contiguous leaves extend the previous run
+    if (g->nr_frames && g->frame_pa[g->nr_frames - 1] + g->frame_pages[g->nr_frames - 1] * PAGE_4K == pa) {
+        g->frame_pages[g->nr_frames - 1] += size / PAGE_4K;
+        return;
+    }
+    if (g->nr_frames == GATHER_FRAMES) gather_flush(g);
+    g->frame_pa[g->nr_frames] = pa;
+    g->frame_pages[g->nr_frames++] = size / PAGE_4K;
+}
+
+static void gather_table(vmm_gather_t *g, uint64_t *tbl) {
+    if (g->nr_tables == GATHER_TABLES) gather_flush(g);
+    g->tables[g->nr_tables++] = tbl;
+}
+
+// Hand a page table and, below level 2, the tables it points to (level: 1 = PT, 2 = PD) to the
+// gather; they are freed once no TLB can still walk through them
+static void gather_table_tree(vmm_gather_t *g, uint64_t *tbl, int level) {
+    if (level > 1) {
+        for (int i = 0; i < ENTRIES_PER_TABLE; ++i) {
+            if ((tbl[i] & VMM_PFLAG_PRESENT) && !(tbl[i] & VMM_PFLAG_HUGE)) gather_table_tree(g, entry_table(tbl[i]), level - 1);
+        }
+    }
+    gather_table(g, tbl);
+}
+
+static void gather_init(vmm_gather_t *g, int active, int free_frames) {
+    g->active = active;
+    g->free_frames = free_frames;
+    g->full_flush = g->shared = 0;
+    g->nr_leaves = g->nr_tables = g->nr_frames = 0;
+}
+
+// Return the next-level table behind `entry`, creating it or splitting a large leaf as needed
+static uint64_t *next_table(uint64_t *entry, int level) {
+    if ((*entry & VMM_PFLAG_PRESENT) && (*entry & VMM_PFLAG_HUGE) && level > 1) {
+        uint64_t *tbl = split_large(entry, level);
+        if (!tbl) return NULL;
+        *entry |= (VMM_PFLAG_USER | VMM_PFLAG_WRITE);
+        return tbl;
+    }
+    return ensure_table(entry);
+}
+
+// Supervisor leaves outside the user windows are the same in every address space and can be global.
+// Anything overlapping a user window must stay non-global: user tables map other pages there.
+static int kernel_leaf(uint64_t va, uint64_t size, uint64_t leaf) {
+    if (!pge_enabled || (leaf & VMM_PFLAG_USER)) return 0;
+    if (va < VMM_USER_IMAGE_END && va + size > VMM_USER_BASE) return 0;
+    if (va < VMM_USER_TOP && va + size > VMM_USER_HIGH_BASE) return 0;
+    return 1;
+}
+
+// Install the large leaf `leaf` spanning `size` bytes from va in `*e`. A sub-table it replaces
+// may still have small leaves cached anywhere in the span, so the whole TLB goes.
+static void replace_table(uint64_t *e, uint64_t leaf, int level, uint64_t va, uint64_t size, vmm_gather_t *g) {
+    uint64_t old = *e;
+    *e = leaf;
+    if (!(old & VMM_PFLAG_PRESENT)) return;
+    if (old & VMM_PFLAG_HUGE) {
+        gather_leaf(g, va, old, size);
+        return;
+    }
+    g->full_flush = 1;
+    if (!vmm_is_user_range(va, size)) g->shared = 1;
+    gather_table_tree(g, entry_table(old), level);
+}
+
+// Install one leaf of `size` bytes for va -> pa in `pml4`. Page-table pages it drops go to `g`.
+static int map_leaf(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t size, uint64_t flags, vmm_gather_t *g) {
+    uint64_t leaf = (flags & LEAF_FLAGS_MASK & ~VMM_PFLAG_HUGE) | VMM_PFLAG_PRESENT;
+    if (kernel_leaf(va, size, leaf)) leaf |= VMM_PFLAG_GLOBAL;
+    uint64_t *pdp = next_table(&pml4[idx_pml4(va)], 4);
     if (!pdp) return -1;
-    
-    size_t i3 = idx_pdp(vaddr);
-    uint64_t *pd = ensure_table(&pdp[i3]); 
+    uint64_t *e = &pdp[idx_pdp(va)];
+    if (size == PAGE_1G) {
+        if (leaf & PTE_PAT_4K) leaf = (leaf & ~PTE_PAT_4K) | PTE_PAT_LARGE;
+        replace_table(e, (pa & ENTRY_ADDR_MASK) | leaf | VMM_PFLAG_HUGE, 2, va, size, g);
+        return 0;
+    }
+    uint64_t *pd = next_table(e, 3);
     if (!pd) return -1;
-    
-    size_t i2 = idx_pd(vaddr);
-    uint64_t *pt = ensure_table(&pd[i2]); 
+    e = &pd[idx_pd(va)];
+    if (size == PAGE_2M) {
+        if (leaf & PTE_PAT_4K) leaf = (leaf & ~PTE_PAT_4K) | PTE_PAT_LARGE;
+        replace_table(e, (pa & ENTRY_ADDR_MASK) | leaf | VMM_PFLAG_HUGE, 1, va, size, g);
+        return 0;
+    }
+    uint64_t *pt = next_table(e, 2);
     if (!pt) return -1;
-    
-    size_t i1 = idx_pt(vaddr);
-    
-    // Set the leaf PTE with the specific flags requested (e.g., code might not be writable)
-    uint64_t entry = (paddr & ENTRY_ADDR_MASK) | (flags & 0xFFF) | VMM_PFLAG_PRESENT;
-    pt[i1] = entry;
-    
-    // Flush TLB for that page
-    __asm__ volatile ("invlpg (%0)" :: "r" (vaddr) : "memory");
+    e = &pt[idx_pt(va)];
+    // A fresh mapping needs no flush; a replaced one does
+    if (*e & VMM_PFLAG_PRESENT) gather_leaf(g, va, *e, PAGE_4K);
+    *e = (pa & ENTRY_ADDR_MASK) | leaf;
     return 0;
 }
 
-int vmm_unmap_page(uint64_t vaddr) {
-    uint64_t *pml4 = (uint64_t *)(uintptr_t)vmm_get_cr3();
-    
-    size_t i4 = idx_pml4(vaddr);
-    uint64_t pml4e = pml4[i4]; 
-    if (!(pml4e & VMM_PFLAG_PRESENT)) return -1;
-    
-    uint64_t *pdp = (uint64_t *)(uintptr_t)(pml4e & ENTRY_ADDR_MASK);
-    size_t i3 = idx_pdp(vaddr);
-    uint64_t pdpe = pdp[i3]; 
-    if (!(pdpe & VMM_PFLAG_PRESENT)) return -1;
-    
-    uint64_t *pd = (uint64_t *)(uintptr_t)(pdpe & ENTRY_ADDR_MASK);
-    size_t i2 = idx_pd(vaddr);
-    uint64_t pde = pd[i2]; 
-    if (!(pde & VMM_PFLAG_PRESENT)) return -1;
-    
-    uint64_t *pt = (uint64_t *)(uintptr_t)(pde & ENTRY_ADDR_MASK);
-    size_t i1 = idx_pt(vaddr);
-    
-    pt[i1] = 0;
-    
-    __asm__ volatile ("invlpg (%0)" :: "r" (vaddr) : "memory");
+// Find the leaf entry mapping `va`; *size receives the leaf size. NULL if unmapped.
+static uint64_t *find_leaf(uint64_t *pml4, uint64_t va, uint64_t *size) {
+    uint64_t e = pml4[idx_pml4(va)];
+    if (!(e & VMM_PFLAG_PRESENT)) return NULL;
+    uint64_t *pdp = entry_table(e);
+    uint64_t *pe = &pdp[idx_pdp(va)];
+    if (!(*pe & VMM_PFLAG_PRESENT)) return NULL;
+    if (*pe & VMM_PFLAG_HUGE) { *size = PAGE_1G; return pe; }
+    uint64_t *pd = entry_table(*pe);
+    pe = &pd[idx_pd(va)];
+    if (!(*pe & VMM_PFLAG_PRESENT)) return NULL;
+    if (*pe & VMM_PFLAG_HUGE) { *size = PAGE_2M; return pe; }
+    uint64_t *pt = entry_table(*pe);
+    pe = &pt[idx_pt(va)];
+    if (!(*pe & VMM_PFLAG_PRESENT)) return NULL;
+    *size = PAGE_4K;
+    return pe;
+}
+
+// Largest leaf usable at va/pa with `len` bytes left
+static uint64_t pick_leaf(uint64_t va, uint64_t pa, uint64_t len) {
+    if (gib_pages_supported && !((va | pa) & (PAGE_1G - 1)) && len >= PAGE_1G) return PAGE_1G;
+    if (!((va | pa) & (PAGE_2M - 1)) && len >= PAGE_2M) return PAGE_2M;
+    return PAGE_4K;
+}
+
+static int table_empty(uint64_t *tbl) {
+    for (int i = 0; i < ENTRIES_PER_TABLE; ++i) {
+        if (tbl[i]) return 0;
+    }
+    return 1;
+}
+
+// Clear every leaf in [va, end) under `tbl` (level 4 = PML4 ... 1 = PT). Returns 1 if the table
+// ended up empty, 0 if not, -1 if a large page could not be split.
+static int unmap_level(uint64_t *tbl, int level, uint64_t va, uint64_t end, vmm_gather_t *g) {
+    uint64_t span = PAGE_4K << (9 * (level - 1));
+    size_t idx = (va >> (12 + 9 * (level - 1))) & 0x1FF;
+    for (; va < end && idx < ENTRIES_PER_TABLE; ++idx) {
+        uint64_t *e = &tbl[idx];
+        uint64_t slot = va & ~(span - 1);
+        uint64_t stop = (end < slot + span) ? end : slot + span;
+        if (*e & VMM_PFLAG_PRESENT) {
+            if (level == 1 || (*e & VMM_PFLAG_HUGE)) {
+                if (va == slot && stop == slot + span) {
+                    gather_leaf(g, slot, *e, span);
+                    *e = 0;
+                } else {
+                    // Only part of a large page goes away: break it down first
+                    uint64_t *sub = split_large(e, level);
+                    if (!sub) return -1;
+                    if (unmap_level(sub, level - 1, va, stop, g) < 0) return -1;
+                    g->full_flush = 1;   // the old large entry may still be cached
+                }
+            } else {
+                uint64_t *sub = entry_table(*e);
+                int r = unmap_level(sub, level - 1, va, stop, g);
+                if (r < 0) return -1;
+                // Kernel-half PDPs stay: their PML4 slots are meant to be shared between address spaces
+                if (r == 1 && !(level == 4 && idx >= 256)) {
+                    *e = 0;
+                    gather_table(g, sub);
+                }
+            }
+        }
+        va = stop;
+    }
+    return table_empty(tbl);
+}
+
+static int unmap_range_in(uint64_t *pml4, uint64_t va, uint64_t len, int free_frames, int active) {
+    vmm_gather_t g;
+    gather_init(&g, active, free_frames);
+    int r = unmap_level(pml4, 4, va, va + len, &g);
+    gather_flush(&g);
+    return r < 0 ? -1 : 0;
+}
+
+int vmm_unmap_range(uint64_t va, uint64_t len, int free_frames) {
+    if ((va | len) & (PAGE_4K - 1)) return -1;
+    return unmap_range_in(active_pml4(), va, len, free_frames, 1);
+}
+
+int vmm_unmap_range_in_table(uint64_t target_cr3, uint64_t va, uint64_t len, int free_frames) {
+    if ((va | len) & (PAGE_4K - 1)) return -1;
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)(target_cr3 & ENTRY_ADDR_MASK);
+    int active = (target_cr3 & ENTRY_ADDR_MASK) == (vmm_get_cr3() & ENTRY_ADDR_MASK);
+    return unmap_range_in(pml4, va, len, free_frames, active);
+}
+
+static int map_range_in(uint64_t *pml4, uint64_t va, uint64_t pa, uint64_t len, uint64_t flags, int flush) {
+    uint64_t start = va;
+    uint64_t end = va + len;
+    vmm_gather_t g;
+    gather_init(&g, flush, 0);
+    while (va < end) {
+        uint64_t size = pick_leaf(va, pa, end - va);
+        if (map_leaf(pml4, va, pa, size, flags, &g) != 0) {
+            // Out of page-table memory: take back the leaves installed so far
+            gather_flush(&g);
+            unmap_range_in(pml4, start, va - start, 0, flush);
+            return -1;
+        }
+        va += size;
+        pa += size;
+    }
+    gather_flush(&g);
     return 0;
 }
 
+int vmm_map_range(uint64_t va, uint64_t pa, uint64_t len, uint64_t flags) {
+    if ((va | pa | len) & (PAGE_4K - 1)) return -1;
+    return map_range_in(active_pml4(), va, pa, len, flags, 1);
+}
+
+int vmm_map_range_in_table(uint64_t target_cr3, uint64_t va, uint64_t pa, uint64_t len, uint64_t flags) {
+    if ((va | pa | len) & (PAGE_4K - 1)) return -1;
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)(target_cr3 & ENTRY_ADDR_MASK);
+    int active = (target_cr3 & ENTRY_ADDR_MASK) == (vmm_get_cr3() & ENTRY_ADDR_MASK);
+    return map_range_in(pml4, va, pa, len, flags, active);
+}
+
+static void count_table(uint64_t *tbl, int level, vmm_stats_t *st) {
+    st->table_pages++;
+    for (int i = 0; i < ENTRIES_PER_TABLE; ++i) {
+        uint64_t e = tbl[i];
+        if (!(e & VMM_PFLAG_PRESENT)) continue;
+        if ((level == 1 || (e & VMM_PFLAG_HUGE)) && (e & VMM_PFLAG_GLOBAL)) st->global_leaves++;
+        if (level == 1) st->pages_4k++;
+        else if (level == 2 && (e & VMM_PFLAG_HUGE)) st->pages_2m++;
+        else if (level == 3 && (e & VMM_PFLAG_HUGE)) st->pages_1g++;
+        else count_table(entry_table(e), level - 1, st);
+    }
+}
+
+void vmm_get_stats(vmm_stats_t *st) {
+    memset_k(st, 0, sizeof(*st));
+    count_table(active_pml4(), 4, st);
+    st->splits_2m = split_count[0];
+    st->splits_1g = split_count[1];
+    st->invlpg_flushes = invlpg_count;
+    st->full_flushes = full_flush_count;
+    st->cow_shared = cow_shared_count;
+    st->cow_copies = cow_copy_count;
+    st->cow_reuses = cow_reuse_count;
+    st->cr3_switches = cr3_switch_count;
+    st->cr3_flushing = cr3_flushing_count;
+    st->global_pages = pge_enabled;
+    st->gib_pages = gib_pages_supported;
+}
+
+// Set the Global bit on every kernel leaf under `tbl` (level 4 = PML4 ... 1 = PT) mapping va_base onwards
+static void mark_global(uint64_t *tbl, int level, uint64_t va_base) {
+    uint64_t span = PAGE_4K << (9 * (level - 1));
+    for (int i = 0; i < ENTRIES_PER_TABLE; ++i) {
+        uint64_t e = tbl[i];
+        uint64_t va = va_base + (uint64_t)i * span;
+        // Sign-extend into the upper half
+        if (level == 4 && i >= ENTRIES_PER_TABLE / 2) va |= 0xFFFF000000000000ULL;
+        if (!(e & VMM_PFLAG_PRESENT)) continue;
+        if (level > 1 && !(e & VMM_PFLAG_HUGE)) {
+            mark_global(entry_table(e), level - 1, va);
+            continue;
+        }
+        if (kernel_leaf(va, span, e)) tbl[i] = e | VMM_PFLAG_GLOBAL;
+    }
+}
+
+// Kernel mappings, the bootloader's 2 MiB identity map included, become global and CR4.PGE is
+// turned on, so kernel translations survive the CR3 loads of user switches
+static void pge_init(uint64_t *pml4) {
+    uint32_t edx = 0;
+    cpuid(1, 0, 0, 0, 0, &edx);
+    if (!((edx >> 13) & 1)) return;
+    pge_enabled = 1;
+    mark_global(pml4, 4, 0);
+    if (read_cr4() & CR4_PGE) flush_all_pcids();
+    else write_cr4(read_cr4() | CR4_PGE);
+}
+
+// Identity map the 1 GiB slot containing `pa` (kernel only) if it is not mapped yet
+static int identity_map_gib(uint64_t *pml4, uint64_t pa) {
+    uint64_t gib = pa & ~(PAGE_1G - 1);
+    uint64_t e = pml4[idx_pml4(gib)];
+    if ((e & VMM_PFLAG_PRESENT) && (entry_table(e)[idx_pdp(gib)] & VMM_PFLAG_PRESENT)) return 0;
+    return map_range_in(pml4, gib, gib, PAGE_1G, VMM_PFLAG_WRITE, 0);
+}
+
+void vmm_init(void) {
+    uint32_t edx = 0;
+    if (cpuid_max_ext() >= 0x80000001) cpuid(0x80000001, 0, 0, 0, 0, &edx);
+    gib_pages_supported = (edx >> 26) & 1;
+    pcid_init();
+    // CR0.WP: kernel writes to user pages honour read-only entries, so they break copy-on-write too
+    uint64_t cr0;
+    __asm__ volatile ("mov %%cr0, %0" : "=r" (cr0));
+    __asm__ volatile ("mov %0, %%cr0" :: "r" (cr0 | CR0_WP));
+    // The bootloader already created identity page tables for the low 4 GiB and enabled paging.
+    // Physical pages are used through their identity address, so extend that map to any RAM above it.
+    uint64_t *pml4 = active_pml4();
+    int extended = 0;
+    for (size_t i = 0; i < pmm_region_count(); ++i) {
+        uintptr_t base;
+        size_t pages;
+        pmm_get_region(i, &base, &pages);
+        uint64_t end = (uint64_t)base + (uint64_t)pages * PMM_PAGE_SIZE;
+        uint64_t pa = base < BOOT_IDENTITY_LIMIT ? BOOT_IDENTITY_LIMIT : (base & ~(PAGE_1G - 1));
+        for (; pa < end; pa += PAGE_1G) {
+            if (identity_map_gib(pml4, pa) != 0) {
+                tty_putstr("[VMM] Out of memory extending identity map\n");
+                return;
+            }
+            extended = 1;
+        }
+    }
+    if (extended) vmm_set_cr3(vmm_get_cr3());
+
+    // User tables copy the kernel half's PML4 entries once, when they are created. Give every
+    // kernel-half slot its PDP now so later kernel mappings show up in all of them.
+    kernel_pml4 = pml4;
+    for (int i = ENTRIES_PER_TABLE / 2; i < ENTRIES_PER_TABLE; ++i) {
+        if (pml4[i] & VMM_PFLAG_PRESENT) continue;
+        uint64_t *pdp = alloc_table();
+        if (!pdp) {
+            tty_putstr("[VMM] Out of memory preparing the kernel half\n");
+            return;
+        }
+        pml4[i] = ((uint64_t)(uintptr_t)pdp & ENTRY_ADDR_MASK) | VMM_PFLAG_PRESENT | VMM_PFLAG_WRITE;
+    }
+    pge_init(pml4);
+}
+
+void vmm_init_cpu(void) {
+    uint64_t cr0;
+    __asm__ volatile ("mov %%cr0, %0" : "=r" (cr0));
+    __asm__ volatile ("mov %0, %%cr0" :: "r" (cr0 | CR0_WP));
+    uint64_t cr4 = read_cr4();
+    if (pge_enabled) cr4 |= CR4_PGE;
+    if (pcid_enabled && !(vmm_get_cr3() & 0xFFF)) cr4 |= CR4_PCIDE;
+    write_cr4(cr4);
+}
+
+int vmm_map_page(uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    uint64_t *pml4 = active_pml4();
+    vmm_gather_t g;
+    gather_init(&g, 1, 0);
+    // Set the leaf PTE with the specific flags requested (e.g., code might not be writable)
+    int r = map_leaf(pml4, vaddr, paddr, PAGE_4K, flags, &g);
+    // Only flushes if the page was mapped before
+    gather_flush(&g);
+    return r;
+}
+
+int vmm_unmap_page(uint64_t vaddr) {
+    uint64_t *pml4 = active_pml4();
+    uint64_t size = PAGE_4K;
+    if (!find_leaf(pml4, vaddr, &size)) return -1;
+    // Splits a large page if needed, and starts a new PCID generation for a kernel page
+    return unmap_range_in(pml4, vaddr & ~(PAGE_4K - 1), PAGE_4K, 0, 1);
+}
+
 uint64_t vmm_clone_table(uint64_t src_cr3) {
-    // Create a fresh PML4 for user process with NO kernel mappings
-    // This prevents user code from accessing kernel memory
-    uint64_t *new_pml4 = alloc_table();
-    if (!new_pml4) return 0;
-
-    // Start with a completely empty page table
-    // User processes will explicitly map what they need via ELF loader
-    // We do NOT copy kernel mappings - this is more secure
-    
-    return (uint64_t)(uintptr_t)new_pml4;
+    (void)src_cr3;
+    if (!kernel_pml4) return 0;
+    uint64_t *kpdp = entry_table(kernel_pml4[0]);
+    uint64_t *kpd = entry_table(kpdp[0]);
+    uint64_t *pml4 = alloc_table();
+    uint64_t *pdp = alloc_table();
+    uint64_t *pd = alloc_table();
+    if (!pml4 || !pdp || !pd) {
+        if (pml4) pmm_free_page(pml4);
+        if (pdp) pmm_free_page(pdp);
+        if (pd) pmm_free_page(pd);
+        return 0;
+    }
+
+    // Only the first GiB holds a user window, so it gets a private PD that copies the kernel's
+    // low identity map around [VMM_USER_BASE, VMM_USER_IMAGE_END). The rest of PML4 entry 0 shares
+    // the kernel's tables; all of it maps supervisor-only pages.
+    for (size_t i = 0; i < ENTRIES_PER_TABLE; ++i) {
+        uint64_t va = (uint64_t)i * PAGE_2M;
+        if (va + PAGE_2M > VMM_USER_BASE && va < VMM_USER_IMAGE_END) continue;
+        pd[i] = kpd[i];
+    }
+    pdp[0] = ((uint64_t)(uintptr_t)pd & ENTRY_ADDR_MASK) | VMM_PFLAG_PRESENT | VMM_PFLAG_WRITE | VMM_PFLAG_USER;
+    for (size_t i = 1; i < ENTRIES_PER_TABLE; ++i) pdp[i] = kpdp[i];
+    pml4[0] = ((uint64_t)(uintptr_t)pdp & ENTRY_ADDR_MASK) | VMM_PFLAG_PRESENT | VMM_PFLAG_WRITE | VMM_PFLAG_USER;
+
+    // The kernel half is shared by pointing at the kernel's own PDPs
+    for (size_t i = ENTRIES_PER_TABLE / 2; i < ENTRIES_PER_TABLE; ++i) pml4[i] = kernel_pml4[i];
+    return (uint64_t)(uintptr_t)pml4;
+}
+
+int vmm_unmap_user(uint64_t cr3, int free_frames) {
+    int r = vmm_unmap_range_in_table(cr3, VMM_USER_BASE, VMM_USER_IMAGE_END - VMM_USER_BASE, free_frames);
+    if (vmm_unmap_range_in_table(cr3, VMM_USER_HIGH_BASE, VMM_USER_TOP - VMM_USER_HIGH_BASE, free_frames) != 0) r = -1;
+    return r;
+}
+
+void vmm_destroy_table(uint64_t cr3) {
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)(cr3 & ENTRY_ADDR_MASK);
+    vmm_unmap_user(cr3, 1);
+    // What is left below the kernel half is the private PDP and PD made by vmm_clone_table
+    uint64_t *pdp = entry_table(pml4[0]);
+    pmm_free_page(entry_table(pdp[0]));
+    pmm_free_page(pdp);
+    pmm_free_page(pml4);
 }
 
 // Map a page in a DIFFERENT page table (specified by target_cr3) without switching CR3
@@ -147,48 +689,174 @@ uint64_t vmm_clone_table(uint64_t src_cr3) {
 int vmm_map_page_in_table(uint64_t target_cr3, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
     // We'll walk the target page table using physical addresses
     // Since the kernel has identity mapping in low memory, we can access physical addresses directly
-    
-    uint64_t *pml4 = (uint64_t *)(uintptr_t)target_cr3;
-    
-    // Get or create PDP
-    size_t i4 = idx_pml4(vaddr);
-    uint64_t *pdp;
-    if (pml4[i4] & VMM_PFLAG_PRESENT) {
-        pml4[i4] |= (VMM_PFLAG_USER | VMM_PFLAG_WRITE);
-        pdp = (uint64_t *)(uintptr_t)(pml4[i4] & ENTRY_ADDR_MASK);
-    } else {
-        pdp = alloc_table();
-        if (!pdp) return -1;
-        pml4[i4] = ((uint64_t)(uintptr_t)pdp & ENTRY_ADDR_MASK) | VMM_PFLAG_PRESENT | VMM_PFLAG_WRITE | VMM_PFLAG_USER;
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)(target_cr3 & ENTRY_ADDR_MASK);
+    vmm_gather_t g;
+    gather_init(&g, (target_cr3 & ENTRY_ADDR_MASK) == (vmm_get_cr3() & ENTRY_ADDR_MASK), 0);
+    int r = map_leaf(pml4, vaddr, paddr, PAGE_4K, flags, &g);
+    gather_flush(&g);
+    return r;
+}
+
+// Share the user leaves under `tbl` (level 4 = PML4 ... 1 = PT) mapping va_base onwards with dst
+static int cow_share_level(uint64_t *dst, uint64_t *tbl, int level, uint64_t va_base, vmm_gather_t *g) {
+    uint64_t span = PAGE_4K << (9 * (level - 1));
+    // Only the lower half holds user mappings
+    int count = (level == 4) ? ENTRIES_PER_TABLE / 2 : ENTRIES_PER_TABLE;
+    for (int i = 0; i < count; ++i) {
+        uint64_t *e = &tbl[i];
+        uint64_t va = va_base + (uint64_t)i * span;
+        if (!(*e & VMM_PFLAG_PRESENT)) continue;
+        if (level > 1 && !(*e & VMM_PFLAG_HUGE)) {
+            if (cow_share_level(dst, entry_table(*e), level - 1, va, g) != 0) return -1;
+            continue;
+        }
+        if (!(*e & VMM_PFLAG_USER)) continue;
+        if (level > 1) {
+            // Reference counts are kept per 4 KiB frame, so large user leaves are broken down
+            uint64_t *sub = split_large(e, level);
+            if (!sub || cow_share_level(dst, sub, level - 1, va, g) != 0) return -1;
+            continue;
+        }
+        if (*e & VMM_PFLAG_WRITE) *e = (*e & ~VMM_PFLAG_WRITE) | VMM_PFLAG_COW;
+        uint64_t pa = *e & ENTRY_ADDR_MASK;
+        if (map_leaf(dst, va, pa, PAGE_4K, *e & LEAF_FLAGS_MASK, g) != 0) return -1;
+        pmm_page_ref((void *)(uintptr_t)pa);
+        cow_shared_count++;
     }
-    
-    // Get or create PD
-    size_t i3 = idx_pdp(vaddr);
-    uint64_t *pd;
-    if (pdp[i3] & VMM_PFLAG_PRESENT) {
-        pdp[i3] |= (VMM_PFLAG_USER | VMM_PFLAG_WRITE);
-        pd = (uint64_t *)(uintptr_t)(pdp[i3] & ENTRY_ADDR_MASK);
-    } else {
-        pd = alloc_table();
-        if (!pd) return -1;
-        pdp[i3] = ((uint64_t)(uintptr_t)pd & ENTRY_ADDR_MASK) | VMM_PFLAG_PRESENT | VMM_PFLAG_WRITE | VMM_PFLAG_USER;
+    return 0;
+}
+
+int vmm_cow_share(uint64_t dst_cr3, uint64_t src_cr3) {
+    uint64_t *dst = (uint64_t *)(uintptr_t)(dst_cr3 & ENTRY_ADDR_MASK);
+    uint64_t *src = (uint64_t *)(uintptr_t)(src_cr3 & ENTRY_ADDR_MASK);
+    // dst is never the live table; only 4 KiB leaves go in, so no page-table page is dropped
+    vmm_gather_t g;
+    gather_init(&g, 0, 0);
+    int r = cow_share_level(dst, src, 4, 0, &g);
+    gather_flush(&g);
+    // The source may still cache writable translations of pages that are now read-only
+    if ((src_cr3 & ENTRY_ADDR_MASK) == (vmm_get_cr3() & ENTRY_ADDR_MASK)) {
+        flush_tlb_local();
+    } else if (pcid_enabled) {
+        flush_all_pcids();
+        full_flush_count++;
     }
-    
-    // Get or create PT
-    size_t i2 = idx_pd(vaddr);
-    uint64_t *pt;
-    if (pd[i2] & VMM_PFLAG_PRESENT) {
-        pd[i2] |= (VMM_PFLAG_USER | VMM_PFLAG_WRITE);
-        pt = (uint64_t *)(uintptr_t)(pd[i2] & ENTRY_ADDR_MASK);
+    return r;
+}
+
+int vmm_cow_fault(uint64_t target_cr3, uint64_t va) {
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)(target_cr3 & ENTRY_ADDR_MASK);
+    uint64_t size = PAGE_4K;
+    uint64_t *e = find_leaf(pml4, va, &size);
+    if (!e || size != PAGE_4K || !(*e & VMM_PFLAG_COW)) return -1;
+    void *frame = (void *)(uintptr_t)(*e & ENTRY_ADDR_MASK);
+    uint64_t flags = (*e & LEAF_FLAGS_MASK & ~VMM_PFLAG_COW) | VMM_PFLAG_WRITE;
+    if (pmm_page_refcount(frame) > 1) {
+        void *copy = pmm_alloc_page();
+        if (!copy) return -1;
+        const uint64_t *from = (const uint64_t *)frame;
+        uint64_t *to = (uint64_t *)copy;
+        for (int i = 0; i < ENTRIES_PER_TABLE; ++i) to[i] = from[i];
+        *e = ((uint64_t)(uintptr_t)copy & ENTRY_ADDR_MASK) | flags;
+        pmm_free_page(frame);   // drops this address space's share
+        cow_copy_count++;
     } else {
-        pt = alloc_table();
-        if (!pt) return -1;
-        pd[i2] = ((uint64_t)(uintptr_t)pt & ENTRY_ADDR_MASK) | VMM_PFLAG_PRESENT | VMM_PFLAG_WRITE | VMM_PFLAG_USER;
+        // Every other owner already copied or went away: the frame is ours again
+        *e = ((uint64_t)(uintptr_t)frame & ENTRY_ADDR_MASK) | flags;
+        cow_reuse_count++;
     }
-    
-    // Set the leaf PTE
-    size_t i1 = idx_pt(vaddr);
-    pt[i1] = (paddr & ENTRY_ADDR_MASK) | (flags & 0xFFF) | VMM_PFLAG_PRESENT;
-    
+    if ((target_cr3 & ENTRY_ADDR_MASK) == (vmm_get_cr3() & ENTRY_ADDR_MASK)) invlpg(va & ~(PAGE_4K - 1));
+    else if (pcid_enabled) flush_all_pcids();
     return 0;
 }
+
+// Read one byte from each page of the working set so every switch pays for its TLB misses
+static void touch_pages(volatile uint8_t *buf, uint32_t pages) {
+    for (uint32_t i = 0; i < pages; ++i) (void)buf[(uint64_t)i * PAGE_4K];
+}
+
+// Set or clear the Global bit on the leaves mapping `pages` pages from va
+static void set_global(uint64_t *pml4, uint64_t va, uint32_t pages, int on) {
+    for (uint32_t i = 0; i < pages; ++i) {
+        uint64_t size = PAGE_4K;
+        uint64_t *e = find_leaf(pml4, va + (uint64_t)i * PAGE_4K, &size);
+        if (!e) continue;
+        if (on) *e |= VMM_PFLAG_GLOBAL;
+        else *e &= ~VMM_PFLAG_GLOBAL;
+    }
+}
+
+void vmm_cr3_benchmark(uint32_t iterations, uint32_t pages, vmm_cr3_bench_t *out) {
+    memset_k(out, 0, sizeof(*out));
+    uint64_t kernel_cr3 = vmm_get_cr3();
+    // Only meaningful from the kernel address space (PCID 0)
+    if (iterations == 0 || (kernel_cr3 & 0xFFF)) return;
+    kernel_cr3 &= ENTRY_ADDR_MASK;
+    volatile uint8_t *buf = (volatile uint8_t *)kmalloc((size_t)pages * PAGE_4K);
+    if (!buf) return;
+    // A second address space sharing every kernel table (heap included), so code and stack stay mapped
+    uint64_t *other = alloc_table();
+    if (!other) {
+        kfree((void *)buf);
+        return;
+    }
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)kernel_cr3;
+    for (int i = 0; i < ENTRIES_PER_TABLE; ++i) other[i] = pml4[i];
+    uint64_t other_cr3 = (uint64_t)(uintptr_t)other;
+    touch_pages(buf, pages);
+
+    uint64_t rflags = irq_save();
+
+    // Plain CR3 writes: every switch flushes the non-global TLB
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        vmm_set_cr3(other_cr3);
+        touch_pages(buf, pages);
+        vmm_set_cr3(kernel_cr3);
+        touch_pages(buf, pages);
+    }
+    out->flush_cycles = (rdtsc() - t0) / iterations;
+
+    if (pge_enabled) {
+        // Same loop with the working set made non-global: every switch has to walk for it again
+        set_global(pml4, (uint64_t)(uintptr_t)buf, pages, 0);
+        flush_all_pcids();
+        t0 = rdtsc();
+        for (uint32_t i = 0; i < iterations; ++i) {
+            vmm_set_cr3(other_cr3);
+            touch_pages(buf, pages);
+            vmm_set_cr3(kernel_cr3);
+            touch_pages(buf, pages);
+        }
+        out->nonglobal_cycles = (rdtsc() - t0) / iterations;
+        set_global(pml4, (uint64_t)(uintptr_t)buf, pages, 1);
+        flush_all_pcids();
+    }
+
+    if (pcid_enabled) {
+        // Tagged switches: the other space borrows the last PCID; both sides keep their entries
+        uint64_t other_tagged = other_cr3 | PCID_MAX;
+        vmm_set_cr3(other_tagged);
+        vmm_set_cr3(kernel_cr3);
+        t0 = rdtsc();
+        for (uint32_t i = 0; i < iterations; ++i) {
+            vmm_set_cr3(other_tagged | VMM_CR3_NOFLUSH);
+            touch_pages(buf, pages);
+            vmm_set_cr3(kernel_cr3 | VMM_CR3_NOFLUSH);
+            touch_pages(buf, pages);
+        }
+        out->pcid_cycles = (rdtsc() - t0) / iterations;
+        // The borrowed tag may belong to a live process: start a new generation so nobody reuses it stale
+        pcid_generation++;
+        pcid_next = 1;
+        flush_all_pcids();
+        out->pcid_enabled = 1;
+    }
+
+    vmm_set_cr3(kernel_cr3);
+    irq_restore(rflags);
+    out->iterations = iterations;
+    out->pages = pages;
+    kfree((void *)buf);
+    pmm_free_page(other);
+}